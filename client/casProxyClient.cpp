@@ -0,0 +1,563 @@
+#include "casProxyClient.h"
+
+namespace casproxy {
+
+namespace {
+
+constexpr auto minReconnectDelay = std::chrono::milliseconds(100);
+constexpr auto maxReconnectDelay = std::chrono::milliseconds(10000);
+constexpr auto healthCheckInterval = std::chrono::seconds(1);
+constexpr uint32_t maxPacketLength = 1024 * 100;
+
+std::vector<uint8_t> packRequest(const RequestBase& req, Encoding encoding) {
+    StreamWriter writer(encoding);
+    req.pack(writer);
+    return makeFrame(writer.buffer, encoding);
+}
+
+}
+
+ClientConnection::ClientConnection(asio::io_context& io_context, const ClientOptions& options)
+    : io_context(io_context), options(options), socket(io_context), resolver(io_context),
+    reconnectTimer(io_context), healthTimer(io_context), reconnectDelay(minReconnectDelay),
+    requestEncoding(options.compact ? Encoding::Compact : Encoding::V1) {
+}
+
+void ClientConnection::start() {
+    auto self = shared_from_this();
+    asio::post(io_context, [this, self] {
+        connect();
+        startHealthCheck();
+    });
+}
+
+void ClientConnection::stop() {
+    auto self = shared_from_this();
+    asio::post(io_context, [this, self] {
+        stopped = true;
+        ready = false;
+        std::error_code ignored;
+        socket.close(ignored);
+        resolver.cancel();
+        reconnectTimer.cancel();
+        healthTimer.cancel();
+        shm.reset();
+        sendQueue.clear();
+        queued.clear();
+        sessionRequests.clear();
+
+        auto requests = std::move(pendingRequests);
+        pendingRequests.clear();
+        for (auto& [packetId, request] : requests) {
+            --pending;
+            request.onResponse(nullptr);
+        }
+    });
+}
+
+void ClientConnection::send(RequestBase& req, ResponseHandler onResponse, uint64_t epoch) {
+    uint32_t packetId = nextPacketId++;
+    if (packetId == 0) {
+        packetId = nextPacketId++;
+    }
+    req.packetId = packetId;
+    auto packet = packRequest(req, requestEncoding);
+    ++pending;
+
+    // Packing happens on the caller's thread; only the bookkeeping is
+    // handed to the I/O thread.
+    auto self = shared_from_this();
+    asio::post(io_context, [this, self, packetId, packet = std::move(packet), onResponse = std::move(onResponse), epoch]() mutable {
+        enqueue(packetId, std::move(packet), std::move(onResponse), epoch);
+    });
+}
+
+void ClientConnection::enqueue(uint32_t packetId, std::vector<uint8_t> packet, ResponseHandler onResponse, uint64_t epoch) {
+    if (stopped || (epoch && epoch != this->epoch)) {
+        --pending;
+        onResponse(nullptr);
+        return;
+    }
+
+    auto& request = pendingRequests[packetId];
+    request.onResponse = std::move(onResponse);
+    request.queuedAt = std::chrono::steady_clock::now();
+    request.epoch = epoch;
+    if (!ready) {
+        queued.push_back({ packetId, std::move(packet) });
+        return;
+    }
+
+    request.sent = true;
+    sendQueue.push_back(std::move(packet));
+    if (sendQueue.size() < 2) {
+        doWrite();
+    }
+}
+
+void ClientConnection::connect() {
+    auto self = shared_from_this();
+    resolver.async_resolve(options.host, std::to_string(options.port),
+        [this, self](std::error_code ec, asio::ip::tcp::resolver::results_type results) {
+            if (stopped) {
+                return;
+            }
+            if (ec) {
+                scheduleReconnect();
+                return;
+            }
+
+            asio::async_connect(socket, results,
+                [this, self](std::error_code ec, const asio::ip::tcp::endpoint&) {
+                    if (stopped) {
+                        return;
+                    }
+                    if (ec) {
+                        scheduleReconnect();
+                        return;
+                    }
+
+                    socket.set_option(asio::ip::tcp::no_delay(true));
+                    encoding = Encoding::V1;
+                    capabilities = 0;
+                    doRead();
+                    if (options.compact || options.serverTiming || options.keepalive) {
+                        sayHello();
+                    }
+                    else {
+                        attachSharedMemory();
+                    }
+                }
+            );
+        }
+    );
+}
+
+void ClientConnection::sayHello() {
+    HelloRequest req;
+    req.capabilities = (options.compact ? CapabilityCompactEncoding : 0) | (options.serverTiming ? CapabilityServerTiming : 0)
+        | (options.keepalive ? CapabilityKeepalive : 0);
+    writeSessionRequest(req, [this](std::shared_ptr<ResponseBase> res) {
+        // Queued requests are already packed compact, so a server that does
+        // not grant it cannot serve them.
+        auto helloRes = std::dynamic_pointer_cast<HelloResponse>(res);
+        if (!helloRes || helloRes->apiReturn != SCARD_S_SUCCESS
+            || (options.compact && !(helloRes->capabilities & CapabilityCompactEncoding))) {
+            reset();
+            return;
+        }
+
+        encoding = requestEncoding;
+        capabilities = helloRes->capabilities;
+        attachSharedMemory();
+    });
+}
+
+void ClientConnection::attachSharedMemory() {
+    if (!options.sharedMemory || shmFailed) {
+        startSession();
+        return;
+    }
+
+    ShmAttachRequest req;
+    writeSessionRequest(req, [this](std::shared_ptr<ResponseBase> res) {
+        auto attachRes = std::dynamic_pointer_cast<ShmAttachResponse>(res);
+        if (!attachRes || attachRes->apiReturn != SCARD_S_SUCCESS) {
+            startSession();
+            return;
+        }
+
+        // The server has already moved over, so the connection has to start
+        // again, on the socket this time.
+        shm = ShmTransport::open(attachRes->name);
+        if (!shm) {
+            shmFailed = true;
+            reset();
+            return;
+        }
+
+        // The transport is owned by the connection, so its handlers must not
+        // keep the connection alive.
+        std::weak_ptr<ClientConnection> weak = shared_from_this();
+        uint64_t generation = ++shmGeneration;
+        auto current = [weak, generation]() -> std::shared_ptr<ClientConnection> {
+            auto self = weak.lock();
+            return self && self->shm && self->shmGeneration == generation ? self : nullptr;
+        };
+        shm->start(
+            [this, current](std::vector<std::vector<uint8_t>>&& frames) {
+                asio::post(io_context, [current, frames = std::move(frames)]() mutable {
+                    for (auto& frame : frames) {
+                        auto self = current();
+                        if (!self) {
+                            return;
+                        }
+                        self->packetData = std::move(frame);
+                        self->handlePacket();
+                    }
+                });
+            },
+            [this, current] {
+                asio::post(io_context, [current] {
+                    if (auto self = current()) {
+                        self->writeShm();
+                    }
+                });
+            },
+            [this, current] {
+                asio::post(io_context, [current] {
+                    if (auto self = current()) {
+                        self->reset();
+                    }
+                });
+            }
+        );
+        startSession();
+    });
+}
+
+void ClientConnection::startSession() {
+    if (!resumeToken.empty()) {
+        SessionResumeRequest req;
+        req.token = resumeToken;
+        writeSessionRequest(req, [this](std::shared_ptr<ResponseBase> res) {
+            auto resumeRes = std::dynamic_pointer_cast<SessionResumeResponse>(res);
+            if (resumeRes && resumeRes->apiReturn == SCARD_S_SUCCESS) {
+                resumeToken = resumeRes->token;
+                sessionEstablished(epoch);
+                return;
+            }
+
+            // The server no longer holds the session; start a new one.
+            resumeToken.clear();
+            startSession();
+        });
+        return;
+    }
+
+    SessionStartRequest req;
+    writeSessionRequest(req, [this](std::shared_ptr<ResponseBase> res) {
+        // A server without session resumption still serves the connection,
+        // it just cannot be resumed.
+        auto startRes = std::dynamic_pointer_cast<SessionStartResponse>(res);
+        if (startRes && startRes->apiReturn == SCARD_S_SUCCESS) {
+            resumeToken = startRes->token;
+        }
+        sessionEstablished(epoch + 1);
+    });
+}
+
+void ClientConnection::sessionEstablished(uint64_t newEpoch) {
+    epoch = newEpoch;
+    ready = true;
+    reconnectDelay = minReconnectDelay;
+    flushQueued();
+}
+
+void ClientConnection::doRead() {
+    if (encoding == Encoding::Compact) {
+        readCompactHeader();
+        return;
+    }
+
+    auto self = shared_from_this();
+    asio::async_read(socket, asio::buffer(&packetLength, 4),
+        [this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                reset();
+                return;
+            }
+
+            packetLength = swapEndian32(packetLength);
+            if (packetLength > maxPacketLength) {
+                reset();
+                return;
+            }
+            readPacketData();
+        }
+    );
+}
+
+void ClientConnection::readCompactHeader() {
+    auto self = shared_from_this();
+    asio::async_read(socket, asio::buffer(compactHeader),
+        [this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                reset();
+                return;
+            }
+
+            size_t prefixSize = readCompactLength(compactHeader.data(), packetLength);
+            size_t headSize = compactHeader.size() - prefixSize;
+            if (prefixSize == 0 || packetLength < headSize || packetLength > maxPacketLength) {
+                reset();
+                return;
+            }
+            readPacketData(compactHeader.data() + prefixSize, headSize);
+        }
+    );
+}
+
+void ClientConnection::readPacketData(const uint8_t* head, size_t headSize) {
+    packetData.resize(packetLength);
+    if (headSize > 0) {
+        memcpy(packetData.data(), head, headSize);
+    }
+
+    auto self = shared_from_this();
+    asio::async_read(socket, asio::buffer(packetData.data() + headSize, packetLength - headSize),
+        [this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                reset();
+                return;
+            }
+
+            handlePacket();
+            if (socket.is_open()) {
+                doRead();
+            }
+        }
+    );
+}
+
+void ClientConnection::handlePacket() {
+    StreamReader reader(packetData, encoding);
+
+    uint32_t packetId, resultCode, opcodeValue;
+    if (!reader.readBe(packetId) || !reader.readBe(resultCode) || !reader.readBe(opcodeValue)) {
+        reset();
+        return;
+    }
+
+    auto res = ResponseFactory::create(static_cast<Opcode>(opcodeValue));
+    if (!res || !res->unpack(packetId, resultCode, reader)
+        || ((capabilities & CapabilityServerTiming) && !res->timing.unpack(reader))) {
+        reset();
+        return;
+    }
+
+    // A keepalive of the server, answered ahead of anything else queued.
+    if (packetId == 0 && static_cast<Opcode>(opcodeValue) == Opcode::PingRes) {
+        PingRequest req;
+        req.packetId = 0;
+        req.nonce = std::static_pointer_cast<PingResponse>(res)->nonce;
+        sendQueue.push_back(packRequest(req, encoding));
+        if (sendQueue.size() < 2) {
+            doWrite();
+        }
+        return;
+    }
+
+    if (auto it = sessionRequests.find(packetId); it != sessionRequests.end()) {
+        auto onResponse = std::move(it->second);
+        sessionRequests.erase(it);
+        onResponse(res);
+        return;
+    }
+
+    auto it = pendingRequests.find(packetId);
+    if (it == pendingRequests.end()) {
+        return;
+    }
+
+    auto onResponse = std::move(it->second.onResponse);
+    pendingRequests.erase(it);
+    --pending;
+    onResponse(res);
+}
+
+void ClientConnection::writeSessionRequest(RequestBase& req, std::function<void(std::shared_ptr<ResponseBase>)> onResponse) {
+    uint32_t packetId = nextPacketId++;
+    if (packetId == 0) {
+        packetId = nextPacketId++;
+    }
+    req.packetId = packetId;
+
+    sessionRequests[packetId] = std::move(onResponse);
+    sendQueue.push_back(packRequest(req, encoding));
+    if (sendQueue.size() < 2) {
+        doWrite();
+    }
+}
+
+void ClientConnection::flushQueued() {
+    bool writing = !sendQueue.empty();
+    auto packets = std::move(queued);
+    queued.clear();
+    for (auto& packet : packets) {
+        auto it = pendingRequests.find(packet.packetId);
+        if (it == pendingRequests.end()) {
+            continue;
+        }
+        if (it->second.epoch && it->second.epoch != epoch) {
+            fail(packet.packetId);
+            continue;
+        }
+
+        it->second.sent = true;
+        sendQueue.push_back(std::move(packet.data));
+    }
+
+    if (!writing) {
+        doWrite();
+    }
+}
+
+void ClientConnection::doWrite() {
+    if (shm) {
+        writeShm();
+        return;
+    }
+    if (sendQueue.empty()) {
+        return;
+    }
+
+    auto self = shared_from_this();
+    asio::async_write(socket, asio::buffer(sendQueue.front()),
+        [this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                reset();
+                return;
+            }
+
+            sendQueue.pop_front();
+            doWrite();
+        }
+    );
+}
+
+void ClientConnection::writeShm() {
+    // Frames in shared memory go without their length prefix.
+    while (!sendQueue.empty()) {
+        const auto& frame = sendQueue.front();
+        size_t prefixSize = framePrefixSize(frame, encoding);
+        if (!shm->write(frame.data() + prefixSize, frame.size() - prefixSize)) {
+            return;
+        }
+        sendQueue.pop_front();
+    }
+}
+
+void ClientConnection::fail(uint32_t packetId) {
+    auto it = pendingRequests.find(packetId);
+    if (it == pendingRequests.end()) {
+        return;
+    }
+
+    auto onResponse = std::move(it->second.onResponse);
+    pendingRequests.erase(it);
+    --pending;
+    onResponse(nullptr);
+}
+
+void ClientConnection::reset() {
+    if (stopped || !socket.is_open()) {
+        return;
+    }
+
+    std::error_code ignored;
+    socket.close(ignored);
+    shm.reset();
+    ready = false;
+    sendQueue.clear();
+    sessionRequests.clear();
+
+    // Whatever was sent may or may not have run, so it fails; what was
+    // still queued goes out once the session is back.
+    std::vector<uint32_t> sent;
+    for (const auto& [packetId, request] : pendingRequests) {
+        if (request.sent) {
+            sent.push_back(packetId);
+        }
+    }
+    for (uint32_t packetId : sent) {
+        fail(packetId);
+    }
+
+    scheduleReconnect();
+}
+
+void ClientConnection::scheduleReconnect() {
+    if (socket.is_open()) {
+        std::error_code ignored;
+        socket.close(ignored);
+    }
+
+    auto self = shared_from_this();
+    reconnectTimer.expires_after(reconnectDelay);
+    reconnectTimer.async_wait([this, self](std::error_code ec) {
+        if (!ec && !stopped) {
+            connect();
+        }
+    });
+    reconnectDelay = std::min<std::chrono::milliseconds>(reconnectDelay * 2, maxReconnectDelay);
+}
+
+void ClientConnection::startHealthCheck() {
+    auto self = shared_from_this();
+    healthTimer.expires_after(healthCheckInterval);
+    healthTimer.async_wait([this, self](std::error_code ec) {
+        if (ec || stopped) {
+            return;
+        }
+
+        checkHealth();
+        startHealthCheck();
+    });
+}
+
+void ClientConnection::checkHealth() {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<uint32_t> expired;
+    for (const auto& [packetId, request] : pendingRequests) {
+        if (now - request.queuedAt <= options.requestTimeout) {
+            continue;
+        }
+        if (request.sent) {
+            reset();
+            return;
+        }
+        expired.push_back(packetId);
+    }
+
+    for (uint32_t packetId : expired) {
+        fail(packetId);
+    }
+}
+
+Client::Client(asio::io_context& io_context, ClientOptions options) : options(std::move(options)) {
+    for (size_t i = 0; i < std::max<size_t>(this->options.connections, 1); ++i) {
+        connections.push_back(std::make_shared<ClientConnection>(io_context, this->options));
+    }
+}
+
+Client::~Client() {
+    stop();
+}
+
+void Client::start() {
+    for (const auto& connection : connections) {
+        connection->start();
+    }
+}
+
+void Client::stop() {
+    for (const auto& connection : connections) {
+        connection->stop();
+    }
+}
+
+size_t Client::pickConnection() const {
+    size_t best = 0;
+    bool bestReady = false;
+    for (size_t i = 0; i < connections.size(); ++i) {
+        bool ready = connections[i]->isReady();
+        if ((ready && !bestReady) || (ready == bestReady && connections[i]->pendingCount() < connections[best]->pendingCount())) {
+            best = i;
+            bestReady = ready;
+        }
+    }
+    return best;
+}
+
+}
@@ -0,0 +1,177 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <functional>
+#include <asio.hpp>
+#include "casProxy.h"
+#include "shmTransport.h"
+
+namespace casproxy {
+
+struct ClientOptions {
+    std::string host;
+    uint16_t port{ 24000 };
+    size_t connections{ 2 };
+    // A request without a response after this long fails; one already sent
+    // also drops its connection, since a reply may still be on the way.
+    std::chrono::seconds requestTimeout{ 10 };
+    // Negotiate the compact encoding. Needs a server of protocol version 2;
+    // older ones drop the connection.
+    bool compact{ false };
+    // Ask for a ServerTiming trailer on every response, left in
+    // ResponseBase::timing. Also needs a server of protocol version 2; one
+    // that does not grant it leaves the timing zero.
+    bool serverTiming{ false };
+    // Answer the pings a server with keepalives sends on a quiet
+    // connection, so that it does not take the connection for dead.
+    bool keepalive{ false };
+    // Move each connection to shared memory if the server runs on the same
+    // host and allows it (sharedMemory). Linux only; elsewhere, or when the
+    // server declines, the socket is used.
+    bool sharedMemory{ false };
+};
+
+// One pipelined connection to a casproxyserver. Any number of requests may
+// be in flight; responses are matched back by packet id.
+//
+// The connection keeps a session resume token, so after a reconnect the
+// contexts and card handles opened on it are taken over if the server still
+// holds them. If it does not, the epoch changes and handles from before are
+// gone. Requests made while the connection is down are held until it is up
+// again, and failed if they were bound to an epoch that has since ended.
+//
+// send() may be called from any thread; handlers run on the io_context.
+class ClientConnection : public std::enable_shared_from_this<ClientConnection> {
+public:
+    using ResponseHandler = std::function<void(std::shared_ptr<ResponseBase>)>;
+
+    ClientConnection(asio::io_context& io_context, const ClientOptions& options);
+    void start();
+    void stop();
+    // The handler is called with nullptr if the request fails before a
+    // response arrives. An epoch of 0 binds the request to none.
+    void send(RequestBase& req, ResponseHandler onResponse, uint64_t epoch = 0);
+    bool isReady() const { return ready; }
+    size_t pendingCount() const { return pending; }
+    // Starts at 1 with the first session and changes whenever a new session
+    // replaces one that could not be resumed.
+    uint64_t getEpoch() const { return epoch; }
+
+private:
+    struct PendingRequest {
+        ResponseHandler onResponse;
+        std::chrono::steady_clock::time_point queuedAt;
+        uint64_t epoch;
+        bool sent{ false };
+    };
+
+    struct QueuedPacket {
+        uint32_t packetId;
+        std::vector<uint8_t> data;
+    };
+
+    void enqueue(uint32_t packetId, std::vector<uint8_t> packet, ResponseHandler onResponse, uint64_t epoch);
+    void connect();
+    void sayHello();
+    void attachSharedMemory();
+    void startSession();
+    void sessionEstablished(uint64_t newEpoch);
+    void doRead();
+    void readCompactHeader();
+    void readPacketData(const uint8_t* head = nullptr, size_t headSize = 0);
+    void handlePacket();
+    void writeSessionRequest(RequestBase& req, std::function<void(std::shared_ptr<ResponseBase>)> onResponse);
+    void flushQueued();
+    void doWrite();
+    void writeShm();
+    void fail(uint32_t packetId);
+    void reset();
+    void scheduleReconnect();
+    void startHealthCheck();
+    void checkHealth();
+
+    asio::io_context& io_context;
+    ClientOptions options;
+    asio::ip::tcp::socket socket;
+    asio::ip::tcp::resolver resolver;
+    asio::steady_timer reconnectTimer;
+    asio::steady_timer healthTimer;
+    std::chrono::milliseconds reconnectDelay;
+    std::atomic<bool> ready{ false };
+    std::atomic<size_t> pending{ 0 };
+    std::atomic<uint64_t> epoch{ 0 };
+    std::atomic<uint32_t> nextPacketId{ 1 };
+    bool stopped{ false };
+    std::vector<uint8_t> resumeToken;
+    // Requests are packed for the encoding asked for in options, responses
+    // read in the one in effect on the wire.
+    Encoding requestEncoding;
+    Encoding encoding{ Encoding::V1 };
+    uint32_t capabilities{ 0 };
+    std::unique_ptr<ShmTransport> shm;
+    // Tells frames of a transport that has been replaced from current ones.
+    uint64_t shmGeneration{ 0 };
+    // The server offered shared memory that could not be opened.
+    bool shmFailed{ false };
+    uint32_t packetLength{ 0 };
+    std::array<uint8_t, compactHeaderSize> compactHeader;
+    std::vector<uint8_t> packetData;
+    std::map<uint32_t, PendingRequest> pendingRequests;
+    std::map<uint32_t, ResponseHandler> sessionRequests;
+    // Requests waiting for the session, in order.
+    std::deque<QueuedPacket> queued;
+    std::deque<std::vector<uint8_t>> sendQueue;
+
+};
+
+// A pool of pipelined connections to one casproxyserver. Contexts and card
+// handles belong to the connection they were opened on, so a caller picks a
+// connection when establishing a context and keeps using it for everything
+// derived from that context.
+class Client {
+public:
+    Client(asio::io_context& io_context, ClientOptions options);
+    ~Client();
+    void start();
+    void stop();
+    size_t size() const { return connections.size(); }
+    // The ready connection with the fewest requests in flight, or any
+    // connection if none is ready.
+    size_t pickConnection() const;
+    ClientConnection& connection(size_t index) { return *connections.at(index); }
+
+    template<typename Response>
+    void send(size_t index, RequestBase& req, std::function<void(std::shared_ptr<Response>)> onResponse, uint64_t epoch = 0) {
+        connection(index).send(req, [onResponse](std::shared_ptr<ResponseBase> res) {
+            onResponse(std::dynamic_pointer_cast<Response>(res));
+        }, epoch);
+    }
+
+    // Blocks until the response arrives, so never call it on the thread
+    // running the io_context.
+    template<typename Response>
+    std::shared_ptr<Response> call(size_t index, RequestBase& req, uint64_t epoch = 0) {
+        auto promise = std::make_shared<std::promise<std::shared_ptr<Response>>>();
+        auto future = promise->get_future();
+        send<Response>(index, req, [promise](std::shared_ptr<Response> res) {
+            promise->set_value(std::move(res));
+        }, epoch);
+        return future.get();
+    }
+
+private:
+    ClientOptions options;
+    std::vector<std::shared_ptr<ClientConnection>> connections;
+
+};
+
+}
@@ -0,0 +1,468 @@
+// A PC/SC library that sends the calls of an unmodified application to a
+// casproxyserver. Calls from different application threads share a pool of
+// pipelined connections instead of waiting for each other.
+//
+//   CASPROXY_SERVER=host:port  server to use, 127.0.0.1:24000 by default
+//   CASPROXY_CONNECTIONS=n     connections in the pool, 2 by default
+//   CASPROXY_COMPACT=1         use the compact encoding (protocol version 2)
+//   CASPROXY_SHM=1             use shared memory with a server on this host
+//   CASPROXY_KEEPALIVE=1       answer the keepalive pings of the server
+//
+// Load it in place of libpcsclite, e.g. with LD_PRELOAD. SCardGetStatusChange,
+// SCardControl, SCardReconnect and the reader group calls have no
+// counterpart in the protocol and return SCARD_E_UNSUPPORTED_FEATURE.
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <optional>
+#include <winscard.h>
+#include <reader.h>
+#include "casProxyClient.h"
+
+const SCARD_IO_REQUEST g_rgSCardT0Pci = { SCARD_PROTOCOL_T0, sizeof(SCARD_IO_REQUEST) };
+const SCARD_IO_REQUEST g_rgSCardT1Pci = { SCARD_PROTOCOL_T1, sizeof(SCARD_IO_REQUEST) };
+const SCARD_IO_REQUEST g_rgSCardRawPci = { SCARD_PROTOCOL_RAW, sizeof(SCARD_IO_REQUEST) };
+
+namespace {
+
+constexpr uint32_t readersLengthHint = 4096;
+
+// Contexts and card handles given to the application carry the connection
+// they were opened on and its epoch next to the server's handle:
+//   bits 56-62  connection index + 1
+//   bits 32-55  epoch
+//   bits 0-31   server handle, which the server keeps within 32 bits
+//               (slot index and generation) so none of it is lost
+struct Handle {
+    size_t connection;
+    uint64_t epoch;
+    uint64_t remote;
+};
+
+uint64_t encodeHandle(size_t connection, uint64_t epoch, uint64_t remote) {
+    return (static_cast<uint64_t>(connection + 1) << 56) | ((epoch & 0xFFFFFF) << 32) | (remote & 0xFFFFFFFF);
+}
+
+struct CardInfo {
+    std::string readerName;
+    DWORD protocol;
+};
+
+class Shim {
+public:
+    Shim() : work(asio::make_work_guard(io_context)) {
+        casproxy::ClientOptions options;
+        options.host = "127.0.0.1";
+        if (const char* server = std::getenv("CASPROXY_SERVER")) {
+            if (auto address = casproxy::parseAddress(server)) {
+                options.host = address->first;
+                options.port = address->second;
+            }
+        }
+        if (const char* connections = std::getenv("CASPROXY_CONNECTIONS")) {
+            options.connections = std::max(1, std::atoi(connections));
+        }
+        if (const char* compact = std::getenv("CASPROXY_COMPACT")) {
+            options.compact = std::atoi(compact) != 0;
+        }
+        if (const char* keepalive = std::getenv("CASPROXY_KEEPALIVE")) {
+            options.keepalive = std::atoi(keepalive) != 0;
+        }
+        if (const char* sharedMemory = std::getenv("CASPROXY_SHM")) {
+            options.sharedMemory = std::atoi(sharedMemory) != 0;
+        }
+
+        client = std::make_unique<casproxy::Client>(io_context, options);
+        client->start();
+        thread = std::thread([this] { io_context.run(); });
+    }
+
+    ~Shim() {
+        client->stop();
+        work.reset();
+        thread.join();
+    }
+
+    std::optional<Handle> decode(uint64_t value) const {
+        size_t connection = static_cast<size_t>((value >> 56) & 0x7F);
+        if (connection == 0 || connection > client->size()) {
+            return std::nullopt;
+        }
+
+        Handle handle{ connection - 1, (value >> 32) & 0xFFFFFF, value & 0xFFFFFFFF };
+        if (handle.epoch != (client->connection(handle.connection).getEpoch() & 0xFFFFFF)) {
+            return std::nullopt;
+        }
+        return handle;
+    }
+
+    template<typename Response>
+    std::shared_ptr<Response> call(const Handle& handle, casproxy::RequestBase& req) {
+        return client->call<Response>(handle.connection, req, client->connection(handle.connection).getEpoch());
+    }
+
+    casproxy::Client& getClient() { return *client; }
+
+    std::mutex mutex;
+    std::map<uint64_t, CardInfo> cards;
+
+private:
+    asio::io_context io_context;
+    asio::executor_work_guard<asio::io_context::executor_type> work;
+    std::unique_ptr<casproxy::Client> client;
+    std::thread thread;
+
+};
+
+Shim& shim() {
+    static Shim instance;
+    return instance;
+}
+
+uint32_t pciType(const SCARD_IO_REQUEST* pci) {
+    if (!pci) {
+        return 3;
+    }
+    switch (pci->dwProtocol) {
+    case SCARD_PROTOCOL_T0: return 0;
+    case SCARD_PROTOCOL_T1: return 1;
+    case SCARD_PROTOCOL_RAW: return 2;
+    default: return 3;
+    }
+}
+
+// Hands a result to the application the PC/SC way: a null buffer asks for
+// the length, SCARD_AUTOALLOCATE asks for a buffer released with
+// SCardFreeMemory.
+LONG copyOut(const uint8_t* data, size_t size, LPBYTE buffer, LPDWORD length) {
+    if (!length) {
+        return SCARD_E_INVALID_PARAMETER;
+    }
+    if (!buffer) {
+        *length = static_cast<DWORD>(size);
+        return SCARD_S_SUCCESS;
+    }
+    if (*length == SCARD_AUTOALLOCATE) {
+        auto* allocated = static_cast<uint8_t*>(std::malloc(size ? size : 1));
+        if (!allocated) {
+            return SCARD_E_NO_MEMORY;
+        }
+        memcpy(allocated, data, size);
+        *reinterpret_cast<uint8_t**>(buffer) = allocated;
+        *length = static_cast<DWORD>(size);
+        return SCARD_S_SUCCESS;
+    }
+    if (*length < size) {
+        *length = static_cast<DWORD>(size);
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(buffer, data, size);
+    *length = static_cast<DWORD>(size);
+    return SCARD_S_SUCCESS;
+}
+
+}
+
+LONG SCardEstablishContext(DWORD dwScope, LPCVOID, LPCVOID, LPSCARDCONTEXT phContext) {
+    if (!phContext) {
+        return SCARD_E_INVALID_PARAMETER;
+    }
+
+    auto& client = shim().getClient();
+    size_t connection = client.pickConnection();
+    uint64_t epoch = client.connection(connection).getEpoch();
+
+    casproxy::SCardEstablishContextRequest req;
+    req.dwScope = static_cast<uint32_t>(dwScope);
+    auto res = client.call<casproxy::SCardEstablishContextResponse>(connection, req, epoch);
+    if (!res) {
+        return SCARD_F_COMM_ERROR;
+    }
+    if (res->apiReturn == SCARD_S_SUCCESS) {
+        // A context requested before the first session knows its epoch only now.
+        if (epoch == 0) {
+            epoch = client.connection(connection).getEpoch();
+        }
+        *phContext = static_cast<SCARDCONTEXT>(encodeHandle(connection, epoch, res->hContext));
+    }
+    return static_cast<LONG>(res->apiReturn);
+}
+
+LONG SCardReleaseContext(SCARDCONTEXT hContext) {
+    auto handle = shim().decode(static_cast<uint64_t>(hContext));
+    if (!handle) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    casproxy::SCardReleaseContextRequest req;
+    req.hContext = handle->remote;
+    auto res = shim().call<casproxy::SCardReleaseContextResponse>(*handle, req);
+    return res ? static_cast<LONG>(res->apiReturn) : SCARD_F_COMM_ERROR;
+}
+
+LONG SCardIsValidContext(SCARDCONTEXT hContext) {
+    return shim().decode(static_cast<uint64_t>(hContext)) ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+}
+
+LONG SCardListReaders(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR mszReaders, LPDWORD pcchReaders) {
+    auto handle = shim().decode(static_cast<uint64_t>(hContext));
+    if (!handle) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    casproxy::SCardListReadersRequest req;
+    req.hContext = handle->remote;
+    req.isGroupsNull = mszGroups == nullptr;
+    if (mszGroups) {
+        req.groups = mszGroups;
+    }
+    req.readersLength = readersLengthHint;
+
+    auto res = shim().call<casproxy::SCardListReadersResponse>(*handle, req);
+    if (res && static_cast<LONG>(res->apiReturn) == SCARD_E_INSUFFICIENT_BUFFER) {
+        req.readersLength = res->readersLength;
+        res = shim().call<casproxy::SCardListReadersResponse>(*handle, req);
+    }
+    if (!res) {
+        return SCARD_F_COMM_ERROR;
+    }
+    if (res->apiReturn != SCARD_S_SUCCESS) {
+        return static_cast<LONG>(res->apiReturn);
+    }
+    return copyOut(res->readers.data(), res->readers.size(), reinterpret_cast<LPBYTE>(mszReaders), pcchReaders);
+}
+
+LONG SCardFreeMemory(SCARDCONTEXT, LPCVOID pvMem) {
+    std::free(const_cast<void*>(pvMem));
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardConnect(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareMode, DWORD dwPreferredProtocols,
+    LPSCARDHANDLE phCard, LPDWORD pdwActiveProtocol) {
+    auto handle = shim().decode(static_cast<uint64_t>(hContext));
+    if (!handle) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    if (!szReader || !phCard || !pdwActiveProtocol) {
+        return SCARD_E_INVALID_PARAMETER;
+    }
+
+    casproxy::SCardConnectRequest req;
+    req.hContext = handle->remote;
+    req.szReader = szReader;
+    req.dwShareMode = static_cast<uint32_t>(dwShareMode);
+    req.dwPreferredProtocols = static_cast<uint32_t>(dwPreferredProtocols);
+    auto res = shim().call<casproxy::SCardConnectResponse>(*handle, req);
+    if (!res) {
+        return SCARD_F_COMM_ERROR;
+    }
+    if (res->apiReturn == SCARD_S_SUCCESS) {
+        uint64_t hCard = encodeHandle(handle->connection, handle->epoch, res->hCard);
+        *phCard = static_cast<SCARDHANDLE>(hCard);
+        *pdwActiveProtocol = res->dwActiveProtocol;
+
+        std::lock_guard<std::mutex> lock(shim().mutex);
+        shim().cards[hCard] = { szReader, res->dwActiveProtocol };
+    }
+    return static_cast<LONG>(res->apiReturn);
+}
+
+LONG SCardReconnect(SCARDHANDLE, DWORD, DWORD, DWORD, LPDWORD) {
+    return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition) {
+    auto handle = shim().decode(static_cast<uint64_t>(hCard));
+    if (!handle) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    casproxy::SCardDisconnectRequest req;
+    req.hCard = handle->remote;
+    req.dwDisposition = static_cast<uint32_t>(dwDisposition);
+    auto res = shim().call<casproxy::SCardDisconnectResponse>(*handle, req);
+    if (!res) {
+        return SCARD_F_COMM_ERROR;
+    }
+    if (res->apiReturn == SCARD_S_SUCCESS) {
+        std::lock_guard<std::mutex> lock(shim().mutex);
+        shim().cards.erase(static_cast<uint64_t>(hCard));
+    }
+    return static_cast<LONG>(res->apiReturn);
+}
+
+LONG SCardBeginTransaction(SCARDHANDLE hCard) {
+    auto handle = shim().decode(static_cast<uint64_t>(hCard));
+    if (!handle) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    casproxy::SCardBeginTransactionRequest req;
+    req.hCard = handle->remote;
+    auto res = shim().call<casproxy::SCardBeginTransactionResponse>(*handle, req);
+    return res ? static_cast<LONG>(res->apiReturn) : SCARD_F_COMM_ERROR;
+}
+
+LONG SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition) {
+    auto handle = shim().decode(static_cast<uint64_t>(hCard));
+    if (!handle) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    casproxy::SCardEndTransactionRequest req;
+    req.hCard = handle->remote;
+    req.dwDisposition = static_cast<uint32_t>(dwDisposition);
+    auto res = shim().call<casproxy::SCardEndTransactionResponse>(*handle, req);
+    return res ? static_cast<LONG>(res->apiReturn) : SCARD_F_COMM_ERROR;
+}
+
+LONG SCardTransmit(SCARDHANDLE hCard, const SCARD_IO_REQUEST* pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength,
+    SCARD_IO_REQUEST* pioRecvPci, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength) {
+    auto handle = shim().decode(static_cast<uint64_t>(hCard));
+    if (!handle) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    if (!pbSendBuffer || !pbRecvBuffer || !pcbRecvLength) {
+        return SCARD_E_INVALID_PARAMETER;
+    }
+
+    casproxy::SCardTransmitRequest req;
+    req.hCard = handle->remote;
+    req.sendPci = pciType(pioSendPci);
+    req.sendBuffer.assign(pbSendBuffer, pbSendBuffer + cbSendLength);
+    req.isRecvPciNull = pioRecvPci == nullptr;
+    if (pioRecvPci) {
+        req.recvPciProtocol = static_cast<uint32_t>(pioRecvPci->dwProtocol);
+        req.recvPciLength = static_cast<uint32_t>(pioRecvPci->cbPciLength);
+    }
+    req.recvLength = static_cast<uint32_t>(*pcbRecvLength);
+
+    auto res = shim().call<casproxy::SCardTransmitResponse>(*handle, req);
+    if (!res) {
+        return SCARD_F_COMM_ERROR;
+    }
+    if (res->apiReturn == SCARD_S_SUCCESS) {
+        size_t size = std::min<size_t>(res->recvBuffer.size(), *pcbRecvLength);
+        memcpy(pbRecvBuffer, res->recvBuffer.data(), size);
+        if (pioRecvPci && !res->isRecvPciNull) {
+            pioRecvPci->dwProtocol = res->recvPciProtocol;
+            pioRecvPci->cbPciLength = res->recvPciLength;
+        }
+    }
+    *pcbRecvLength = res->recvLength;
+    return static_cast<LONG>(res->apiReturn);
+}
+
+LONG SCardGetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPBYTE pbAttr, LPDWORD pcbAttrLen) {
+    auto handle = shim().decode(static_cast<uint64_t>(hCard));
+    if (!handle) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+    if (!pcbAttrLen) {
+        return SCARD_E_INVALID_PARAMETER;
+    }
+
+    // Without a caller buffer of known size, ask for the length first.
+    casproxy::SCardGetAttribRequest req;
+    req.hCard = handle->remote;
+    req.dwAttrId = static_cast<uint32_t>(dwAttrId);
+    req.attrLength = pbAttr && *pcbAttrLen != SCARD_AUTOALLOCATE ? static_cast<uint32_t>(*pcbAttrLen) : 0;
+    auto res = shim().call<casproxy::SCardGetAttribResponse>(*handle, req);
+    if (res && res->apiReturn == SCARD_S_SUCCESS && pbAttr && req.attrLength == 0) {
+        req.attrLength = res->attrLength;
+        res = shim().call<casproxy::SCardGetAttribResponse>(*handle, req);
+    }
+    if (!res) {
+        return SCARD_F_COMM_ERROR;
+    }
+    if (res->apiReturn != SCARD_S_SUCCESS) {
+        if (static_cast<LONG>(res->apiReturn) == SCARD_E_INSUFFICIENT_BUFFER) {
+            *pcbAttrLen = res->attrLength;
+        }
+        return static_cast<LONG>(res->apiReturn);
+    }
+    if (!pbAttr) {
+        *pcbAttrLen = res->attrLength;
+        return SCARD_S_SUCCESS;
+    }
+    return copyOut(res->attrBuffer.data(), res->attrBuffer.size(), pbAttr, pcbAttrLen);
+}
+
+LONG SCardSetAttrib(SCARDHANDLE, DWORD, LPCBYTE, DWORD) {
+    return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+LONG SCardStatus(SCARDHANDLE hCard, LPSTR szReaderName, LPDWORD pcchReaderLen, LPDWORD pdwState,
+    LPDWORD pdwProtocol, LPBYTE pbAtr, LPDWORD pcbAtrLen) {
+    auto handle = shim().decode(static_cast<uint64_t>(hCard));
+    if (!handle) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    CardInfo card;
+    {
+        std::lock_guard<std::mutex> lock(shim().mutex);
+        auto it = shim().cards.find(static_cast<uint64_t>(hCard));
+        if (it == shim().cards.end()) {
+            return SCARD_E_INVALID_HANDLE;
+        }
+        card = it->second;
+    }
+
+    // The state is not in the protocol; a connected handle is reported as
+    // ready for use, and the ATR comes from the (cached) attribute.
+    casproxy::SCardGetAttribRequest req;
+    req.hCard = handle->remote;
+    req.dwAttrId = SCARD_ATTR_ATR_STRING;
+    req.attrLength = MAX_ATR_SIZE;
+    auto res = shim().call<casproxy::SCardGetAttribResponse>(*handle, req);
+    if (!res) {
+        return SCARD_F_COMM_ERROR;
+    }
+    if (res->apiReturn != SCARD_S_SUCCESS) {
+        return static_cast<LONG>(res->apiReturn);
+    }
+
+    if (pdwState) {
+        *pdwState = SCARD_SPECIFIC;
+    }
+    if (pdwProtocol) {
+        *pdwProtocol = card.protocol;
+    }
+
+    LONG returnValue = SCARD_S_SUCCESS;
+    if (pcchReaderLen) {
+        std::string readerName = card.readerName + '\0';
+        returnValue = copyOut(reinterpret_cast<const uint8_t*>(readerName.data()), readerName.size(),
+            reinterpret_cast<LPBYTE>(szReaderName), pcchReaderLen);
+    }
+    if (pcbAtrLen && returnValue == SCARD_S_SUCCESS) {
+        returnValue = copyOut(res->attrBuffer.data(), res->attrBuffer.size(), pbAtr, pcbAtrLen);
+    }
+    return returnValue;
+}
+
+LONG SCardGetStatusChange(SCARDCONTEXT, DWORD, SCARD_READERSTATE*, DWORD) {
+    return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+LONG SCardControl(SCARDHANDLE, DWORD, LPCVOID, DWORD, LPVOID, DWORD, LPDWORD) {
+    return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+LONG SCardListReaderGroups(SCARDCONTEXT, LPSTR, LPDWORD) {
+    return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+LONG SCardCancel(SCARDCONTEXT) {
+    return SCARD_S_SUCCESS;
+}
+
+const char* pcsc_stringify_error(const LONG pcscError) {
+    static thread_local char text[32];
+    std::snprintf(text, sizeof(text), "PC/SC error 0x%08lX", static_cast<unsigned long>(pcscError) & 0xFFFFFFFFUL);
+    return text;
+}
@@ -0,0 +1,64 @@
+#include "attribCache.h"
+#include "readerMonitor.h"
+#ifndef _WIN32
+#include <reader.h>
+#endif
+
+AttribCache::AttribCache(ReaderMonitor& readerMonitor) : readerMonitor(readerMonitor) {
+}
+
+bool AttribCache::isCacheable(DWORD attrId) {
+    switch (attrId) {
+    case SCARD_ATTR_ATR_STRING:
+    case SCARD_ATTR_ICC_TYPE_PER_ATR:
+    case SCARD_ATTR_VENDOR_NAME:
+    case SCARD_ATTR_VENDOR_IFD_TYPE:
+    case SCARD_ATTR_VENDOR_IFD_VERSION:
+    case SCARD_ATTR_VENDOR_IFD_SERIAL_NO:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::optional<std::vector<uint8_t>> AttribCache::find(const std::string& reader, uint64_t cardGeneration, DWORD attrId) {
+    if (!isCurrentCard(reader, cardGeneration)) {
+        return std::nullopt;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(reader);
+    if (it == entries.end() || it->second.cardGeneration != cardGeneration) {
+        return std::nullopt;
+    }
+
+    auto attrib = it->second.attribs.find(attrId);
+    if (attrib == it->second.attribs.end()) {
+        return std::nullopt;
+    }
+    return attrib->second;
+}
+
+void AttribCache::store(const std::string& reader, uint64_t cardGeneration, DWORD attrId, const std::vector<uint8_t>& value) {
+    if (!isCacheable(attrId) || !isCurrentCard(reader, cardGeneration)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& entry = entries[reader];
+    if (entry.cardGeneration != cardGeneration) {
+        entry.cardGeneration = cardGeneration;
+        entry.attribs.clear();
+    }
+    entry.attribs[attrId] = value;
+}
+
+void AttribCache::invalidate(const std::string& reader) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.erase(reader);
+}
+
+bool AttribCache::isCurrentCard(const std::string& reader, uint64_t cardGeneration) const {
+    const auto current = readerMonitor.findCardGeneration(reader);
+    return current && *current == cardGeneration;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <winscard.h>
+
+class ReaderMonitor;
+
+// Caches attributes that cannot change while the same card stays in the
+// reader, keyed by reader name and the card generation reported by
+// ReaderMonitor. An entry is only served while the monitor still reports
+// the same card, so removal and insertion invalidate it implicitly.
+class AttribCache {
+public:
+    explicit AttribCache(ReaderMonitor& readerMonitor);
+    static bool isCacheable(DWORD attrId);
+    std::optional<std::vector<uint8_t>> find(const std::string& reader, uint64_t cardGeneration, DWORD attrId);
+    void store(const std::string& reader, uint64_t cardGeneration, DWORD attrId, const std::vector<uint8_t>& value);
+    void invalidate(const std::string& reader);
+
+private:
+    struct Entry {
+        uint64_t cardGeneration{ 0 };
+        std::map<DWORD, std::vector<uint8_t>> attribs;
+    };
+
+    bool isCurrentCard(const std::string& reader, uint64_t cardGeneration) const;
+
+    ReaderMonitor& readerMonitor;
+    std::mutex mutex;
+    std::map<std::string, Entry> entries;
+
+};
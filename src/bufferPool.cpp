@@ -0,0 +1,52 @@
+#include "bufferPool.h"
+
+size_t BufferPool::classIndex(size_t size) {
+    size_t index = 0;
+    size_t classSize = minClassSize;
+    while (classSize < size && index < classCount) {
+        classSize <<= 1;
+        ++index;
+    }
+    return index;
+}
+
+std::vector<uint8_t> BufferPool::acquire(size_t size) {
+    size_t index = classIndex(size);
+    if (index >= classCount) {
+        return std::vector<uint8_t>(size);
+    }
+
+    std::vector<uint8_t> buffer;
+    auto& idle = idleBuffers[index];
+    if (!idle.empty()) {
+        buffer = std::move(idle.back());
+        idle.pop_back();
+    }
+    else {
+        buffer.reserve(minClassSize << index);
+    }
+    buffer.resize(size);
+    return buffer;
+}
+
+void BufferPool::release(std::vector<uint8_t>&& buffer) {
+    // A buffer goes back to the largest class it can fully serve.
+    size_t capacity = buffer.capacity();
+    if (capacity < minClassSize) {
+        return;
+    }
+    size_t index = classIndex(capacity);
+    if (index >= classCount || (minClassSize << index) > capacity) {
+        if (index == 0) {
+            return;
+        }
+        --index;
+    }
+
+    auto& idle = idleBuffers[index];
+    if (idle.size() < maxIdlePerClass) {
+        buffer.clear();
+        idle.push_back(std::move(buffer));
+    }
+    std::vector<uint8_t>().swap(buffer);
+}
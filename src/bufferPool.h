@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <array>
+
+// Receive buffers shared by all sessions. A session takes a buffer for the
+// frame it is reading and gives it back once the frame is handled, so an idle
+// connection holds no buffer. Buffers are kept in power-of-two size classes;
+// frames larger than the biggest class get a buffer of their own. Only used
+// from the I/O thread.
+class BufferPool {
+public:
+    std::vector<uint8_t> acquire(size_t size);
+    void release(std::vector<uint8_t>&& buffer);
+
+private:
+    static constexpr size_t minClassSize = 256;
+    static constexpr size_t classCount = 10;
+    static constexpr size_t maxIdlePerClass = 64;
+
+    static size_t classIndex(size_t size);
+
+    std::array<std::vector<std::vector<uint8_t>>, classCount> idleBuffers;
+
+};
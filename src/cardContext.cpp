@@ -1,180 +1,432 @@
 #include "cardContext.h"
 #include "session.h"
+#include "attribCache.h"
+#include "config.h"
+#include "metrics.h"
+#include "cardScheduler.h"
+#include "readerHealth.h"
+#include "threadScheduling.h"
+#include "logger.h"
+#include <utility>
+#include <algorithm>
 
-CardContext::CardContext(std::shared_ptr<Session> session, uint64_t virtualCardHandle) :
-    session(session), virtualCardHandle(virtualCardHandle) {
+CardContext::CardContext(std::shared_ptr<Session> session, ServerContext& server, uint64_t virtualCardHandle) :
+    session(session), server(server), virtualCardHandle(virtualCardHandle),
+    client(server.cardScheduler.attach(session->ip, session->getId())) {
 }
 
-void CardContext::addTask(std::shared_ptr<casproxy::RequestBase> req) {
-    {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        tasks.push(req);
+CardContext::~CardContext() {
+    server.cardScheduler.detach(client);
+}
+
+namespace {
+
+uint32_t toMicroseconds(std::chrono::steady_clock::duration duration) {
+    auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    return static_cast<uint32_t>(std::clamp<int64_t>(microseconds, 0, UINT32_MAX));
+}
+
+}
+
+bool CardContext::addTask(std::shared_ptr<casproxy::RequestBase> req, std::chrono::steady_clock::time_point receivedAt) {
+    Task task{ std::move(req), {}, {}, receivedAt, std::chrono::steady_clock::now() };
+    return tasks.push(std::move(task));
+}
+
+bool CardContext::addTransmit(const casproxy::SCardTransmitView& req, std::vector<uint8_t>& frame, std::chrono::steady_clock::time_point receivedAt) {
+    Task task{ nullptr, req, std::move(frame), receivedAt, std::chrono::steady_clock::now() };
+    if (!tasks.push(std::move(task))) {
+        frame = std::move(task.frame);
+        return false;
     }
-    cv.notify_one();
+    return true;
 }
 
 void CardContext::run() {
-    for (;;) {
-        std::shared_ptr<casproxy::RequestBase> req;
-        {
-            std::unique_lock<std::mutex> lock(queueMutex);
-            cv.wait(lock, [this] { return !running || !tasks.empty(); });
-            if (!running && tasks.empty()) {
-                return;
-            }
-            req = std::move(tasks.front());
-            tasks.pop();
-        }
+    applyScheduling();
 
-        casproxy::Opcode opcode = static_cast<casproxy::Opcode>(req->opcode);
-        if (opcode == casproxy::Opcode::SCardConnectReq) {
-            handleSCardConnect(std::static_pointer_cast<casproxy::SCardConnectRequest>(req));
-        }
-        if (opcode == casproxy::Opcode::SCardDisconnectReq) {
-            handleSCardDisconnect(std::static_pointer_cast<casproxy::SCardDisconnectRequest>(req));
-        }
-        else if (opcode == casproxy::Opcode::SCardBeginTransactionReq) {
-            handleSCardBeginTransaction(std::static_pointer_cast<casproxy::SCardBeginTransactionRequest>(req));
+    std::vector<Task> batch;
+    for (;;) {
+        bool idle = tasks.empty();
+        tasks.wait([this] { return !running || transactionExpired; });
+        tasks.popAll(batch);
+        if (!running && batch.empty()) {
+            break;
         }
-        else if (opcode == casproxy::Opcode::SCardEndTransactionReq) {
-            handleSCardEndTransaction(std::static_pointer_cast<casproxy::SCardEndTransactionRequest>(req));
+        if (idle && !batch.empty()) {
+            server.metrics.workerWakeup.record(std::chrono::steady_clock::now() - batch.front().queuedAt);
         }
-        else if (opcode == casproxy::Opcode::SCardTransmitReq) {
-            handleSCardTransmit(std::static_pointer_cast<casproxy::SCardTransmitRequest>(req));
+
+        if (transactionExpired.exchange(false) && transacted) {
+            SCardEndTransaction(hCard, SCARD_LEAVE_CARD);
+            transacted = false;
         }
-        else if (opcode == casproxy::Opcode::SCardGetAttribReq) {
-            handleSCardGetAttrib(std::static_pointer_cast<casproxy::SCardGetAttribRequest>(req));
+
+        for (auto& task : batch) {
+            handleTask(task);
         }
+        batch.clear();
+    }
+
+    // The handle is only touched from this thread, so a stop without a client
+    // disconnect (session closed, context released) disconnects here.
+    if (connected) {
+        SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+        connected = false;
     }
 }
 
-void CardContext::stop() {
-    running = false;
-    cv.notify_all();
+void CardContext::applyScheduling() {
+    const auto& scheduling = server.config.scheduling;
+    static std::once_flag pinWarning;
+    static std::once_flag priorityWarning;
+
+    if (!pinCurrentThread(scheduling.workerCpus)) {
+        std::call_once(pinWarning, [this] {
+            server.logger.log(LogLevel::Warning, "Cannot pin card workers to the configured CPUs");
+        });
+    }
+    if (scheduling.workerPriority > 0 && !setRealtimePriority(scheduling.workerPriority)) {
+        std::call_once(priorityWarning, [this] {
+            server.logger.log(LogLevel::Warning, "Cannot run card workers with real-time priority");
+        });
+    }
 }
 
-void CardContext::handleSCardConnect(std::shared_ptr<casproxy::SCardConnectRequest> req) {
-    auto s = session.lock();
-    if (!s) {
+void CardContext::handleTask(Task& task) {
+    // Inside a transaction the card is ours alone; waiting for a turn here
+    // would also keep the transaction from ending while other handles of
+    // the reader are blocked on it.
+    hasTurn = !transacted && server.cardScheduler.acquire(readerName, *client);
+    auto start = std::chrono::steady_clock::now();
+    turnStartedAt = start;
+    timing.receiveToEnqueue = toMicroseconds(task.queuedAt - task.receivedAt);
+    timing.queueWait = toMicroseconds(start - task.queuedAt);
+    cardCallTime = {};
+    dispatchTask(task);
+    server.cardScheduler.finish(readerName, *client, std::chrono::steady_clock::now() - turnStartedAt, hasTurn);
+}
+
+void CardContext::dispatchTask(Task& task) {
+    if (!task.req) {
+        handleSCardTransmit(task.transmit, std::move(task.frame));
         return;
     }
 
-    const auto hNativeContext = s->findContext(req->hContext);
-    if (!hNativeContext) {
-        casproxy::SCardConnectResponse res;
-        res.packetId = req->packetId;
-        res.apiReturn = SCARD_E_INVALID_HANDLE;
-        session.lock()->sendResponse(res);
+    const auto& req = task.req;
+    casproxy::Opcode opcode = static_cast<casproxy::Opcode>(req->opcode);
+    if (opcode == casproxy::Opcode::SCardConnectReq) {
+        handleSCardConnect(std::static_pointer_cast<casproxy::SCardConnectRequest>(req));
+    }
+    if (opcode == casproxy::Opcode::SCardDisconnectReq) {
+        handleSCardDisconnect(std::static_pointer_cast<casproxy::SCardDisconnectRequest>(req));
+    }
+    else if (opcode == casproxy::Opcode::SCardBeginTransactionReq) {
+        handleSCardBeginTransaction(std::static_pointer_cast<casproxy::SCardBeginTransactionRequest>(req));
+    }
+    else if (opcode == casproxy::Opcode::SCardEndTransactionReq) {
+        handleSCardEndTransaction(std::static_pointer_cast<casproxy::SCardEndTransactionRequest>(req));
+    }
+    else if (opcode == casproxy::Opcode::SCardTransmitReq) {
+        handleSCardTransmit(casproxy::SCardTransmitView::of(static_cast<const casproxy::SCardTransmitRequest&>(*req)), {});
+    }
+    else if (opcode == casproxy::Opcode::SCardGetAttribReq) {
+        handleSCardGetAttrib(std::static_pointer_cast<casproxy::SCardGetAttribRequest>(req));
+    }
+    else if (opcode == casproxy::Opcode::SCardTransactionScriptReq) {
+        handleSCardTransactionScript(std::static_pointer_cast<casproxy::SCardTransactionScriptRequest>(req));
+    }
+}
+
+template<typename Call>
+LONG CardContext::timedCall(Call&& call) {
+    auto start = std::chrono::steady_clock::now();
+    LONG returnValue = call();
+    cardCallTime += std::chrono::steady_clock::now() - start;
+    return returnValue;
+}
+
+void CardContext::respond(const std::shared_ptr<Session>& session, casproxy::ResponseBase& res, std::vector<uint8_t>&& frame) {
+    if (!session) {
         return;
     }
+    timing.cardCall = toMicroseconds(cardCallTime);
+    res.timing = timing;
+    session->sendResponse(res, std::move(frame));
+}
+
+void CardContext::setSession(std::shared_ptr<Session> session) {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    this->session = session;
+}
+
+std::shared_ptr<Session> CardContext::getSession() {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    return session.lock();
+}
+
+void CardContext::expireTransaction() {
+    transactionExpired = true;
+    tasks.wake();
+}
+
+void CardContext::stop() {
+    running = false;
+    tasks.wake();
+}
+
+void CardContext::handleSCardConnect(std::shared_ptr<casproxy::SCardConnectRequest> req) {
+    auto s = getSession();
 
     DWORD dwActiveProtocol = 0;
-    LONG returnValue = SCardConnect(*hNativeContext, req->szReader.c_str(), req->dwShareMode, req->dwPreferredProtocols, &hCard, &dwActiveProtocol);
+    LONG returnValue = timedCall([&] {
+        return SCardConnect(hContext, req->szReader.c_str(), req->dwShareMode, req->dwPreferredProtocols, &hCard, &dwActiveProtocol);
+    });
     if (returnValue != SCARD_S_SUCCESS) {
         stop();
     }
+    else {
+        connected = true;
+        this->dwShareMode = req->dwShareMode;
+        this->dwPreferredProtocols = req->dwPreferredProtocols;
+        this->dwActiveProtocol = dwActiveProtocol;
+    }
 
     casproxy::SCardConnectResponse res;
     res.packetId = req->packetId;
     res.apiReturn = returnValue;
     res.hCard = virtualCardHandle;
     res.dwActiveProtocol = dwActiveProtocol;
-    s->sendResponse(res);
+    respond(s, res);
+
+    // The client never learns the handle, so nothing would free its slot.
+    if (returnValue != SCARD_S_SUCCESS) {
+        if (auto current = getSession()) {
+            current->releaseCardHandle(virtualCardHandle);
+        }
+    }
 }
 
 void CardContext::handleSCardDisconnect(std::shared_ptr<casproxy::SCardDisconnectRequest> req) {
-    auto s = session.lock();
-    if (!s) {
-        return;
-    }
+    auto s = getSession();
 
-    LONG returnValue = SCardDisconnect(hCard, req->dwDisposition);
+    LONG returnValue = timedCall([&] { return SCardDisconnect(hCard, req->dwDisposition); });
+    checkCardEvent(returnValue, req->dwDisposition);
     if (returnValue == SCARD_S_SUCCESS) {
+        connected = false;
+        transacted = false;
         stop();
     }
 
     casproxy::SCardDisconnectResponse res;
     res.packetId = req->packetId;
     res.apiReturn = returnValue;
-    s->sendResponse(res);
+    respond(s, res);
 }
 
 void CardContext::handleSCardBeginTransaction(std::shared_ptr<casproxy::SCardBeginTransactionRequest> req) {
-    auto s = session.lock();
-    if (!s) {
-        return;
-    }
+    auto s = getSession();
 
-    LONG returnValue = SCardBeginTransaction(hCard);
+    LONG returnValue = timedCall([&] { return SCardBeginTransaction(hCard); });
+    checkCardEvent(returnValue);
+    if (returnValue == SCARD_S_SUCCESS) {
+        transacted = true;
+        if (s) {
+            s->watchTransaction(virtualCardHandle);
+        }
+    }
 
     casproxy::SCardBeginTransactionResponse res;
     res.packetId = req->packetId;
     res.apiReturn = returnValue;
-    s->sendResponse(res);
+    respond(s, res);
 }
 
 void CardContext::handleSCardEndTransaction(std::shared_ptr<casproxy::SCardEndTransactionRequest> req) {
-    auto s = session.lock();
-    if (!s) {
-        return;
-    }
+    auto s = getSession();
 
-    LONG returnValue = SCardEndTransaction(hCard, req->dwDisposition);
+    LONG returnValue = timedCall([&] { return SCardEndTransaction(hCard, req->dwDisposition); });
+    checkCardEvent(returnValue, req->dwDisposition);
+    if (returnValue == SCARD_S_SUCCESS) {
+        transacted = false;
+    }
 
     casproxy::SCardEndTransactionResponse res;
     res.packetId = req->packetId;
     res.apiReturn = returnValue;
-    s->sendResponse(res);
+    respond(s, res);
 }
 
-void CardContext::handleSCardTransmit(std::shared_ptr<casproxy::SCardTransmitRequest> req) {
-    auto s = session.lock();
-    if (!s) {
-        return;
-    }
-
-    std::vector<uint8_t> recvBuffer(req->recvLength);
+void CardContext::handleSCardTransmit(const casproxy::SCardTransmitView& req, std::vector<uint8_t>&& frame) {
+    auto s = getSession();
 
-    SCARD_IO_REQUEST* recvPci = nullptr;
-    if (!req->isRecvPciNull) {
-        SCARD_IO_REQUEST pci;
-        pci.dwProtocol = req->recvPciProtocol;
-        pci.cbPciLength = req->recvPciLength;
-        recvPci = &pci;
+    SCARD_IO_REQUEST pci;
+    SCARD_IO_REQUEST* recvPci = req.isRecvPciNull ? nullptr : &pci;
+    std::vector<uint8_t> recvBuffer;
+    DWORD recvLength;
+    LONG status = transmit(req, recvPci, recvBuffer, recvLength);
+    // The card did not run the APDU, so sending it again is safe.
+    if (canRecover(req, status) && reconnectCard()) {
+        status = transmit(req, recvPci, recvBuffer, recvLength);
     }
 
-    DWORD recvLength = req->recvLength;
-    LONG status = SCardTransmit(hCard, casproxy::getPciByType(req->sendPci), (BYTE*)req->sendBuffer.data(), (DWORD)req->sendBuffer.size(), recvPci, recvBuffer.data(), &recvLength);
-    recvBuffer.resize(recvLength);
-
     casproxy::SCardTransmitResponse res;
-    res.packetId = req->packetId;
+    res.packetId = req.packetId;
     res.apiReturn = status;
-    res.recvBuffer = recvBuffer;
-    if (!req->isRecvPciNull) {
+    res.recvBuffer = std::move(recvBuffer);
+    if (!req.isRecvPciNull) {
         res.recvPciProtocol = recvPci->dwProtocol;
         res.recvPciLength = recvPci->cbPciLength;
     }
-    res.isRecvPciNull = req->isRecvPciNull;
+    res.isRecvPciNull = req.isRecvPciNull;
     res.recvLength = recvLength;
-    s->sendResponse(res);
+    respond(s, res, std::move(frame));
 }
 
-void CardContext::handleSCardGetAttrib(std::shared_ptr<casproxy::SCardGetAttribRequest> req) {
-    auto s = session.lock();
-    if (!s) {
-        return;
+LONG CardContext::transmit(const casproxy::SCardTransmitView& req, SCARD_IO_REQUEST* recvPci, std::vector<uint8_t>& recvBuffer, DWORD& recvLength) {
+    if (recvPci) {
+        recvPci->dwProtocol = req.recvPciProtocol;
+        recvPci->cbPciLength = req.recvPciLength;
+    }
+    recvBuffer.resize(req.recvLength);
+    recvLength = req.recvLength;
+
+    auto start = std::chrono::steady_clock::now();
+    LONG status = SCardTransmit(hCard, casproxy::getPciByType(req.sendPci), (BYTE*)req.sendBuffer, (DWORD)req.sendLength, recvPci, recvBuffer.data(), &recvLength);
+    auto latency = std::chrono::steady_clock::now() - start;
+    cardCallTime += latency;
+    recvBuffer.resize(recvLength);
+    server.readerHealth.record(readerName, latency, status, recvBuffer.data(), recvBuffer.size());
+    checkCardEvent(status);
+    return status;
+}
+
+bool CardContext::canRecover(const casproxy::SCardTransmitView& req, LONG returnValue) const {
+    const auto& policy = server.config.cardRecovery;
+    if (!policy.enabled || (returnValue != SCARD_W_RESET_CARD && returnValue != SCARD_W_REMOVED_CARD)) {
+        return false;
+    }
+    // A transaction of the client ended with the reset; it has to know.
+    if (transacted) {
+        return false;
+    }
+    if (policy.retryIns.empty()) {
+        return true;
+    }
+    return req.sendLength >= 2 && std::find(policy.retryIns.begin(), policy.retryIns.end(), req.sendBuffer[1]) != policy.retryIns.end();
+}
+
+bool CardContext::reconnectCard() {
+    const auto& policy = server.config.cardRecovery;
+    for (uint32_t attempt = 0; attempt < policy.attempts && running; ++attempt) {
+        if (attempt > 0) {
+            // The other handles of the reader need not wait for the card
+            // to come back.
+            if (hasTurn) {
+                server.cardScheduler.yield(readerName, *client, std::chrono::steady_clock::now() - turnStartedAt);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(policy.retryDelay));
+            if (hasTurn) {
+                server.cardScheduler.acquire(readerName, *client);
+                turnStartedAt = std::chrono::steady_clock::now();
+            }
+        }
+
+        DWORD activeProtocol = 0;
+        LONG returnValue = timedCall([&] {
+            return SCardReconnect(hCard, dwShareMode, dwPreferredProtocols, SCARD_LEAVE_CARD, &activeProtocol);
+        });
+        if (returnValue != SCARD_S_SUCCESS) {
+            continue;
+        }
+        // The client's PCI is for the protocol it was told about.
+        if (activeProtocol != dwActiveProtocol) {
+            break;
+        }
+        ++server.metrics.cardRecoveries;
+        cardReplaced = true;
+        return true;
     }
+    ++server.metrics.failedCardRecoveries;
+    return false;
+}
+
+void CardContext::handleSCardGetAttrib(std::shared_ptr<casproxy::SCardGetAttribRequest> req) {
+    auto s = getSession();
 
     std::vector<uint8_t> recvBuffer(req->attrLength);
     DWORD recvLength = req->attrLength;
-    LONG status = SCardGetAttrib(hCard, req->dwAttrId, recvBuffer.data(), &recvLength);
+    LONG status = timedCall([&] { return SCardGetAttrib(hCard, req->dwAttrId, recvBuffer.data(), &recvLength); });
     recvBuffer.resize(recvLength);
+    checkCardEvent(status);
+    if (status == SCARD_S_SUCCESS && req->attrLength != 0) {
+        server.attribCache.store(readerName, cardGeneration, req->dwAttrId, recvBuffer);
+    }
 
     casproxy::SCardGetAttribResponse res;
     res.packetId = req->packetId;
     res.apiReturn = status;
     res.attrBuffer = recvBuffer;
     res.attrLength = recvLength;
-    s->sendResponse(res);
+    respond(s, res);
+}
+
+void CardContext::handleSCardTransactionScript(std::shared_ptr<casproxy::SCardTransactionScriptRequest> req) {
+    auto s = getSession();
+
+    casproxy::SCardTransactionScriptResponse res;
+    res.packetId = req->packetId;
+
+    // Inside a transaction the client began itself, the script runs in it
+    // and leaves it open.
+    bool ownTransaction = !transacted;
+    LONG returnValue = SCARD_S_SUCCESS;
+    if (ownTransaction) {
+        returnValue = timedCall([&] { return SCardBeginTransaction(hCard); });
+        checkCardEvent(returnValue);
+    }
+
+    if (returnValue == SCARD_S_SUCCESS) {
+        for (const auto& apdu : req->apdus) {
+            std::vector<uint8_t> recvBuffer(req->recvLength);
+            DWORD recvLength = req->recvLength;
+            auto start = std::chrono::steady_clock::now();
+            returnValue = SCardTransmit(hCard, casproxy::getPciByType(req->sendPci), (BYTE*)apdu.data(), (DWORD)apdu.size(), nullptr, recvBuffer.data(), &recvLength);
+            auto latency = std::chrono::steady_clock::now() - start;
+            cardCallTime += latency;
+            recvBuffer.resize(returnValue == SCARD_S_SUCCESS ? recvLength : 0);
+            server.readerHealth.record(readerName, latency, returnValue, recvBuffer.data(), recvBuffer.size());
+            checkCardEvent(returnValue);
+            if (returnValue != SCARD_S_SUCCESS) {
+                break;
+            }
+
+            bool statusOk = recvLength >= 2
+                && ((recvBuffer[recvLength - 2] == 0x90 && recvBuffer[recvLength - 1] == 0x00) || recvBuffer[recvLength - 2] == 0x61);
+            res.responses.push_back(std::move(recvBuffer));
+            if (req->stopOnStatusError && !statusOk) {
+                break;
+            }
+        }
+
+        if (ownTransaction) {
+            LONG endReturn = timedCall([&] { return SCardEndTransaction(hCard, req->dwDisposition); });
+            checkCardEvent(endReturn, req->dwDisposition);
+            if (returnValue == SCARD_S_SUCCESS) {
+                returnValue = endReturn;
+            }
+        }
+    }
+
+    res.apiReturn = returnValue;
+    respond(s, res);
+}
+
+void CardContext::checkCardEvent(LONG returnValue, DWORD dwDisposition) {
+    // A reset or removed card, or a disposition that resets the card, may
+    // change what the cached attributes describe.
+    if (returnValue == SCARD_W_RESET_CARD || returnValue == SCARD_W_REMOVED_CARD
+        || (returnValue == SCARD_S_SUCCESS && dwDisposition != SCARD_LEAVE_CARD)) {
+        server.attribCache.invalidate(readerName);
+    }
 }
\ No newline at end of file
@@ -1,36 +1,109 @@
 #pragma once
 #include "casProxy.h"
+#include "serverContext.h"
+#include "taskQueue.h"
 #include <mutex>
 #include <memory>
-#include <queue>
+#include <vector>
 #include <thread>
-#include <condition_variable>
 #include <atomic>
+#include <chrono>
 
 class Session;
+struct CardClient;
 
 class CardContext {
 public:
-    CardContext(std::shared_ptr<Session> session, uint64_t virtualCardHandle);
-    void addTask(std::shared_ptr<casproxy::RequestBase> req);
+    CardContext(std::shared_ptr<Session> session, ServerContext& server, uint64_t virtualCardHandle);
+    ~CardContext();
+    // receivedAt is when the frame of the request was read. Both return
+    // false if the worker already has maxQueuedTasks waiting.
+    bool addTask(std::shared_ptr<casproxy::RequestBase> req, std::chrono::steady_clock::time_point receivedAt);
+    // A transmit read in place; frame is the receive buffer the view points
+    // into and goes back to the buffer pool with the response. frame is only
+    // taken if the task is queued.
+    bool addTransmit(const casproxy::SCardTransmitView& req, std::vector<uint8_t>& frame, std::chrono::steady_clock::time_point receivedAt);
     void stop();
     void run();
     void handleSCardConnect(std::shared_ptr<casproxy::SCardConnectRequest> req);
     void handleSCardDisconnect(std::shared_ptr<casproxy::SCardDisconnectRequest> req);
     void handleSCardBeginTransaction(std::shared_ptr<casproxy::SCardBeginTransactionRequest> req);
     void handleSCardEndTransaction(std::shared_ptr<casproxy::SCardEndTransactionRequest> req);
-    void handleSCardTransmit(std::shared_ptr<casproxy::SCardTransmitRequest> req);
+    void handleSCardTransmit(const casproxy::SCardTransmitView& req, std::vector<uint8_t>&& frame);
     void handleSCardGetAttrib(std::shared_ptr<casproxy::SCardGetAttribRequest> req);
+    void handleSCardTransactionScript(std::shared_ptr<casproxy::SCardTransactionScriptRequest> req);
+    void setSession(std::shared_ptr<Session> session);
+    std::shared_ptr<Session> getSession();
     bool isRunning() const { return running; }
-    SCARDHANDLE hCard;
+    bool isConnected() const { return connected; }
+    bool isTransacted() const { return transacted; }
+    // Ends the transaction on the worker thread, leaving the card as is.
+    void expireTransaction();
+    SCARDHANDLE hCard{ 0 };
     std::thread workerThread;
+    uint64_t virtualContext{ 0 };
+    SCARDCONTEXT hContext{ 0 };
+    std::string readerName;
+    // Of the card the handle is connected to. Only written on the I/O
+    // thread, which looks it up again once the worker sets cardReplaced
+    // after reconnecting to a card that was reset or put back.
+    std::atomic<uint64_t> cardGeneration{ 0 };
+    std::atomic<bool> cardReplaced{ false };
+    // Time of the last request on the handle; only used from the I/O thread.
+    std::chrono::steady_clock::time_point lastUsed;
+
+    static constexpr size_t maxQueuedTasks = 256;
 
 private:
+    struct Task {
+        // Null for a transmit read in place.
+        std::shared_ptr<casproxy::RequestBase> req;
+        casproxy::SCardTransmitView transmit;
+        std::vector<uint8_t> frame;
+        std::chrono::steady_clock::time_point receivedAt;
+        std::chrono::steady_clock::time_point queuedAt;
+    };
+
+    void applyScheduling();
+    void handleTask(Task& task);
+    void dispatchTask(Task& task);
+    void checkCardEvent(LONG returnValue, DWORD dwDisposition = SCARD_LEAVE_CARD);
+    // One SCardTransmit of req; recvBuffer holds the response afterwards.
+    LONG transmit(const casproxy::SCardTransmitView& req, SCARD_IO_REQUEST* recvPci, std::vector<uint8_t>& recvBuffer, DWORD& recvLength);
+    // Whether the cardRecovery policy lets a transmit that failed with
+    // returnValue go again after a reconnect.
+    bool canRecover(const casproxy::SCardTransmitView& req, LONG returnValue) const;
+    // Reconnects the handle to the card that was reset or put back.
+    bool reconnectCard();
+    // Runs a PC/SC call, adding its time to that of the current task.
+    template<typename Call>
+    LONG timedCall(Call&& call);
+    // Sends the response to the current task along with its timing. A task
+    // taken while the session is parked for a resume still runs, so that a
+    // disconnect or the end of a transaction is not lost; only its response
+    // is dropped, session being null.
+    void respond(const std::shared_ptr<Session>& session, casproxy::ResponseBase& res, std::vector<uint8_t>&& frame = {});
+
+    std::mutex sessionMutex;
     std::weak_ptr<Session> session;
+    ServerContext& server;
     uint64_t virtualCardHandle;
-    std::mutex queueMutex;
-    std::queue<std::shared_ptr<casproxy::RequestBase>> tasks;
-    std::condition_variable cv;
+    // Who the card time of this handle is accounted to.
+    std::shared_ptr<CardClient> client;
+    TaskQueue<Task> tasks{ maxQueuedTasks };
     std::atomic<bool> running{true};
+    std::atomic<bool> connected{false};
+    std::atomic<bool> transacted{false};
+    std::atomic<bool> transactionExpired{false};
+    // What the handle was connected with, for reconnects.
+    DWORD dwShareMode{ 0 };
+    DWORD dwPreferredProtocols{ 0 };
+    DWORD dwActiveProtocol{ 0 };
+    // Of the task the worker is running.
+    casproxy::ServerTiming timing;
+    std::chrono::steady_clock::duration cardCallTime{};
+    // Whether the worker holds its fair-share turn on the reader, and since when.
+    bool hasTurn{ false };
+    std::chrono::steady_clock::time_point turnStartedAt;
 
 };
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "cardScheduler.h"
+#include <algorithm>
+
+namespace {
+
+// Finish times at or below the reader's virtual time carry no information and
+// are pruned once a reader has seen this many clients.
+constexpr size_t maxFinishTimes = 64;
+
+}
+
+void CardScheduler::configure(const Config::FairShare& fairShare) {
+    enabled = fairShare.enabled;
+    perSession = fairShare.perSession;
+    defaultWeight = fairShare.defaultWeight;
+    weights = fairShare.weights;
+}
+
+std::shared_ptr<CardClient> CardScheduler::attach(const std::string& ip, uint64_t sessionId) {
+    std::string name = perSession ? ip + "#" + std::to_string(sessionId) : ip;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& client = clients[name];
+    if (!client) {
+        client = std::make_shared<CardClient>();
+        client->name = name;
+        auto weight = weights.find(ip);
+        client->weight = weight != weights.end() ? weight->second : defaultWeight;
+    }
+    ++client->handles;
+    return client;
+}
+
+void CardScheduler::detach(const std::shared_ptr<CardClient>& client) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // Per-client totals of an IP are kept for the life of the server; those
+    // of a session go with its last card handle.
+    if (--client->handles == 0 && perSession) {
+        clients.erase(client->name);
+    }
+}
+
+bool CardScheduler::acquire(const std::string& readerName, CardClient& client) {
+    if (!enabled) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto& reader = readers[readerName];
+    if (!reader.busy) {
+        reader.busy = true;
+        grant(reader, client);
+        return true;
+    }
+
+    auto waitStart = std::chrono::steady_clock::now();
+    Waiter waiter{ &client };
+    reader.waiting.push_back(&waiter);
+    reader.cv.wait(lock, [&waiter] { return waiter.granted; });
+    auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - waitStart);
+    client.waitNanoseconds.fetch_add(static_cast<uint64_t>(waited.count()), std::memory_order_relaxed);
+    return true;
+}
+
+void CardScheduler::finish(const std::string& readerName, CardClient& client, std::chrono::steady_clock::duration cardTime, bool hadTurn) {
+    client.requests.fetch_add(1, std::memory_order_relaxed);
+    endTurn(readerName, client, cardTime, hadTurn);
+}
+
+void CardScheduler::yield(const std::string& readerName, CardClient& client, std::chrono::steady_clock::duration cardTime) {
+    endTurn(readerName, client, cardTime, true);
+}
+
+void CardScheduler::endTurn(const std::string& readerName, CardClient& client, std::chrono::steady_clock::duration cardTime, bool hadTurn) {
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(cardTime).count();
+    client.cardNanoseconds.fetch_add(static_cast<uint64_t>(nanoseconds), std::memory_order_relaxed);
+    if (!hadTurn) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& reader = readers[readerName];
+    reader.finishTimes[client.name] = reader.virtualTime + nanoseconds / 1e9 / client.weight;
+
+    if (reader.waiting.empty()) {
+        reader.busy = false;
+        return;
+    }
+
+    // Earliest start time wins; ties go to the longest waiting.
+    auto startTime = [&reader](const Waiter* waiter) {
+        auto finishTime = reader.finishTimes.find(waiter->client->name);
+        return finishTime != reader.finishTimes.end() ? std::max(finishTime->second, reader.virtualTime) : reader.virtualTime;
+    };
+    auto next = std::min_element(reader.waiting.begin(), reader.waiting.end(),
+        [&startTime](const Waiter* a, const Waiter* b) { return startTime(a) < startTime(b); });
+    Waiter* waiter = *next;
+    reader.waiting.erase(next);
+    grant(reader, *waiter->client);
+    waiter->granted = true;
+    reader.cv.notify_all();
+}
+
+void CardScheduler::grant(Reader& reader, CardClient& client) {
+    if (auto finishTime = reader.finishTimes.find(client.name); finishTime != reader.finishTimes.end()) {
+        reader.virtualTime = std::max(reader.virtualTime, finishTime->second);
+    }
+
+    if (reader.finishTimes.size() > maxFinishTimes) {
+        for (auto it = reader.finishTimes.begin(); it != reader.finishTimes.end();) {
+            if (it->second <= reader.virtualTime) {
+                it = reader.finishTimes.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+}
+
+void CardScheduler::write(std::ostream& os) const {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    os << "# HELP casproxy_card_time_seconds_total Time card workers spent executing the requests of a client.\n";
+    os << "# TYPE casproxy_card_time_seconds_total counter\n";
+    for (const auto& [name, client] : clients) {
+        os << "casproxy_card_time_seconds_total{client=\"" << name << "\"} "
+            << client->cardNanoseconds.load(std::memory_order_relaxed) / 1e9 << "\n";
+    }
+
+    os << "# HELP casproxy_card_wait_seconds_total Time the requests of a client waited for their fair-share turn.\n";
+    os << "# TYPE casproxy_card_wait_seconds_total counter\n";
+    for (const auto& [name, client] : clients) {
+        os << "casproxy_card_wait_seconds_total{client=\"" << name << "\"} "
+            << client->waitNanoseconds.load(std::memory_order_relaxed) / 1e9 << "\n";
+    }
+
+    os << "# HELP casproxy_card_requests_total Requests of a client executed by card workers.\n";
+    os << "# TYPE casproxy_card_requests_total counter\n";
+    for (const auto& [name, client] : clients) {
+        os << "casproxy_card_requests_total{client=\"" << name << "\"} "
+            << client->requests.load(std::memory_order_relaxed) << "\n";
+    }
+}
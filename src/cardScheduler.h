@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <condition_variable>
+#include "config.h"
+
+// Card time used by one client: a client IP, or a single session when card
+// time is accounted per session.
+struct CardClient {
+    std::string name;
+    double weight;
+    std::atomic<uint64_t> cardNanoseconds{ 0 };
+    std::atomic<uint64_t> waitNanoseconds{ 0 };
+    std::atomic<uint64_t> requests{ 0 };
+    // Card handles attributed to the client; guarded by the scheduler.
+    size_t handles{ 0 };
+};
+
+// Accounts the time card workers spend executing requests to the client that
+// sent them, and with fair share enabled lets the workers of a reader use the
+// card one at a time, in start-time fair queueing order: the next turn goes to
+// the waiting client that has used the least card time relative to its weight.
+class CardScheduler {
+public:
+    void configure(const Config::FairShare& fairShare);
+    std::shared_ptr<CardClient> attach(const std::string& ip, uint64_t sessionId);
+    void detach(const std::shared_ptr<CardClient>& client);
+
+    // Blocks until the client's turn on the reader. Returns false when fair
+    // share is disabled and no turn was taken.
+    bool acquire(const std::string& readerName, CardClient& client);
+    // Accounts a request and ends the client's turn if it had one.
+    void finish(const std::string& readerName, CardClient& client, std::chrono::steady_clock::duration cardTime, bool hadTurn);
+    // Ends the client's turn in the middle of a request that has to wait,
+    // accounting the card time used so far; acquire takes it up again.
+    void yield(const std::string& readerName, CardClient& client, std::chrono::steady_clock::duration cardTime);
+
+    void write(std::ostream& os) const;
+
+private:
+    struct Waiter {
+        CardClient* client;
+        bool granted{ false };
+    };
+
+    // Virtual times are seconds of card time divided by the client weight.
+    struct Reader {
+        bool busy{ false };
+        double virtualTime{ 0 };
+        std::map<std::string, double> finishTimes;
+        std::vector<Waiter*> waiting;
+        std::condition_variable cv;
+    };
+
+    void grant(Reader& reader, CardClient& client);
+    void endTurn(const std::string& readerName, CardClient& client, std::chrono::steady_clock::duration cardTime, bool hadTurn);
+
+    bool enabled{ false };
+    bool perSession{ false };
+    double defaultWeight{ 1.0 };
+    std::map<std::string, double> weights;
+    mutable std::mutex mutex;
+    std::map<std::string, std::shared_ptr<CardClient>> clients;
+    std::map<std::string, Reader> readers;
+
+};
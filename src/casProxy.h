@@ -101,10 +101,55 @@ enum class Opcode : uint32_t {
     SCardTransmitRes,
     SCardGetAttribReq,
     SCardGetAttribRes,
+    SessionStartReq,
+    SessionStartRes,
+    SessionResumeReq,
+    SessionResumeRes,
+    SCardTransactionScriptReq,
+    SCardTransactionScriptRes,
+    HelloReq,
+    HelloRes,
+    ShmAttachReq,
+    ShmAttachRes,
+    PingReq,
+    PingRes,
 };
 
+// Version 2 added the Hello handshake. A connection that starts without one
+// speaks version 1 with no capabilities.
+constexpr uint32_t protocolVersion = 2;
+
+enum Capability : uint32_t {
+    // Varints instead of big-endian words, for the length prefix as well as
+    // every integer, length and handle in the frame.
+    CapabilityCompactEncoding = 1 << 0,
+    // Every frame starts with a channel id, an integer like any other, and
+    // each channel is a session of its own. Channel 0 is the connection's.
+    CapabilityChannels = 1 << 1,
+    // Every response ends with a ServerTiming trailer.
+    CapabilityServerTiming = 1 << 2,
+    // The server may send a PingResponse with packet id 0 on a quiet
+    // connection, which the client answers with a PingRequest of packet id
+    // 0 and the same nonce.
+    CapabilityKeepalive = 1 << 3,
+    // The client is another node of the cluster. Transmits it forwards were
+    // routed there already and run on this node's card.
+    CapabilityClusterPeer = 1 << 4,
+};
+
+enum class Encoding : uint8_t {
+    V1,
+    Compact,
+};
+
+// Integers written with writeBe are big-endian words in the v1 encoding and
+// varints in the compact one; sizes of strings and vectors likewise.
 class StreamWriter {
 public:
+    StreamWriter() = default;
+    explicit StreamWriter(Encoding encoding) : encoding(encoding) {
+    }
+
     void write(const std::string& value) {
         uint32_t size = static_cast<uint32_t>(value.size());
         write(size);
@@ -133,24 +178,38 @@ public:
         buffer.push_back(value ? 1 : 0);
     }
 
+    void writeVarint(uint64_t value) {
+        while (value >= 0x80) {
+            buffer.push_back(static_cast<uint8_t>(value) | 0x80);
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<uint8_t>(value));
+    }
+
     void writeBe(const std::string& value) {
-        uint32_t size = static_cast<uint32_t>(value.size());
-        write(swapEndian32(size));
+        writeBe(static_cast<uint32_t>(value.size()));
         buffer.insert(buffer.end(), value.begin(), value.end());
     }
 
     void writeBe(const std::vector<uint8_t>& value) {
-        uint32_t size = static_cast<uint32_t>(value.size());
-        write(swapEndian32(size));
+        writeBe(static_cast<uint32_t>(value.size()));
         buffer.insert(buffer.end(), value.begin(), value.end());
     }
 
     void writeBe(uint32_t value) {
+        if (encoding == Encoding::Compact) {
+            writeVarint(value);
+            return;
+        }
         uint32_t be = swapEndian32(value);
         write(be);
     }
 
     void writeBe(uint64_t value) {
+        if (encoding == Encoding::Compact) {
+            writeVarint(value);
+            return;
+        }
         uint64_t be = swapEndian64(value);
         write(be);
     }
@@ -160,13 +219,14 @@ public:
     }
 
     std::vector<uint8_t> buffer;
+    Encoding encoding{ Encoding::V1 };
 
 };
 
 class StreamReader {
 public:
-    explicit StreamReader(const std::vector<uint8_t>& data)
-        : buffer_(data), offset_(0) {
+    explicit StreamReader(const std::vector<uint8_t>& data, Encoding encoding = Encoding::V1)
+        : buffer_(data), offset_(0), encoding_(encoding) {
     }
 
     bool read(std::string& value) {
@@ -230,7 +290,24 @@ public:
         return true;
     }
 
+    bool readVarint(uint64_t& value) {
+        value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (offset_ >= buffer_.size()) return false;
+            uint8_t byte = buffer_[offset_++];
+            value |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
     bool readBe(uint32_t& value) {
+        if (encoding_ == Encoding::Compact) {
+            uint64_t varint;
+            if (!readVarint(varint) || varint > UINT32_MAX) return false;
+            value = static_cast<uint32_t>(varint);
+            return true;
+        }
         if (offset_ + 4 > buffer_.size()) return false;
         memcpy(&value, &buffer_[offset_], 4);
         value = swapEndian32(value);
@@ -239,6 +316,9 @@ public:
     }
 
     bool readBe(uint64_t& value) {
+        if (encoding_ == Encoding::Compact) {
+            return readVarint(value);
+        }
         if (offset_ + 8 > buffer_.size()) return false;
         memcpy(&value, &buffer_[offset_], 8);
         value = swapEndian64(value);
@@ -253,13 +333,66 @@ public:
         return true;
     }
 
+    // Like readBe of a vector, but leaves the bytes where they are.
+    bool readBeInPlace(const uint8_t*& data, uint32_t& size) {
+        if (!readBe(size)) return false;
+        if (offset_ + size > buffer_.size()) return false;
+
+        data = buffer_.data() + offset_;
+        offset_ += size;
+        return true;
+    }
+
     size_t remaining() const { return buffer_.size() - offset_; }
 
 private:
     const std::vector<uint8_t>& buffer_;
     size_t offset_;
+    Encoding encoding_;
 };
 
+// A compact frame starts with a varint length of at most three bytes, which
+// is enough for any frame the server accepts, and carries at least two more
+// varints. Reading this many bytes first therefore never reads past a frame.
+constexpr size_t compactHeaderSize = 3;
+
+// Decodes the length prefix at the start of a compact frame. Returns the
+// size of the prefix, or 0 if it is longer than compactHeaderSize.
+inline size_t readCompactLength(const uint8_t* bytes, uint32_t& length) {
+    length = 0;
+    for (size_t i = 0; i < compactHeaderSize; ++i) {
+        length |= uint32_t(bytes[i] & 0x7F) << (7 * i);
+        if (!(bytes[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Size of the length prefix at the start of a frame made by makeFrame.
+inline size_t framePrefixSize(const std::vector<uint8_t>& frame, Encoding encoding) {
+    if (encoding == Encoding::V1) {
+        return 4;
+    }
+    size_t size = 1;
+    while (size < frame.size() && (frame[size - 1] & 0x80)) {
+        ++size;
+    }
+    return size;
+}
+
+// Prepends the length prefix of the encoding to a packed frame.
+inline std::vector<uint8_t> makeFrame(const std::vector<uint8_t>& data, Encoding encoding) {
+    StreamWriter prefix(encoding);
+    prefix.writeBe(static_cast<uint32_t>(data.size()));
+
+    std::vector<uint8_t> frame;
+    frame.reserve(prefix.buffer.size() + data.size());
+    frame.insert(frame.end(), prefix.buffer.begin(), prefix.buffer.end());
+    frame.insert(frame.end(), data.begin(), data.end());
+    return frame;
+}
+
 class RequestBase {
 public:
     virtual ~RequestBase() = default;
@@ -527,7 +660,7 @@ protected:
         writer.writeBe(sendBuffer);
         writer.writeBe(isRecvPciNull);
         if (!isRecvPciNull) {
-            writer.writeBe(isRecvPciNull);
+            writer.writeBe(recvPciProtocol);
             writer.writeBe(recvPciLength);
         }
         writer.writeBe(recvLength);
@@ -535,6 +668,64 @@ protected:
 
 };
 
+// The fields of an SCardTransmitRequest read without copying the APDU:
+// sendBuffer points into the frame, which has to outlive the view.
+struct SCardTransmitView {
+    uint32_t packetId{0};
+    uint64_t hCard{0};
+    uint32_t sendPci{0};
+    const uint8_t* sendBuffer{nullptr};
+    uint32_t sendLength{0};
+    bool isRecvPciNull{true};
+    uint32_t recvPciProtocol{0};
+    uint32_t recvPciLength{0};
+    uint32_t recvLength{0};
+
+    bool unpack(uint32_t packetId, StreamReader& reader) {
+        this->packetId = packetId;
+        if (!reader.readBe(hCard)) {
+            return false;
+        }
+        if (!reader.readBe(sendPci)) {
+            return false;
+        }
+        if (!reader.readBeInPlace(sendBuffer, sendLength)) {
+            return false;
+        }
+        if (!reader.readBe(isRecvPciNull)) {
+            return false;
+        }
+        if (!isRecvPciNull) {
+            if (!reader.readBe(recvPciProtocol)) {
+                return false;
+            }
+            if (!reader.readBe(recvPciLength)) {
+                return false;
+            }
+        }
+        if (!reader.readBe(recvLength)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    // Valid while req is.
+    static SCardTransmitView of(const SCardTransmitRequest& req) {
+        SCardTransmitView view;
+        view.packetId = req.packetId;
+        view.hCard = req.hCard;
+        view.sendPci = req.sendPci;
+        view.sendBuffer = req.sendBuffer.data();
+        view.sendLength = static_cast<uint32_t>(req.sendBuffer.size());
+        view.isRecvPciNull = req.isRecvPciNull;
+        view.recvPciProtocol = req.recvPciProtocol;
+        view.recvPciLength = req.recvPciLength;
+        view.recvLength = req.recvLength;
+        return view;
+    }
+};
+
 class SCardGetAttribRequest : public TypedRequest<Opcode::SCardGetAttribReq> {
 public:
     uint64_t hCard{0};
@@ -564,6 +755,200 @@ protected:
 
 };
 
+// Sent as the first frame of a connection. The server grants the requested
+// capabilities it supports, and both sides use them from the next frame on.
+class HelloRequest : public TypedRequest<Opcode::HelloReq> {
+public:
+    uint32_t version{ protocolVersion };
+    uint32_t capabilities{ 0 };
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(version)) {
+            return false;
+        }
+        if (!reader.readBe(capabilities)) {
+            return false;
+        }
+        // Later versions may append fields.
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(version);
+        writer.writeBe(capabilities);
+    }
+
+};
+
+// Moves the connection to shared memory rings (see shmTransport.h). Only a
+// client on the same host can open them, and only before any card handle
+// exists. After the response the socket carries nothing and stays open to
+// tell either side that the other is gone.
+class ShmAttachRequest : public TypedRequest<Opcode::ShmAttachReq> {
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (reader.remaining() > 0) {
+            return false;
+        }
+        return true;
+    }
+
+};
+
+// Answered with a PingResponse carrying the same nonce. With packet id 0 it
+// is the answer to a keepalive of the server instead and gets no response.
+class PingRequest : public TypedRequest<Opcode::PingReq> {
+public:
+    uint64_t nonce{ 0 };
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(nonce)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(nonce);
+    }
+
+};
+
+class SessionStartRequest : public TypedRequest<Opcode::SessionStartReq> {
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (reader.remaining() > 0) {
+            return false;
+        }
+        return true;
+    }
+
+};
+
+class SessionResumeRequest : public TypedRequest<Opcode::SessionResumeReq> {
+public:
+    std::vector<uint8_t> token;
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(token)) {
+            return false;
+        }
+        if (reader.remaining() > 0) {
+            return false;
+        }
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(token);
+    }
+
+};
+
+// APDUs run back to back inside one transaction on the card worker, so the
+// card is locked for card time only instead of several client round trips.
+class SCardTransactionScriptRequest : public TypedRequest<Opcode::SCardTransactionScriptReq> {
+public:
+    static constexpr uint32_t maxApdus = 64;
+
+    uint64_t hCard{0};
+    uint32_t sendPci{0};
+    std::vector<std::vector<uint8_t>> apdus;
+    // Receive buffer size for each APDU.
+    uint32_t recvLength{0};
+    uint32_t dwDisposition{0};
+    // Stop after the first response whose status word is not 90 00 or 61 xx.
+    bool stopOnStatusError{false};
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(hCard)) {
+            return false;
+        }
+        if (!reader.readBe(sendPci)) {
+            return false;
+        }
+        uint32_t apduCount;
+        if (!reader.readBe(apduCount) || apduCount > maxApdus) {
+            return false;
+        }
+        apdus.resize(apduCount);
+        for (auto& apdu : apdus) {
+            if (!reader.readBe(apdu)) {
+                return false;
+            }
+        }
+        if (!reader.readBe(recvLength)) {
+            return false;
+        }
+        if (!reader.readBe(dwDisposition)) {
+            return false;
+        }
+        if (!reader.readBe(stopOnStatusError)) {
+            return false;
+        }
+        if (reader.remaining() > 0) {
+            return false;
+        }
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(hCard);
+        writer.writeBe(sendPci);
+        writer.writeBe(static_cast<uint32_t>(apdus.size()));
+        for (const auto& apdu : apdus) {
+            writer.writeBe(apdu);
+        }
+        writer.writeBe(recvLength);
+        writer.writeBe(dwDisposition);
+        writer.writeBe(stopOnStatusError);
+    }
+
+};
+
+// Where the server spent the time of a request, in microseconds. All zero for
+// responses that did not go through a card worker.
+struct ServerTiming {
+    // From the request frame being read to it being queued for the worker.
+    uint32_t receiveToEnqueue{0};
+    // From being queued to the worker starting on it, including any wait
+    // for a fair share turn.
+    uint32_t queueWait{0};
+    // Spent in PC/SC calls for the request.
+    uint32_t cardCall{0};
+
+    void pack(StreamWriter& writer) const {
+        writer.writeBe(receiveToEnqueue);
+        writer.writeBe(queueWait);
+        writer.writeBe(cardCall);
+    }
+
+    bool unpack(StreamReader& reader) {
+        return reader.readBe(receiveToEnqueue) && reader.readBe(queueWait) && reader.readBe(cardCall);
+    }
+};
+
+// Size of the ServerTiming trailer at the end of a response frame. Only the
+// last byte of a varint has the high bit clear, so compact trailers can be
+// found from the end too.
+inline size_t timingTrailerSize(const std::vector<uint8_t>& frame, Encoding encoding) {
+    if (encoding == Encoding::V1) {
+        return std::min<size_t>(frame.size(), 12);
+    }
+    size_t size = frame.size();
+    for (int i = 0; i < 3 && size > 0; ++i) {
+        --size;
+        while (size > 0 && (frame[size - 1] & 0x80)) {
+            --size;
+        }
+    }
+    return frame.size() - size;
+}
 
 class ResponseBase {
 public:
@@ -589,6 +974,9 @@ public:
     uint32_t packetId{0};
     uint32_t resultCode{0};
     uint32_t opcode{0};
+    // Follows the payload on connections that negotiated
+    // CapabilityServerTiming; pack and unpack leave it out.
+    ServerTiming timing;
 
 };
 
@@ -840,6 +1228,178 @@ protected:
 
 };
 
+class HelloResponse : public TypedResponse<Opcode::HelloRes> {
+public:
+    uint32_t apiReturn{0};
+    uint32_t version{0};
+    uint32_t capabilities{0};
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(apiReturn)) {
+            return false;
+        }
+        if (!reader.readBe(version)) {
+            return false;
+        }
+        if (!reader.readBe(capabilities)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(apiReturn);
+        writer.writeBe(version);
+        writer.writeBe(capabilities);
+    }
+
+};
+
+class ShmAttachResponse : public TypedResponse<Opcode::ShmAttachRes> {
+public:
+    uint32_t apiReturn{0};
+    // Name of the shared memory file for shm_open.
+    std::string name;
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(apiReturn)) {
+            return false;
+        }
+        if (!reader.readBe(name)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(apiReturn);
+        writer.writeBe(name);
+    }
+
+};
+
+class PingResponse : public TypedResponse<Opcode::PingRes> {
+public:
+    uint32_t apiReturn{0};
+    uint64_t nonce{0};
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(apiReturn)) {
+            return false;
+        }
+        if (!reader.readBe(nonce)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(apiReturn);
+        writer.writeBe(nonce);
+    }
+
+};
+
+class SessionStartResponse : public TypedResponse<Opcode::SessionStartRes> {
+public:
+    uint32_t apiReturn{0};
+    std::vector<uint8_t> token;
+    uint32_t gracePeriod{0};
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(apiReturn)) {
+            return false;
+        }
+        if (!reader.readBe(token)) {
+            return false;
+        }
+        if (!reader.readBe(gracePeriod)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(apiReturn);
+        writer.writeBe(token);
+        writer.writeBe(gracePeriod);
+    }
+
+};
+
+class SessionResumeResponse : public TypedResponse<Opcode::SessionResumeRes> {
+public:
+    uint32_t apiReturn{0};
+    std::vector<uint8_t> token;
+    uint32_t gracePeriod{0};
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(apiReturn)) {
+            return false;
+        }
+        if (!reader.readBe(token)) {
+            return false;
+        }
+        if (!reader.readBe(gracePeriod)) {
+            return false;
+        }
+
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(apiReturn);
+        writer.writeBe(token);
+        writer.writeBe(gracePeriod);
+    }
+
+};
+
+// One response per APDU that ran. apiReturn is the first failure of
+// SCardBeginTransaction, SCardTransmit or SCardEndTransaction.
+class SCardTransactionScriptResponse : public TypedResponse<Opcode::SCardTransactionScriptRes> {
+public:
+    uint32_t apiReturn{0};
+    std::vector<std::vector<uint8_t>> responses;
+
+protected:
+    virtual bool unpackPayload(StreamReader& reader) {
+        if (!reader.readBe(apiReturn)) {
+            return false;
+        }
+        uint32_t responseCount;
+        if (!reader.readBe(responseCount) || responseCount > SCardTransactionScriptRequest::maxApdus) {
+            return false;
+        }
+        responses.resize(responseCount);
+        for (auto& response : responses) {
+            if (!reader.readBe(response)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    virtual void packPayload(StreamWriter& writer) const {
+        writer.writeBe(apiReturn);
+        writer.writeBe(static_cast<uint32_t>(responses.size()));
+        for (const auto& response : responses) {
+            writer.writeBe(response);
+        }
+    }
+
+};
+
 class ResponseFactory {
 public:
     static std::shared_ptr<ResponseBase> create(Opcode opcode) {
@@ -866,6 +1426,12 @@ private:
         { Opcode::SCardEndTransactionRes,       []{ return std::make_shared<SCardEndTransactionResponse>(); } },
         { Opcode::SCardTransmitRes,             []{ return std::make_shared<SCardTransmitResponse>(); } },
         { Opcode::SCardGetAttribRes,            []{ return std::make_shared<SCardGetAttribResponse>(); } },
+        { Opcode::SessionStartRes,              []{ return std::make_shared<SessionStartResponse>(); } },
+        { Opcode::SessionResumeRes,             []{ return std::make_shared<SessionResumeResponse>(); } },
+        { Opcode::SCardTransactionScriptRes,    []{ return std::make_shared<SCardTransactionScriptResponse>(); } },
+        { Opcode::HelloRes,                     []{ return std::make_shared<HelloResponse>(); } },
+        { Opcode::ShmAttachRes,                 []{ return std::make_shared<ShmAttachResponse>(); } },
+        { Opcode::PingRes,                      []{ return std::make_shared<PingResponse>(); } },
     };
 };
 
@@ -13,6 +13,22 @@
 #include "casProxy.h"
 #include "config.h"
 #include "session.h"
+#include "readerMonitor.h"
+#include "attribCache.h"
+#include "contextPool.h"
+#include "sessionStore.h"
+#include "upstream.h"
+#include "cluster.h"
+#include "trafficCapture.h"
+#include "trafficMirror.h"
+#include "bufferPool.h"
+#include "timerWheel.h"
+#include "metrics.h"
+#include "threadScheduling.h"
+#include "logger.h"
+#include "cardScheduler.h"
+#include "readerHealth.h"
+#include "serverContext.h"
 
 #ifdef _WIN32
 constexpr const char* defaultConfigPath = "config.yml";
@@ -20,24 +36,6 @@ constexpr const char* defaultConfigPath = "config.yml";
 constexpr const char* defaultConfigPath = "/usr/local/etc/casproxyserver.yml";
 #endif
 
-namespace {
-
-std::string currentTime() {
-    using clock = std::chrono::system_clock;
-    auto now = clock::to_time_t(clock::now());
-    std::tm tm{};
-#ifdef _WIN32
-    localtime_s(&tm, &now);
-#else
-    localtime_r(&now, &tm);
-#endif
-    std::ostringstream oss;
-    oss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
-    return oss.str();
-}
-
-}
-
 class CasProxyServer {
 public:
     CasProxyServer() {
@@ -45,6 +43,10 @@ public:
 
     void run(const std::string configFilePath) {
         config.loadConfig(configFilePath);
+        logger.setLevel(config.logLevel);
+        cardScheduler.configure(config.fairShare);
+        readerHealth.configure(config.readerHealth, config.readerGroups);
+        mirror.configure(config.mirror);
 
         asio::error_code ec;
         asio::ip::address addr = asio::ip::make_address(config.listenIp, ec);
@@ -57,7 +59,35 @@ public:
         acceptor->bind({ addr, config.port });
         acceptor->listen();
 
-        std::cout << "casproxyserver listening on " << config.listenIp << ":" << config.port << std::endl;
+        if (config.readerMonitor) {
+            readerMonitor.start();
+        }
+        contextPool.start(config.contextPool);
+        upstreams.start(config.upstreams);
+        cluster.start(config.cluster);
+        if (config.leases.any() || config.keepalive.interval) {
+            timerWheel.start();
+        }
+        if (!config.metricsFile.empty()) {
+            metrics.start(config.metricsFile, std::chrono::seconds(config.metricsInterval));
+        }
+        // Card workers are started from the I/O thread and would inherit its
+        // pinning.
+        if (!config.scheduling.ioCpus.empty() && config.scheduling.workerCpus.empty()) {
+            config.scheduling.workerCpus = currentThreadCpus();
+        }
+        if (!pinCurrentThread(config.scheduling.ioCpus)) {
+            logger.log(LogLevel::Warning, "Cannot pin the I/O thread to the configured CPUs");
+        }
+        if (!config.capturePath.empty()) {
+            capture.open(config.capturePath, config.captureMaxSize * 1024 * 1024);
+            logger.log(LogLevel::Info, "Capturing traffic to " + config.capturePath);
+        }
+        if (mirror.isEnabled()) {
+            logger.log(LogLevel::Info, "Mirroring traffic to " + config.mirror.host + ":" + std::to_string(config.mirror.port));
+        }
+
+        logger.log(LogLevel::Info, "casproxyserver listening on " + config.listenIp + ":" + std::to_string(config.port));
         startAccept();
         io_context.run();
     }
@@ -73,13 +103,13 @@ private:
                         socket.close();
                     }
                     else {
-                        auto session = std::make_shared<Session>(std::move(socket),
+                        auto session = std::make_shared<Session>(std::move(socket), serverContext,
                             [this](std::shared_ptr<Session> s) { onClose(s); });
                         session->ip = ip;
                         mapSession[session.get()] = session;
 
-                        std::cout << session->ip << " - " << currentTime() << " - New connection" << "\n";
-                        session->doRead();
+                        logger.connectionOpened(session->getId(), session->ip);
+                        session->start();
                     }
                 }
                 startAccept();
@@ -88,13 +118,29 @@ private:
     }
 
     void onClose(std::shared_ptr<Session> session) {
-        std::cout << session->ip << " - " << currentTime() << " - Connection closed" << "\n";
+        logger.connectionClosed(session->getId(), session->ip);
         mapSession.erase(session.get());
     }
 
+    // First so that it outlives everything that logs.
+    Logger logger;
     asio::io_context io_context;
     std::unique_ptr<asio::ip::tcp::acceptor> acceptor;
     Config config;
+    ReaderMonitor readerMonitor;
+    AttribCache attribCache{ readerMonitor };
+    ContextPool contextPool;
+    SessionStore sessionStore{ io_context, contextPool };
+    Upstreams upstreams{ io_context };
+    Cluster cluster{ io_context };
+    TrafficCapture capture;
+    TrafficMirror mirror{ io_context };
+    BufferPool bufferPool;
+    TimerWheel timerWheel{ io_context };
+    CardScheduler cardScheduler;
+    ReaderHealth readerHealth{ logger };
+    Metrics metrics{ io_context, logger, cardScheduler, readerHealth, mirror };
+    ServerContext serverContext{ config, readerMonitor, attribCache, contextPool, sessionStore, upstreams, cluster, capture, mirror, bufferPool, timerWheel, metrics, logger, cardScheduler, readerHealth };
     std::map<void*, std::shared_ptr<Session>> mapSession;
     std::mutex mutex;
 
@@ -0,0 +1,197 @@
+#include "cluster.h"
+#include "upstream.h"
+#include <cmath>
+#include <algorithm>
+
+namespace {
+
+constexpr size_t virtualNodes = 128;
+constexpr double loadHalfLife = 1.0;
+
+// FNV-1a, so that every node places keys on the ring the same way.
+uint64_t hashBytes(const uint8_t* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t hashString(const std::string& value) {
+    return hashBytes(reinterpret_cast<const uint8_t*>(value.data()), value.size());
+}
+
+}
+
+ClusterNode::ClusterNode(asio::io_context& io_context, const Config::ClusterNode& node)
+    : node(node), connection(std::make_shared<UpstreamConnection>(io_context, node.upstream, casproxy::CapabilityClusterPeer)) {
+}
+
+void ClusterNode::start() {
+    connection->start();
+}
+
+bool ClusterNode::isAvailable() const {
+    return connection->isReady();
+}
+
+void ClusterNode::transmit(const casproxy::SCardTransmitRequest& req, ResponseHandler onResponse) {
+    if (!connection->isReady()) {
+        onResponse(nullptr);
+        return;
+    }
+
+    if (remoteCard && remoteCardEpoch == connection->getEpoch()) {
+        send(req, std::move(onResponse));
+        return;
+    }
+
+    pendingTransmits.push_back({ req, std::move(onResponse) });
+    if (!connectingCard) {
+        connectCard();
+    }
+}
+
+void ClusterNode::connectCard() {
+    casproxy::SCardConnectRequest req;
+    req.hContext = connection->getRemoteContext();
+    req.szReader = node.upstream.readers.front();
+    req.dwShareMode = SCARD_SHARE_SHARED;
+    req.dwPreferredProtocols = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+
+    connectingCard = true;
+    uint64_t epoch = connection->getEpoch();
+    connection->send(req, [this, epoch](std::shared_ptr<casproxy::ResponseBase> res) {
+        connectingCard = false;
+        auto connectRes = std::dynamic_pointer_cast<casproxy::SCardConnectResponse>(res);
+        if (connectRes && connectRes->apiReturn == SCARD_S_SUCCESS) {
+            remoteCard = connectRes->hCard;
+            remoteCardEpoch = epoch;
+        }
+        else {
+            remoteCard = 0;
+        }
+
+        auto pending = std::move(pendingTransmits);
+        pendingTransmits.clear();
+        for (auto& transmit : pending) {
+            if (remoteCard) {
+                send(transmit.req, std::move(transmit.onResponse));
+            }
+            else {
+                transmit.onResponse(nullptr);
+            }
+        }
+    });
+}
+
+void ClusterNode::send(const casproxy::SCardTransmitRequest& req, ResponseHandler onResponse) {
+    casproxy::SCardTransmitRequest upstreamReq = req;
+    upstreamReq.hCard = remoteCard;
+    connection->send(upstreamReq, [this, onResponse](std::shared_ptr<casproxy::ResponseBase> res) {
+        auto transmitRes = std::dynamic_pointer_cast<casproxy::SCardTransmitResponse>(res);
+        if (!transmitRes) {
+            onResponse(nullptr);
+            return;
+        }
+
+        // The shared handle is gone (peer restarted its card, reader removed);
+        // reconnect it on the next transmit and let the caller run this one.
+        if (transmitRes->apiReturn == static_cast<uint32_t>(SCARD_E_INVALID_HANDLE)
+            || transmitRes->apiReturn == static_cast<uint32_t>(SCARD_W_RESET_CARD)
+            || transmitRes->apiReturn == static_cast<uint32_t>(SCARD_W_REMOVED_CARD)) {
+            remoteCard = 0;
+            onResponse(nullptr);
+            return;
+        }
+        onResponse(res);
+    });
+}
+
+Cluster::Cluster(asio::io_context& io_context) : io_context(io_context) {
+}
+
+void Cluster::start(const Config::Cluster& cluster) {
+    if (cluster.nodes.empty()) {
+        return;
+    }
+
+    config = &cluster;
+    for (size_t i = 0; i < cluster.nodes.size(); ++i) {
+        const auto& node = cluster.nodes[i];
+        if (node.id == cluster.self) {
+            nodes.push_back(nullptr);
+        }
+        else {
+            auto clusterNode = std::make_shared<ClusterNode>(io_context, node);
+            clusterNode->start();
+            nodes.push_back(clusterNode);
+        }
+
+        for (size_t v = 0; v < virtualNodes; ++v) {
+            ring.emplace_back(hashString(node.id + "#" + std::to_string(v)), i);
+        }
+    }
+    loads.resize(nodes.size());
+    std::sort(ring.begin(), ring.end());
+}
+
+std::shared_ptr<ClusterNode> Cluster::route(const std::vector<uint8_t>& apdu, bool selfAvailable) {
+    if (ring.empty() || !isRouted(apdu)) {
+        return nullptr;
+    }
+
+    size_t keyOffset = std::min(config->keyOffset, apdu.size());
+    size_t keyLength = std::min(config->keyLength, apdu.size() - keyOffset);
+    uint64_t key = hashBytes(apdu.data() + keyOffset, keyLength);
+
+    auto now = std::chrono::steady_clock::now();
+    double totalLoad = 0;
+    size_t availableNodes = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (nodes[i] ? nodes[i]->isAvailable() : selfAvailable) {
+            totalLoad += currentLoad(i, now);
+            ++availableNodes;
+        }
+    }
+    if (availableNodes == 0) {
+        return nullptr;
+    }
+    double capacity = std::ceil(config->loadFactor * (totalLoad + 1) / availableNodes);
+
+    // Walk clockwise from the key to the first available node with room.
+    auto start = std::lower_bound(ring.begin(), ring.end(), std::make_pair(key, size_t{ 0 }));
+    size_t owner = nodes.size();
+    for (size_t step = 0; step < ring.size(); ++step) {
+        auto it = ring.begin() + ((start - ring.begin()) + step) % ring.size();
+        size_t index = it->second;
+        if (nodes[index] ? !nodes[index]->isAvailable() : !selfAvailable) {
+            continue;
+        }
+        if (owner == nodes.size()) {
+            owner = index;
+        }
+        if (loads[index].load + 1 <= capacity) {
+            owner = index;
+            break;
+        }
+    }
+
+    loads[owner].load += 1;
+    return nodes[owner];
+}
+
+bool Cluster::isRouted(const std::vector<uint8_t>& apdu) const {
+    if (apdu.size() < 2) {
+        return false;
+    }
+    return std::find(config->routeIns.begin(), config->routeIns.end(), apdu[1]) != config->routeIns.end();
+}
+
+double Cluster::currentLoad(size_t index, std::chrono::steady_clock::time_point now) {
+    auto& nodeLoad = loads[index];
+    std::chrono::duration<double> elapsed = now - nodeLoad.updatedAt;
+    nodeLoad.load *= std::exp2(-elapsed.count() / loadHalfLife);
+    nodeLoad.updatedAt = now;
+    return nodeLoad.load;
+}
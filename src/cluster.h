@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <asio.hpp>
+#include "casProxy.h"
+#include "config.h"
+
+class UpstreamConnection;
+
+// A peer in the cluster. Routed transmits share one card handle that is
+// opened on the peer's reader over an upstream connection.
+class ClusterNode {
+public:
+    using ResponseHandler = std::function<void(std::shared_ptr<casproxy::ResponseBase>)>;
+
+    ClusterNode(asio::io_context& io_context, const Config::ClusterNode& node);
+    void start();
+    bool isAvailable() const;
+    // The handler is called with nullptr if the peer cannot run the APDU.
+    void transmit(const casproxy::SCardTransmitRequest& req, ResponseHandler onResponse);
+    const std::string& getId() const { return node.id; }
+
+private:
+    struct PendingTransmit {
+        casproxy::SCardTransmitRequest req;
+        ResponseHandler onResponse;
+    };
+
+    void connectCard();
+    void send(const casproxy::SCardTransmitRequest& req, ResponseHandler onResponse);
+
+    const Config::ClusterNode& node;
+    std::shared_ptr<UpstreamConnection> connection;
+    uint64_t remoteCard{ 0 };
+    uint64_t remoteCardEpoch{ 0 };
+    bool connectingCard{ false };
+    std::deque<PendingTransmit> pendingTransmits;
+
+};
+
+// Routes transmits to the node that owns the APDU's routing key on a
+// consistent-hash ring. A node whose recent share of the traffic exceeds
+// loadFactor times the average is skipped for the next node on the ring, so
+// keys of a node that leaves spread over the remaining ones. Only used from
+// the I/O thread.
+class Cluster {
+public:
+    explicit Cluster(asio::io_context& io_context);
+    void start(const Config::Cluster& cluster);
+    bool isEnabled() const { return !nodes.empty(); }
+    // Returns nullptr when the APDU is not routed or this node owns it. When
+    // this node is not available it only owns APDUs no other node can take.
+    std::shared_ptr<ClusterNode> route(const std::vector<uint8_t>& apdu, bool selfAvailable = true);
+
+private:
+    struct NodeLoad {
+        double load{ 0 };
+        std::chrono::steady_clock::time_point updatedAt;
+    };
+
+    bool isRouted(const std::vector<uint8_t>& apdu) const;
+    double currentLoad(size_t index, std::chrono::steady_clock::time_point now);
+
+    asio::io_context& io_context;
+    const Config::Cluster* config{ nullptr };
+    // nullptr marks this node.
+    std::vector<std::shared_ptr<ClusterNode>> nodes;
+    std::vector<NodeLoad> loads;
+    std::vector<std::pair<uint64_t, size_t>> ring;
+
+};
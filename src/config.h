@@ -1,7 +1,14 @@
 #pragma once
 #include <yaml-cpp/yaml.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <array>
+#include <optional>
+#include <map>
 #include <charconv>
+#include "casProxy.h"
+#include "logger.h"
 
 class Config {
 public:
@@ -15,10 +22,129 @@ public:
         std::array<uint8_t, 16> mask;
     };
 
+    struct Upstream {
+        std::string host;
+        uint16_t port;
+        size_t connections = 2;
+        std::vector<std::string> readers;
+    };
+
+    struct ClusterNode {
+        std::string id;
+        // Connection to the node and the reader that runs routed APDUs.
+        Upstream upstream;
+    };
+
+    // Seconds without a request before the object is given up; 0 disables.
+    struct Leases {
+        uint32_t session = 0;
+        uint32_t context = 0;
+        uint32_t cardHandle = 0;
+        // Ends a transaction whose card handle sees no request.
+        uint32_t transaction = 0;
+
+        bool any() const { return session || context || cardHandle || transaction; }
+    };
+
+    // Finding peers that are gone without closing their connection.
+    struct Keepalive {
+        // Seconds a connection may be quiet before it is probed; 0 disables.
+        uint32_t interval = 0;
+        // Seconds a probe may go unanswered before the session is closed.
+        uint32_t timeout = 10;
+    };
+
+    struct Scheduling {
+        std::vector<int> ioCpus;
+        std::vector<int> workerCpus;
+        // SCHED_FIFO priority of card workers, 1-99; 0 keeps normal scheduling.
+        int workerPriority = 0;
+    };
+
+    // Card time of the handles sharing a reader, split between clients in
+    // proportion to their weight.
+    struct FairShare {
+        bool enabled = false;
+        // Account card time to each session instead of to the client IP.
+        bool perSession = false;
+        double defaultWeight = 1.0;
+        // By client IP.
+        std::map<std::string, double> weights;
+    };
+
+    // A reader whose transmit latency or failure rate, both moving averages,
+    // crosses its threshold is quarantined until probes succeed again.
+    struct ReaderHealth {
+        bool enabled = false;
+        // Milliseconds.
+        uint32_t latency = 200;
+        double errorRate = 0.2;
+        // Transmits seen before a reader can be quarantined.
+        uint32_t minSamples = 20;
+        // Seconds.
+        uint32_t probeInterval = 10;
+        // Consecutive successful probes that reinstate a reader.
+        uint32_t probes = 3;
+    };
+
+    // Reconnecting a card handle on its worker when a transmit finds the card
+    // reset or removed, and sending the transmit again.
+    struct CardRecovery {
+        bool enabled = false;
+        // Reconnects tried for one transmit.
+        uint32_t attempts = 3;
+        // Milliseconds between reconnects while the card is out.
+        uint32_t retryDelay = 100;
+        // INS bytes of the APDUs that are sent again; empty for all.
+        std::vector<uint8_t> retryIns;
+    };
+
+    // A shadow casproxyserver that is sent a copy of every request.
+    struct Mirror {
+        std::string host;
+        uint16_t port = 0;
+        // Requests the shadow can be behind by on a connection before that
+        // connection is no longer mirrored.
+        size_t queueSize = 256;
+    };
+
+    struct Cluster {
+        std::string self;
+        std::vector<ClusterNode> nodes;
+        // INS bytes of the APDUs that are routed, by default ECM commands.
+        std::vector<uint8_t> routeIns{ 0x34 };
+        // The bytes of the APDU that identify the service.
+        size_t keyOffset = 5;
+        size_t keyLength = 3;
+        double loadFactor = 1.25;
+    };
+
     std::string listenIp = "0.0.0.0";
     uint16_t port = 24000;
     std::vector<Ipv4Cidr> allowedIpv4Ranges;
     std::vector<Ipv6Cidr> allowedIpv6Ranges;
+    bool readerMonitor = true;
+    size_t contextPool = 4;
+    uint32_t sessionResumeTimeout = 30;
+    // Let clients on the same host move their connection to shared memory.
+    bool sharedMemory = false;
+    std::vector<Upstream> upstreams;
+    Cluster cluster;
+    LogLevel logLevel = LogLevel::Info;
+    Leases leases;
+    Keepalive keepalive;
+    Scheduling scheduling;
+    FairShare fairShare;
+    ReaderHealth readerHealth;
+    CardRecovery cardRecovery;
+    // Readers holding interchangeable cards.
+    std::vector<std::vector<std::string>> readerGroups;
+    std::string metricsFile;
+    uint32_t metricsInterval = 15;
+    std::string capturePath;
+    // Megabytes.
+    uint64_t captureMaxSize = 256;
+    Mirror mirror;
 
 public:
     void loadConfig(const std::string& configFile) {
@@ -35,6 +161,236 @@ public:
         if (yaml["port"]) {
             port = yaml["port"].as<uint16_t>();
         }
+        if (yaml["readerMonitor"]) {
+            readerMonitor = yaml["readerMonitor"].as<bool>();
+        }
+        if (yaml["contextPool"]) {
+            contextPool = yaml["contextPool"].as<size_t>();
+        }
+        if (yaml["sessionResumeTimeout"]) {
+            sessionResumeTimeout = yaml["sessionResumeTimeout"].as<uint32_t>();
+        }
+        if (yaml["sharedMemory"]) {
+            sharedMemory = yaml["sharedMemory"].as<bool>();
+        }
+        if (yaml["upstreams"]) {
+            for (const auto& node : yaml["upstreams"]) {
+                std::string address = node["address"].as<std::string>();
+                auto hostPort = casproxy::parseAddress(address);
+                if (!hostPort) {
+                    throw std::runtime_error("Invalid upstream address '" + address + "'");
+                }
+
+                Upstream upstream;
+                upstream.host = hostPort->first;
+                upstream.port = hostPort->second;
+                if (node["connections"]) {
+                    upstream.connections = node["connections"].as<size_t>();
+                }
+                for (const auto& reader : node["readers"]) {
+                    upstream.readers.push_back(reader.as<std::string>());
+                }
+                upstreams.push_back(upstream);
+            }
+        }
+        if (yaml["cluster"]) {
+            const auto& node = yaml["cluster"];
+            cluster.self = node["self"].as<std::string>();
+            if (node["routeIns"]) {
+                cluster.routeIns.clear();
+                for (const auto& ins : node["routeIns"]) {
+                    cluster.routeIns.push_back(static_cast<uint8_t>(ins.as<uint32_t>()));
+                }
+            }
+            if (node["keyOffset"]) {
+                cluster.keyOffset = node["keyOffset"].as<size_t>();
+            }
+            if (node["keyLength"]) {
+                cluster.keyLength = node["keyLength"].as<size_t>();
+            }
+            if (node["loadFactor"]) {
+                cluster.loadFactor = node["loadFactor"].as<double>();
+                if (cluster.loadFactor < 1.0) {
+                    throw std::runtime_error("Cluster loadFactor must be at least 1.0");
+                }
+            }
+
+            bool hasSelf = false;
+            for (const auto& member : node["nodes"]) {
+                std::string address = member["address"].as<std::string>();
+                auto hostPort = casproxy::parseAddress(address);
+                if (!hostPort) {
+                    throw std::runtime_error("Invalid cluster node address '" + address + "'");
+                }
+
+                ClusterNode clusterNode;
+                clusterNode.id = member["id"].as<std::string>();
+                clusterNode.upstream.host = hostPort->first;
+                clusterNode.upstream.port = hostPort->second;
+                clusterNode.upstream.connections = 1;
+                clusterNode.upstream.readers.push_back(member["reader"].as<std::string>());
+                hasSelf = hasSelf || clusterNode.id == cluster.self;
+                cluster.nodes.push_back(clusterNode);
+            }
+            if (!hasSelf) {
+                throw std::runtime_error("Cluster node '" + cluster.self + "' is not in the node list");
+            }
+        }
+        if (yaml["logLevel"]) {
+            std::string name = yaml["logLevel"].as<std::string>();
+            auto level = Logger::parseLevel(name);
+            if (!level) {
+                throw std::runtime_error("Invalid logLevel '" + name + "'");
+            }
+            logLevel = *level;
+        }
+        if (yaml["leases"]) {
+            const auto& node = yaml["leases"];
+            if (node["session"]) {
+                leases.session = node["session"].as<uint32_t>();
+            }
+            if (node["context"]) {
+                leases.context = node["context"].as<uint32_t>();
+            }
+            if (node["cardHandle"]) {
+                leases.cardHandle = node["cardHandle"].as<uint32_t>();
+            }
+            if (node["transaction"]) {
+                leases.transaction = node["transaction"].as<uint32_t>();
+            }
+        }
+        if (yaml["keepalive"]) {
+            const auto& node = yaml["keepalive"];
+            if (node["interval"]) {
+                keepalive.interval = node["interval"].as<uint32_t>();
+            }
+            if (node["timeout"]) {
+                keepalive.timeout = node["timeout"].as<uint32_t>();
+                if (keepalive.timeout == 0) {
+                    throw std::runtime_error("keepalive timeout must be at least 1");
+                }
+            }
+        }
+        if (yaml["scheduling"]) {
+            const auto& node = yaml["scheduling"];
+            if (node["ioCpus"]) {
+                scheduling.ioCpus = node["ioCpus"].as<std::vector<int>>();
+            }
+            if (node["workerCpus"]) {
+                scheduling.workerCpus = node["workerCpus"].as<std::vector<int>>();
+            }
+            if (node["workerPriority"]) {
+                scheduling.workerPriority = node["workerPriority"].as<int>();
+                if (scheduling.workerPriority < 0 || scheduling.workerPriority > 99) {
+                    throw std::runtime_error("workerPriority must be between 0 and 99");
+                }
+            }
+        }
+        if (yaml["fairShare"]) {
+            const auto& node = yaml["fairShare"];
+            if (node["enabled"]) {
+                fairShare.enabled = node["enabled"].as<bool>();
+            }
+            if (node["by"]) {
+                std::string by = node["by"].as<std::string>();
+                if (by != "ip" && by != "session") {
+                    throw std::runtime_error("fairShare by must be 'ip' or 'session'");
+                }
+                fairShare.perSession = by == "session";
+            }
+            if (node["defaultWeight"]) {
+                fairShare.defaultWeight = node["defaultWeight"].as<double>();
+            }
+            if (node["weights"]) {
+                for (const auto& weight : node["weights"]) {
+                    fairShare.weights[weight.first.as<std::string>()] = weight.second.as<double>();
+                }
+            }
+            if (fairShare.defaultWeight <= 0) {
+                throw std::runtime_error("fairShare weights must be positive");
+            }
+            for (const auto& [ip, weight] : fairShare.weights) {
+                if (weight <= 0) {
+                    throw std::runtime_error("fairShare weights must be positive");
+                }
+            }
+        }
+        if (yaml["readerHealth"]) {
+            const auto& node = yaml["readerHealth"];
+            readerHealth.enabled = true;
+            if (node["latency"]) {
+                readerHealth.latency = node["latency"].as<uint32_t>();
+            }
+            if (node["errorRate"]) {
+                readerHealth.errorRate = node["errorRate"].as<double>();
+            }
+            if (node["minSamples"]) {
+                readerHealth.minSamples = node["minSamples"].as<uint32_t>();
+            }
+            if (node["probeInterval"]) {
+                readerHealth.probeInterval = node["probeInterval"].as<uint32_t>();
+            }
+            if (node["probes"]) {
+                readerHealth.probes = node["probes"].as<uint32_t>();
+                if (readerHealth.probes == 0) {
+                    throw std::runtime_error("readerHealth probes must be at least 1");
+                }
+            }
+        }
+        if (yaml["cardRecovery"]) {
+            const auto& node = yaml["cardRecovery"];
+            cardRecovery.enabled = true;
+            if (node["attempts"]) {
+                cardRecovery.attempts = node["attempts"].as<uint32_t>();
+                if (cardRecovery.attempts == 0) {
+                    throw std::runtime_error("cardRecovery attempts must be at least 1");
+                }
+            }
+            if (node["retryDelay"]) {
+                cardRecovery.retryDelay = node["retryDelay"].as<uint32_t>();
+            }
+            if (node["retryIns"]) {
+                for (const auto& ins : node["retryIns"]) {
+                    cardRecovery.retryIns.push_back(static_cast<uint8_t>(ins.as<uint32_t>()));
+                }
+            }
+        }
+        if (yaml["readerGroups"]) {
+            for (const auto& group : yaml["readerGroups"]) {
+                readerGroups.push_back(group.as<std::vector<std::string>>());
+            }
+        }
+        if (yaml["metricsFile"]) {
+            metricsFile = yaml["metricsFile"].as<std::string>();
+        }
+        if (yaml["metricsInterval"]) {
+            metricsInterval = yaml["metricsInterval"].as<uint32_t>();
+            if (metricsInterval == 0) {
+                throw std::runtime_error("metricsInterval must be at least 1");
+            }
+        }
+        if (yaml["capturePath"]) {
+            capturePath = yaml["capturePath"].as<std::string>();
+        }
+        if (yaml["captureMaxSize"]) {
+            captureMaxSize = yaml["captureMaxSize"].as<uint64_t>();
+        }
+        if (yaml["mirror"]) {
+            const auto& node = yaml["mirror"];
+            std::string address = node["address"].as<std::string>();
+            auto hostPort = casproxy::parseAddress(address);
+            if (!hostPort) {
+                throw std::runtime_error("Invalid mirror address '" + address + "'");
+            }
+            mirror.host = hostPort->first;
+            mirror.port = hostPort->second;
+            if (node["queueSize"]) {
+                mirror.queueSize = node["queueSize"].as<size_t>();
+                if (mirror.queueSize == 0) {
+                    throw std::runtime_error("mirror queueSize must be at least 1");
+                }
+            }
+        }
         if (yaml["allowedIps"]) {
             for (const auto& node : yaml["allowedIps"]) {
                 std::string cidr = node.as<std::string>();
@@ -0,0 +1,152 @@
+#include "contextPool.h"
+#include <vector>
+#include <chrono>
+
+namespace {
+
+constexpr auto checkInterval = std::chrono::seconds(10);
+
+}
+
+ContextPool::~ContextPool() {
+    stop();
+}
+
+void ContextPool::start(size_t poolSize) {
+    if (poolSize == 0 || running.exchange(true)) {
+        return;
+    }
+
+    this->poolSize = poolSize;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        scopes.insert(SCARD_SCOPE_USER);
+        scopes.insert(SCARD_SCOPE_SYSTEM);
+    }
+
+    workerThread = std::thread([this]() {
+        run();
+    });
+}
+
+void ContextPool::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+
+    cv.notify_all();
+    if (workerThread.joinable()) {
+        workerThread.join();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& [dwScope, contexts] : idleContexts) {
+        for (SCARDCONTEXT hContext : contexts) {
+            SCardReleaseContext(hContext);
+        }
+    }
+    idleContexts.clear();
+}
+
+LONG ContextPool::lease(DWORD dwScope, SCARDCONTEXT& hContext) {
+    if (running) {
+        std::unique_lock<std::mutex> lock(mutex);
+        scopes.insert(dwScope);
+        auto& contexts = idleContexts[dwScope];
+        while (!contexts.empty()) {
+            SCARDCONTEXT candidate = contexts.front();
+            contexts.pop_front();
+            if (SCardIsValidContext(candidate) == SCARD_S_SUCCESS) {
+                hContext = candidate;
+                refillRequested = true;
+                lock.unlock();
+                cv.notify_one();
+                return SCARD_S_SUCCESS;
+            }
+            SCardReleaseContext(candidate);
+        }
+        refillRequested = true;
+        lock.unlock();
+        cv.notify_one();
+    }
+
+    return SCardEstablishContext(dwScope, nullptr, nullptr, &hContext);
+}
+
+void ContextPool::release(DWORD dwScope, SCARDCONTEXT hContext) {
+    if (!hContext) {
+        return;
+    }
+
+    if (running && SCardIsValidContext(hContext) == SCARD_S_SUCCESS) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& contexts = idleContexts[dwScope];
+        if (contexts.size() < poolSize) {
+            contexts.push_back(hContext);
+            return;
+        }
+    }
+
+    SCardReleaseContext(hContext);
+}
+
+void ContextPool::run() {
+    while (running) {
+        refill();
+        checkIdle();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_for(lock, checkInterval, [this] { return !running || refillRequested; });
+        refillRequested = false;
+    }
+}
+
+void ContextPool::refill() {
+    std::vector<DWORD> pendingScopes;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pendingScopes.assign(scopes.begin(), scopes.end());
+    }
+
+    for (DWORD dwScope : pendingScopes) {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!running || idleContexts[dwScope].size() >= poolSize) {
+                    break;
+                }
+            }
+
+            // Establish outside the lock; this is the round trip the pool hides.
+            SCARDCONTEXT hContext = 0;
+            if (SCardEstablishContext(dwScope, nullptr, nullptr, &hContext) != SCARD_S_SUCCESS) {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            idleContexts[dwScope].push_back(hContext);
+        }
+    }
+}
+
+void ContextPool::checkIdle() {
+    std::vector<SCARDCONTEXT> invalidContexts;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& [dwScope, contexts] : idleContexts) {
+            for (auto it = contexts.begin(); it != contexts.end();) {
+                if (SCardIsValidContext(*it) != SCARD_S_SUCCESS) {
+                    invalidContexts.push_back(*it);
+                    it = contexts.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    for (SCARDCONTEXT hContext : invalidContexts) {
+        SCardReleaseContext(hContext);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <winscard.h>
+
+// Keeps native contexts established ahead of time so that a client's
+// SCardEstablishContext does not wait on the PC/SC service. Contexts are
+// leased exclusively and returned on release; idle contexts are checked
+// with SCardIsValidContext before reuse and periodically in the background.
+class ContextPool {
+public:
+    ContextPool() = default;
+    ~ContextPool();
+    void start(size_t poolSize);
+    void stop();
+    LONG lease(DWORD dwScope, SCARDCONTEXT& hContext);
+    void release(DWORD dwScope, SCARDCONTEXT hContext);
+
+private:
+    void run();
+    void refill();
+    void checkIdle();
+
+    size_t poolSize{ 0 };
+    std::thread workerThread;
+    std::atomic<bool> running{ false };
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<DWORD, std::deque<SCARDCONTEXT>> idleContexts;
+    std::set<DWORD> scopes;
+    bool refillRequested{ false };
+
+};
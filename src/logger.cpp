@@ -0,0 +1,206 @@
+#include "logger.h"
+#include <chrono>
+#include <ctime>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+namespace {
+
+constexpr auto flushInterval = std::chrono::milliseconds(50);
+
+const char* levelName(LogLevel level) {
+    switch (level) {
+    case LogLevel::Error:
+        return "error";
+    case LogLevel::Warning:
+        return "warning";
+    case LogLevel::Info:
+        return "info";
+    case LogLevel::Debug:
+        return "debug";
+    }
+    return "";
+}
+
+}
+
+Logger::Logger() : slots(new Slot[capacity]) {
+    for (size_t i = 0; i < capacity; ++i) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    thread = std::thread([this] { run(); });
+}
+
+Logger::~Logger() {
+    running = false;
+    cv.notify_one();
+    thread.join();
+}
+
+std::optional<LogLevel> Logger::parseLevel(const std::string& name) {
+    for (auto level : { LogLevel::Error, LogLevel::Warning, LogLevel::Info, LogLevel::Debug }) {
+        if (name == levelName(level)) {
+            return level;
+        }
+    }
+    return std::nullopt;
+}
+
+void Logger::log(LogLevel level, std::string_view text) {
+    if (isEnabled(level)) {
+        push(level, Event::Message, 0, 0, text);
+    }
+}
+
+void Logger::connectionOpened(uint64_t sessionId, std::string_view ip) {
+    if (isEnabled(LogLevel::Info)) {
+        push(LogLevel::Info, Event::ConnectionOpened, sessionId, 0, ip);
+    }
+}
+
+void Logger::connectionClosed(uint64_t sessionId, std::string_view ip) {
+    if (isEnabled(LogLevel::Info)) {
+        push(LogLevel::Info, Event::ConnectionClosed, sessionId, 0, ip);
+    }
+}
+
+void Logger::request(uint64_t sessionId, uint32_t opcode, uint32_t packetId) {
+    if (isEnabled(LogLevel::Debug)) {
+        push(LogLevel::Debug, Event::Request, sessionId, (uint64_t{ opcode } << 32) | packetId, {});
+    }
+}
+
+// Bounded multi-producer ring: a producer claims a position by advancing the
+// head and publishes the slot by bumping its sequence number.
+void Logger::push(LogLevel level, Event event, uint64_t sessionId, uint64_t value, std::string_view text) {
+    uint64_t position = head.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &slots[position & (capacity - 1)];
+        uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+        int64_t difference = static_cast<int64_t>(sequence) - static_cast<int64_t>(position);
+        if (difference == 0) {
+            if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (difference < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else {
+            position = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    auto& record = slot->record;
+    record.time = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record.sessionId = sessionId;
+    record.value = value;
+    record.level = level;
+    record.event = event;
+    record.textLength = static_cast<uint16_t>(std::min(text.size(), sizeof(record.text)));
+    memcpy(record.text, text.data(), record.textLength);
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    if (position - tail.load(std::memory_order_relaxed) >= capacity / 2) {
+        cv.notify_one();
+    }
+}
+
+bool Logger::pop(Record& record) {
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    Slot& slot = slots[position & (capacity - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+        return false;
+    }
+
+    record = slot.record;
+    slot.sequence.store(position + capacity, std::memory_order_release);
+    tail.store(position + 1, std::memory_order_relaxed);
+    return true;
+}
+
+void Logger::run() {
+    std::string output;
+    while (running) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait_for(lock, flushInterval);
+        }
+        drain(output);
+    }
+    drain(output);
+}
+
+void Logger::drain(std::string& output) {
+    Record record;
+    while (pop(record)) {
+        format(record, output);
+    }
+
+    uint64_t droppedNow = dropped.load(std::memory_order_relaxed);
+    if (droppedNow != reportedDropped) {
+        output += std::to_string(droppedNow - reportedDropped) + " log records dropped\n";
+        reportedDropped = droppedNow;
+    }
+
+    if (!output.empty()) {
+        std::cout.write(output.data(), static_cast<std::streamsize>(output.size()));
+        std::cout.flush();
+        output.clear();
+    }
+}
+
+void Logger::format(const Record& record, std::string& output) {
+    // Only the consumer thread formats, so the time string is cached per second.
+    int64_t second = record.time / 1000000;
+    if (second != cachedSecond) {
+        std::time_t time = static_cast<std::time_t>(second);
+        std::tm tm{};
+#ifdef _WIN32
+        localtime_s(&tm, &time);
+#else
+        localtime_r(&time, &tm);
+#endif
+        char buffer[32];
+        std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
+        cachedTime = buffer;
+        cachedSecond = second;
+    }
+
+    std::string_view text(record.text, record.textLength);
+    switch (record.event) {
+    case Event::Message:
+        output += cachedTime;
+        output += " - ";
+        output += levelName(record.level);
+        output += " - ";
+        output += text;
+        break;
+    case Event::ConnectionOpened:
+        output += text;
+        output += " - ";
+        output += cachedTime;
+        output += " - New connection";
+        break;
+    case Event::ConnectionClosed:
+        output += text;
+        output += " - ";
+        output += cachedTime;
+        output += " - Connection closed";
+        break;
+    case Event::Request:
+        output += cachedTime;
+        output += " - session ";
+        output += std::to_string(record.sessionId);
+        output += " - opcode ";
+        output += std::to_string(record.value >> 32);
+        output += " packet ";
+        output += std::to_string(record.value & 0xFFFFFFFF);
+        break;
+    }
+    output += '\n';
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <condition_variable>
+
+enum class LogLevel : uint8_t {
+    Error,
+    Warning,
+    Info,
+    Debug,
+};
+
+// Producers write fixed-size binary records into a lock-free ring and never
+// block; a background thread formats and writes them. When the ring is full
+// records are dropped and counted.
+class Logger {
+public:
+    Logger();
+    ~Logger();
+    static std::optional<LogLevel> parseLevel(const std::string& name);
+    void setLevel(LogLevel level) { this->level.store(level, std::memory_order_relaxed); }
+    bool isEnabled(LogLevel level) const { return level <= this->level.load(std::memory_order_relaxed); }
+
+    void log(LogLevel level, std::string_view text);
+    void connectionOpened(uint64_t sessionId, std::string_view ip);
+    void connectionClosed(uint64_t sessionId, std::string_view ip);
+    void request(uint64_t sessionId, uint32_t opcode, uint32_t packetId);
+
+private:
+    enum class Event : uint8_t {
+        Message,
+        ConnectionOpened,
+        ConnectionClosed,
+        Request,
+    };
+
+    struct Record {
+        int64_t time;
+        uint64_t sessionId;
+        uint64_t value;
+        LogLevel level;
+        Event event;
+        uint16_t textLength;
+        char text[92];
+    };
+
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        Record record;
+    };
+
+    static constexpr size_t capacity = 8192;
+
+    void push(LogLevel level, Event event, uint64_t sessionId, uint64_t value, std::string_view text);
+    bool pop(Record& record);
+    void run();
+    void drain(std::string& output);
+    void format(const Record& record, std::string& output);
+
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<uint64_t> head{ 0 };
+    alignas(64) std::atomic<uint64_t> tail{ 0 };
+    std::atomic<uint64_t> dropped{ 0 };
+    uint64_t reportedDropped{ 0 };
+    std::atomic<LogLevel> level{ LogLevel::Info };
+    std::atomic<bool> running{ true };
+    std::mutex mutex;
+    std::condition_variable cv;
+    int64_t cachedSecond{ -1 };
+    std::string cachedTime;
+    std::thread thread;
+
+};
@@ -0,0 +1,135 @@
+#include "metrics.h"
+#include "logger.h"
+#include "cardScheduler.h"
+#include "readerHealth.h"
+#include "trafficMirror.h"
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration latency) {
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+    if (nanoseconds < 0) {
+        nanoseconds = 0;
+    }
+
+    uint64_t microseconds = static_cast<uint64_t>(nanoseconds) / 1000;
+    size_t index = 0;
+    while (index < bucketBounds.size() && microseconds >= bucketBounds[index]) {
+        ++index;
+    }
+    buckets[index].fetch_add(1, std::memory_order_relaxed);
+    sumNanoseconds.fetch_add(static_cast<uint64_t>(nanoseconds), std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::write(std::ostream& os, const std::string& name, const std::string& help) const {
+    os << "# HELP " << name << " " << help << "\n";
+    os << "# TYPE " << name << " histogram\n";
+
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < bucketBounds.size(); ++i) {
+        cumulative += buckets[i].load(std::memory_order_relaxed);
+        os << name << "_bucket{le=\"" << bucketBounds[i] / 1e6 << "\"} " << cumulative << "\n";
+    }
+    cumulative += buckets[bucketBounds.size()].load(std::memory_order_relaxed);
+    os << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+    os << name << "_sum " << sumNanoseconds.load(std::memory_order_relaxed) / 1e9 << "\n";
+    os << name << "_count " << count.load(std::memory_order_relaxed) << "\n";
+}
+
+Metrics::Metrics(asio::io_context& io_context, Logger& logger, const CardScheduler& cardScheduler, const ReaderHealth& readerHealth,
+    const TrafficMirror& mirror) :
+    timer(io_context), logger(logger), cardScheduler(cardScheduler), readerHealth(readerHealth), mirror(mirror) {
+}
+
+Metrics::~Metrics() {
+    if (!exporter.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    exporter.join();
+}
+
+void Metrics::start(const std::string& path, std::chrono::seconds interval) {
+    this->path = path;
+    this->interval = interval;
+    exporter = std::thread([this] { runExporter(); });
+    scheduleExport();
+}
+
+void Metrics::write(std::ostream& os) const {
+    workerWakeup.write(os, "casproxy_worker_wakeup_seconds",
+        "Time from a task being queued on an idle card worker to the worker running it.");
+    ioWakeup.write(os, "casproxy_io_wakeup_seconds",
+        "Time from a card worker handing a response to the I/O thread running it.");
+
+    os << "# HELP casproxy_card_recoveries_total Card handles reconnected after a reset or removed card, by result.\n";
+    os << "# TYPE casproxy_card_recoveries_total counter\n";
+    os << "casproxy_card_recoveries_total{result=\"recovered\"} " << cardRecoveries << "\n";
+    os << "casproxy_card_recoveries_total{result=\"failed\"} " << failedCardRecoveries << "\n";
+    sessionRtt.write(os, "casproxy_session_rtt_seconds",
+        "Round trip time of keepalive pings to clients.");
+    os << "# HELP casproxy_sessions_reaped_total Sessions closed because their client did not answer a keepalive ping.\n";
+    os << "# TYPE casproxy_sessions_reaped_total counter\n";
+    os << "casproxy_sessions_reaped_total " << reapedSessions << "\n";
+    cardScheduler.write(os);
+    readerHealth.write(os);
+    mirror.write(os);
+}
+
+void Metrics::scheduleExport() {
+    timer.expires_after(interval);
+    timer.async_wait([this](std::error_code ec) {
+        if (ec) {
+            return;
+        }
+
+        // Some sources are only safe to read here; the disk is not touched.
+        std::ostringstream os;
+        write(os);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = os.str();
+        }
+        cv.notify_one();
+        scheduleExport();
+    });
+}
+
+void Metrics::runExporter() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty()) {
+            return;
+        }
+
+        std::string text = std::move(pending);
+        pending.clear();
+        lock.unlock();
+        exportFile(text);
+        lock.lock();
+    }
+}
+
+void Metrics::exportFile(const std::string& text) {
+    // Written aside and renamed so that a collector never reads a partial file.
+    std::string tempPath = path + ".tmp";
+    {
+        std::ofstream fs(tempPath, std::ios::trunc);
+        if (!fs.good()) {
+            logger.log(LogLevel::Warning, "Cannot write metrics to " + tempPath);
+            return;
+        }
+        fs << text;
+    }
+#ifdef _WIN32
+    std::remove(path.c_str());
+#endif
+    std::rename(tempPath.c_str(), path.c_str());
+}
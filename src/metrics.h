@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <ostream>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <asio.hpp>
+
+class Logger;
+class CardScheduler;
+class ReaderHealth;
+class TrafficMirror;
+
+// Fixed-bucket latency histogram that any thread records into without
+// locking.
+class LatencyHistogram {
+public:
+    void record(std::chrono::steady_clock::duration latency);
+    void write(std::ostream& os, const std::string& name, const std::string& help) const;
+
+private:
+    // Upper bounds in microseconds; the last bucket is unbounded.
+    static constexpr std::array<uint64_t, 16> bucketBounds{
+        1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000
+    };
+
+    std::array<std::atomic<uint64_t>, bucketBounds.size() + 1> buckets{};
+    std::atomic<uint64_t> sumNanoseconds{ 0 };
+    std::atomic<uint64_t> count{ 0 };
+
+};
+
+// Server metrics, written periodically in the Prometheus text format to a
+// file that a node exporter textfile collector can pick up. They are
+// rendered on the I/O thread and the file is written by a background thread.
+class Metrics {
+public:
+    Metrics(asio::io_context& io_context, Logger& logger, const CardScheduler& cardScheduler, const ReaderHealth& readerHealth,
+        const TrafficMirror& mirror);
+    ~Metrics();
+    void start(const std::string& path, std::chrono::seconds interval);
+    void write(std::ostream& os) const;
+
+    // From a task being queued on an idle card worker to the worker running.
+    LatencyHistogram workerWakeup;
+    // From a card worker handing a response over to the I/O thread running it.
+    LatencyHistogram ioWakeup;
+    // Card handles a worker reconnected after a reset or removed card, and
+    // those it gave up on.
+    std::atomic<uint64_t> cardRecoveries{ 0 };
+    std::atomic<uint64_t> failedCardRecoveries{ 0 };
+    // Of keepalive pings, and sessions closed for leaving one unanswered.
+    LatencyHistogram sessionRtt;
+    std::atomic<uint64_t> reapedSessions{ 0 };
+
+private:
+    void scheduleExport();
+    void runExporter();
+    void exportFile(const std::string& text);
+
+    asio::steady_timer timer;
+    Logger& logger;
+    const CardScheduler& cardScheduler;
+    const ReaderHealth& readerHealth;
+    const TrafficMirror& mirror;
+    std::string path;
+    std::chrono::seconds interval{ 0 };
+    // The latest rendering not yet written; a newer one replaces it.
+    std::string pending;
+    bool stopping{ false };
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread exporter;
+
+};
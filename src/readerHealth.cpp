@@ -0,0 +1,193 @@
+#include "readerHealth.h"
+#include "logger.h"
+#include <cstdio>
+
+namespace {
+
+constexpr double smoothing = 0.1;
+// Distinct status words counted per reader; later ones are not broken out.
+constexpr size_t maxStatusWords = 32;
+
+// Status words that point at the card rather than at the command: execution
+// errors, memory failures and errors without diagnosis.
+bool isCardFault(uint16_t statusWord) {
+    uint8_t sw1 = static_cast<uint8_t>(statusWord >> 8);
+    return sw1 == 0x64 || sw1 == 0x65 || sw1 == 0x66 || sw1 == 0x6F;
+}
+
+std::string escapeLabel(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+std::string hex(uint32_t value, int width) {
+    char buffer[16];
+    std::snprintf(buffer, sizeof(buffer), "%0*X", width, value);
+    return buffer;
+}
+
+}
+
+ReaderHealth::ReaderHealth(Logger& logger) : logger(logger) {
+}
+
+void ReaderHealth::configure(const Config::ReaderHealth& config, const std::vector<std::vector<std::string>>& readerGroups) {
+    this->config = config;
+    this->readerGroups = readerGroups;
+    for (const auto& group : this->readerGroups) {
+        for (const auto& readerName : group) {
+            groupOf[readerName] = &group;
+        }
+    }
+}
+
+void ReaderHealth::record(const std::string& readerName, std::chrono::steady_clock::duration latency,
+    LONG apiReturn, const uint8_t* response, size_t responseLength) {
+    bool failed = apiReturn != SCARD_S_SUCCESS || responseLength < 2;
+    uint16_t statusWord = 0;
+    if (apiReturn == SCARD_S_SUCCESS && responseLength >= 2) {
+        statusWord = static_cast<uint16_t>((response[responseLength - 2] << 8) | response[responseLength - 1]);
+        failed = isCardFault(statusWord);
+    }
+    double seconds = std::chrono::duration<double>(latency).count();
+    double latencyThreshold = config.latency / 1000.0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& reader = readers[readerName];
+    if (apiReturn != SCARD_S_SUCCESS) {
+        ++reader.apiErrors[apiReturn];
+    }
+    // Normal completions (9000, 61xx) are not counted.
+    else if (statusWord != 0x9000 && (statusWord >> 8) != 0x61
+        && (reader.statusWords.size() < maxStatusWords || reader.statusWords.count(statusWord))) {
+        ++reader.statusWords[statusWord];
+    }
+
+    if (reader.samples++ == 0) {
+        reader.latency = seconds;
+        reader.errorRate = failed ? 1.0 : 0.0;
+    }
+    else {
+        reader.latency += smoothing * (seconds - reader.latency);
+        reader.errorRate += smoothing * ((failed ? 1.0 : 0.0) - reader.errorRate);
+    }
+
+    if (!config.enabled) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (!reader.quarantined) {
+        if (reader.samples >= config.minSamples
+            && (reader.latency > latencyThreshold || reader.errorRate > config.errorRate)) {
+            reader.quarantined = true;
+            reader.probeSuccesses = 0;
+            reader.nextProbe = now + std::chrono::seconds(config.probeInterval);
+            logger.log(LogLevel::Warning, "Reader '" + readerName + "' quarantined, latency "
+                + std::to_string(static_cast<int>(reader.latency * 1000)) + " ms, error rate "
+                + std::to_string(static_cast<int>(reader.errorRate * 100)) + "%");
+        }
+        return;
+    }
+
+    // While quarantined every transmit is a probe, whether it was let
+    // through for one or the reader has no alternative.
+    if (failed || seconds > latencyThreshold) {
+        reader.probeSuccesses = 0;
+        return;
+    }
+    if (++reader.probeSuccesses >= config.probes) {
+        reader.quarantined = false;
+        reader.samples = 0;
+        logger.log(LogLevel::Info, "Reader '" + readerName + "' reinstated");
+    }
+}
+
+bool ReaderHealth::isAvailable(const std::string& readerName) {
+    if (!config.enabled) {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = readers.find(readerName);
+    return it == readers.end() || isAvailable(it->second, std::chrono::steady_clock::now());
+}
+
+bool ReaderHealth::isAvailable(Reader& reader, std::chrono::steady_clock::time_point now) {
+    if (!reader.quarantined) {
+        return true;
+    }
+    if (now >= reader.nextProbe) {
+        reader.nextProbe = now + std::chrono::seconds(config.probeInterval);
+        return true;
+    }
+    return false;
+}
+
+std::string ReaderHealth::selectReader(const std::string& readerName) {
+    auto group = groupOf.find(readerName);
+    if (!config.enabled || group == groupOf.end()) {
+        return readerName;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto it = readers.find(readerName);
+    if (it == readers.end() || isAvailable(it->second, now)) {
+        return readerName;
+    }
+
+    for (const auto& alternative : *group->second) {
+        auto other = readers.find(alternative);
+        if (other == readers.end() || isAvailable(other->second, now)) {
+            return alternative;
+        }
+    }
+    return readerName;
+}
+
+void ReaderHealth::write(std::ostream& os) const {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    os << "# HELP casproxy_reader_latency_seconds Moving average of the transmit latency of a reader.\n";
+    os << "# TYPE casproxy_reader_latency_seconds gauge\n";
+    for (const auto& [name, reader] : readers) {
+        os << "casproxy_reader_latency_seconds{reader=\"" << escapeLabel(name) << "\"} " << reader.latency << "\n";
+    }
+
+    os << "# HELP casproxy_reader_error_ratio Moving average of the share of failed transmits of a reader.\n";
+    os << "# TYPE casproxy_reader_error_ratio gauge\n";
+    for (const auto& [name, reader] : readers) {
+        os << "casproxy_reader_error_ratio{reader=\"" << escapeLabel(name) << "\"} " << reader.errorRate << "\n";
+    }
+
+    os << "# HELP casproxy_reader_quarantined Whether a reader is quarantined.\n";
+    os << "# TYPE casproxy_reader_quarantined gauge\n";
+    for (const auto& [name, reader] : readers) {
+        os << "casproxy_reader_quarantined{reader=\"" << escapeLabel(name) << "\"} " << (reader.quarantined ? 1 : 0) << "\n";
+    }
+
+    os << "# HELP casproxy_reader_api_errors_total Transmits of a reader that failed, by apiReturn.\n";
+    os << "# TYPE casproxy_reader_api_errors_total counter\n";
+    for (const auto& [name, reader] : readers) {
+        for (const auto& [apiReturn, count] : reader.apiErrors) {
+            os << "casproxy_reader_api_errors_total{reader=\"" << escapeLabel(name) << "\",api_return=\"0x"
+                << hex(static_cast<uint32_t>(apiReturn), 8) << "\"} " << count << "\n";
+        }
+    }
+
+    os << "# HELP casproxy_reader_status_words_total Responses of a reader with a status word other than 9000 or 61xx.\n";
+    os << "# TYPE casproxy_reader_status_words_total counter\n";
+    for (const auto& [name, reader] : readers) {
+        for (const auto& [statusWord, count] : reader.statusWords) {
+            os << "casproxy_reader_status_words_total{reader=\"" << escapeLabel(name) << "\",sw=\""
+                << hex(statusWord, 4) << "\"} " << count << "\n";
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <ostream>
+#include <winscard.h>
+#include "config.h"
+
+class Logger;
+
+// Tracks the transmit latency and failure rate of every local reader as
+// moving averages, and counts failures by apiReturn and status word. With
+// thresholds configured, a reader that crosses one is quarantined: connects
+// go to another reader of its group and routed transmits to another cluster
+// node. Once per probe interval a request is let through as a probe, and a
+// run of successful probes reinstates the reader.
+class ReaderHealth {
+public:
+    explicit ReaderHealth(Logger& logger);
+    void configure(const Config::ReaderHealth& config, const std::vector<std::vector<std::string>>& readerGroups);
+    // Called by card workers after every transmit.
+    void record(const std::string& readerName, std::chrono::steady_clock::duration latency,
+        LONG apiReturn, const uint8_t* response, size_t responseLength);
+    bool isAvailable(const std::string& readerName);
+    // The reader a connect to readerName should use.
+    std::string selectReader(const std::string& readerName);
+    void write(std::ostream& os) const;
+
+private:
+    struct Reader {
+        // Seconds.
+        double latency{ 0 };
+        double errorRate{ 0 };
+        uint64_t samples{ 0 };
+        bool quarantined{ false };
+        uint32_t probeSuccesses{ 0 };
+        std::chrono::steady_clock::time_point nextProbe;
+        std::map<LONG, uint64_t> apiErrors;
+        std::map<uint16_t, uint64_t> statusWords;
+    };
+
+    bool isAvailable(Reader& reader, std::chrono::steady_clock::time_point now);
+
+    Logger& logger;
+    Config::ReaderHealth config;
+    std::map<std::string, const std::vector<std::string>*> groupOf;
+    std::vector<std::vector<std::string>> readerGroups;
+    mutable std::mutex mutex;
+    std::map<std::string, Reader> readers;
+
+};
@@ -0,0 +1,246 @@
+#include "readerMonitor.h"
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+constexpr DWORD statusChangeTimeout = 1000;
+constexpr auto retryInterval = std::chrono::seconds(1);
+constexpr const char* pnpNotification = "\\\\?PnP?\\Notification";
+
+bool isServiceGone(LONG returnValue) {
+    return returnValue == SCARD_E_NO_SERVICE
+        || returnValue == SCARD_E_SERVICE_STOPPED
+        || returnValue == SCARD_E_INVALID_HANDLE;
+}
+
+bool isSameState(const ReaderMonitor::ReaderState& a, const ReaderMonitor::ReaderState& b) {
+    constexpr DWORD mask = SCARD_STATE_PRESENT | SCARD_STATE_EMPTY | SCARD_STATE_MUTE
+        | SCARD_STATE_UNAVAILABLE | SCARD_STATE_EXCLUSIVE | SCARD_STATE_INUSE;
+    return a.name == b.name && (a.eventState & mask) == (b.eventState & mask) && a.atr == b.atr
+        && a.cardGeneration == b.cardGeneration;
+}
+
+// The upper 16 bits of the event state hold a per-reader event counter that
+// changes on card insertion and removal.
+bool isCardChanged(DWORD previous, DWORD current) {
+    return ((previous ^ current) & SCARD_STATE_PRESENT) || (previous >> 16) != (current >> 16);
+}
+
+}
+
+ReaderMonitor::~ReaderMonitor() {
+    stop();
+}
+
+void ReaderMonitor::start() {
+    if (running.exchange(true)) {
+        return;
+    }
+
+    workerThread = std::thread([this]() {
+        run();
+    });
+}
+
+void ReaderMonitor::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(retryMutex);
+        if (hContext) {
+            SCardCancel(hContext);
+        }
+    }
+    retryCv.notify_all();
+
+    if (workerThread.joinable()) {
+        workerThread.join();
+    }
+}
+
+std::shared_ptr<const ReaderMonitor::Snapshot> ReaderMonitor::getSnapshot() const {
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    return snapshot;
+}
+
+std::optional<uint64_t> ReaderMonitor::findCardGeneration(const std::string& reader) const {
+    const auto current = getSnapshot();
+    if (!current) {
+        return std::nullopt;
+    }
+
+    for (const auto& state : current->states) {
+        if (state.name == reader) {
+            if (!(state.eventState & SCARD_STATE_PRESENT)) {
+                return std::nullopt;
+            }
+            return state.cardGeneration;
+        }
+    }
+    return std::nullopt;
+}
+
+void ReaderMonitor::run() {
+    std::vector<ReaderState> states;
+    DWORD pnpState = SCARD_STATE_UNAWARE;
+
+    while (running) {
+        if (!hContext && !establishContext()) {
+            waitRetry();
+            continue;
+        }
+
+        std::vector<std::string> names;
+        LONG returnValue = listReaders(names);
+        if (returnValue != SCARD_S_SUCCESS) {
+            if (isServiceGone(returnValue)) {
+                releaseContext();
+            }
+            invalidate();
+            states.clear();
+            pnpState = SCARD_STATE_UNAWARE;
+            waitRetry();
+            continue;
+        }
+
+        // Keep the last known state of readers that are still present so that
+        // SCardGetStatusChange only returns on a real change.
+        std::vector<ReaderState> nextStates;
+        nextStates.reserve(names.size());
+        for (auto& name : names) {
+            ReaderState state;
+            state.name = std::move(name);
+            for (const auto& prev : states) {
+                if (prev.name == state.name) {
+                    state = prev;
+                    break;
+                }
+            }
+            nextStates.push_back(std::move(state));
+        }
+        states.swap(nextStates);
+
+        std::vector<SCARD_READERSTATE> readerStates(states.size() + 1);
+        for (size_t i = 0; i < states.size(); ++i) {
+            readerStates[i].szReader = states[i].name.c_str();
+            readerStates[i].dwCurrentState = states[i].eventState & ~SCARD_STATE_CHANGED;
+        }
+        readerStates.back().szReader = pnpNotification;
+        readerStates.back().dwCurrentState = pnpState & ~SCARD_STATE_CHANGED;
+
+        // The first pass uses SCARD_STATE_UNAWARE and returns immediately with the
+        // current state of every reader; later passes block until something changes.
+        returnValue = SCardGetStatusChange(hContext, statusChangeTimeout, readerStates.data(), static_cast<DWORD>(readerStates.size()));
+        if (returnValue == SCARD_S_SUCCESS) {
+            for (size_t i = 0; i < states.size(); ++i) {
+                auto& state = states[i];
+                const auto& readerState = readerStates[i];
+                std::vector<uint8_t> atr(readerState.rgbAtr, readerState.rgbAtr + std::min<DWORD>(readerState.cbAtr, MAX_ATR_SIZE));
+                if (state.cardGeneration == 0 || isCardChanged(state.eventState, readerState.dwEventState) || state.atr != atr) {
+                    state.cardGeneration = nextCardGeneration++;
+                }
+                state.eventState = readerState.dwEventState;
+                state.atr = std::move(atr);
+            }
+            pnpState = readerStates.back().dwEventState;
+        }
+        else if (isServiceGone(returnValue)) {
+            releaseContext();
+            invalidate();
+            states.clear();
+            pnpState = SCARD_STATE_UNAWARE;
+            continue;
+        }
+        else if (returnValue != SCARD_E_TIMEOUT && returnValue != SCARD_E_CANCELLED) {
+            // Readers removed between listing and waiting, or the PnP pseudo reader
+            // is not supported. Re-list on the next pass without busy looping.
+            waitRetry();
+        }
+
+        publish(states);
+    }
+
+    releaseContext();
+}
+
+bool ReaderMonitor::establishContext() {
+    SCARDCONTEXT context = 0;
+    if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, nullptr, nullptr, &context) != SCARD_S_SUCCESS) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(retryMutex);
+    hContext = context;
+    return true;
+}
+
+void ReaderMonitor::releaseContext() {
+    std::lock_guard<std::mutex> lock(retryMutex);
+    if (hContext) {
+        SCardReleaseContext(hContext);
+        hContext = 0;
+    }
+}
+
+LONG ReaderMonitor::listReaders(std::vector<std::string>& names) {
+    names.clear();
+
+    DWORD readersLength = 0;
+    LONG returnValue = SCardListReaders(hContext, nullptr, nullptr, &readersLength);
+    if (returnValue == SCARD_E_NO_READERS_AVAILABLE) {
+        return SCARD_S_SUCCESS;
+    }
+    if (returnValue != SCARD_S_SUCCESS) {
+        return returnValue;
+    }
+
+    std::vector<char> buffer(readersLength);
+    returnValue = SCardListReaders(hContext, nullptr, buffer.data(), &readersLength);
+    if (returnValue == SCARD_E_NO_READERS_AVAILABLE) {
+        return SCARD_S_SUCCESS;
+    }
+    if (returnValue != SCARD_S_SUCCESS) {
+        return returnValue;
+    }
+
+    buffer.resize(readersLength);
+    for (size_t pos = 0; pos < buffer.size() && buffer[pos] != '\0';) {
+        std::string name(&buffer[pos]);
+        pos += name.size() + 1;
+        names.push_back(std::move(name));
+    }
+    return SCARD_S_SUCCESS;
+}
+
+void ReaderMonitor::publish(std::vector<ReaderState> states) {
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    if (snapshot && snapshot->states.size() == states.size()
+        && std::equal(states.begin(), states.end(), snapshot->states.begin(), isSameState)) {
+        return;
+    }
+
+    auto next = std::make_shared<Snapshot>();
+    next->version = nextVersion++;
+    for (const auto& state : states) {
+        next->readers.insert(next->readers.end(), state.name.begin(), state.name.end());
+        next->readers.push_back('\0');
+    }
+    if (!next->readers.empty()) {
+        next->readers.push_back('\0');
+    }
+    next->states = std::move(states);
+    snapshot = std::move(next);
+}
+
+void ReaderMonitor::invalidate() {
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    snapshot.reset();
+}
+
+void ReaderMonitor::waitRetry() {
+    std::unique_lock<std::mutex> lock(retryMutex);
+    retryCv.wait_for(lock, retryInterval, [this] { return !running; });
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <optional>
+#include <condition_variable>
+#include <winscard.h>
+
+// Tracks reader and card presence with SCardGetStatusChange on a background
+// thread and keeps a versioned snapshot of the reader list, so that
+// SCardListReaders can be answered from memory.
+class ReaderMonitor {
+public:
+    struct ReaderState {
+        std::string name;
+        DWORD eventState{ SCARD_STATE_UNAWARE };
+        std::vector<uint8_t> atr;
+        // Changes whenever a different card is (or no card is) in the reader.
+        uint64_t cardGeneration{ 0 };
+    };
+
+    struct Snapshot {
+        uint64_t version{ 0 };
+        // Multi-string in the same layout SCardListReaders returns.
+        std::vector<uint8_t> readers;
+        std::vector<ReaderState> states;
+    };
+
+    ReaderMonitor() = default;
+    ~ReaderMonitor();
+    void start();
+    void stop();
+    std::shared_ptr<const Snapshot> getSnapshot() const;
+    std::optional<uint64_t> findCardGeneration(const std::string& reader) const;
+
+private:
+    void run();
+    bool establishContext();
+    void releaseContext();
+    LONG listReaders(std::vector<std::string>& names);
+    void publish(std::vector<ReaderState> states);
+    void invalidate();
+    void waitRetry();
+
+    SCARDCONTEXT hContext{ 0 };
+    std::thread workerThread;
+    std::atomic<bool> running{ false };
+    mutable std::mutex snapshotMutex;
+    std::shared_ptr<const Snapshot> snapshot;
+    uint64_t nextVersion{ 1 };
+    uint64_t nextCardGeneration{ 1 };
+    std::mutex retryMutex;
+    std::condition_variable retryCv;
+
+};
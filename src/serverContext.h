@@ -0,0 +1,36 @@
+#pragma once
+
+class Config;
+class ReaderMonitor;
+class AttribCache;
+class ContextPool;
+class SessionStore;
+class Upstreams;
+class Cluster;
+class TrafficCapture;
+class TrafficMirror;
+class BufferPool;
+class TimerWheel;
+class Metrics;
+class Logger;
+class CardScheduler;
+class ReaderHealth;
+
+// Server-wide state shared by every session.
+struct ServerContext {
+    const Config& config;
+    ReaderMonitor& readerMonitor;
+    AttribCache& attribCache;
+    ContextPool& contextPool;
+    SessionStore& sessionStore;
+    Upstreams& upstreams;
+    Cluster& cluster;
+    TrafficCapture& capture;
+    TrafficMirror& mirror;
+    BufferPool& bufferPool;
+    TimerWheel& timerWheel;
+    Metrics& metrics;
+    Logger& logger;
+    CardScheduler& cardScheduler;
+    ReaderHealth& readerHealth;
+};
@@ -1,33 +1,109 @@
 #include "session.h"
+#include "config.h"
+#include "readerMonitor.h"
+#include "attribCache.h"
+#include "contextPool.h"
+#include "sessionStore.h"
+#include "upstream.h"
+#include "cluster.h"
+#include "trafficCapture.h"
+#include "trafficMirror.h"
+#include "bufferPool.h"
+#include "timerWheel.h"
+#include "metrics.h"
+#include "logger.h"
+#include "readerHealth.h"
+#include <atomic>
+#include <algorithm>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
-Session::Session(asio::ip::tcp::socket socket, CloseHandler onClose)
-    : socket(std::move(socket)), onClose(std::move(onClose))
+namespace {
+
+std::atomic<uint64_t> nextSessionId{ 1 };
+constexpr uint32_t supportedCapabilities = casproxy::CapabilityCompactEncoding | casproxy::CapabilityChannels
+    | casproxy::CapabilityServerTiming | casproxy::CapabilityKeepalive | casproxy::CapabilityClusterPeer;
+constexpr size_t maxChannels = 1024;
+constexpr size_t maxPacketLength = 1024 * 100;
+
+}
+
+struct Session::Lease {
+    std::chrono::seconds duration;
+    // Returns nullopt once the leased object is gone.
+    std::function<std::optional<std::chrono::steady_clock::time_point>()> lastUsed;
+    std::function<void()> onExpired;
+};
+
+Session::Session(asio::ip::tcp::socket socket, ServerContext& server, CloseHandler onClose)
+    : socket(std::move(socket)), server(server), id(nextSessionId++), onClose(std::move(onClose))
 {
 }
 
-void Session::clear() {
-    for (const auto& [virtualHandle, context] : mapCardContext) {
-        if (context->hCard) {
-            SCardDisconnect(context->hCard, SCARD_LEAVE_CARD);
+Session::Session(std::shared_ptr<Session> parent, uint32_t channel, CloseHandler onClose)
+    : ip(parent->ip), socket(parent->socket.get_executor()), server(parent->server), encoding(parent->encoding),
+    capabilities(parent->capabilities), parent(parent), channel(channel), id(nextSessionId++), onClose(std::move(onClose))
+{
+}
+
+void SessionState::clear(ContextPool& contextPool) {
+    cardHandles.forEach([](uint64_t, CardHandle& cardHandle) {
+        if (cardHandle.local) {
+            cardHandle.local->stop();
+            return;
         }
-        context->stop();
-    }
-    mapCardContext.clear();
+        const auto& card = *cardHandle.upstream;
+        if (card.connection->isReady() && card.connection->getEpoch() == card.epoch) {
+            casproxy::SCardDisconnectRequest req;
+            req.hCard = card.hCard;
+            req.dwDisposition = SCARD_LEAVE_CARD;
+            card.connection->send(req, [](std::shared_ptr<casproxy::ResponseBase>) {});
+        }
+    });
+    cardHandles.clear();
+
+    contexts.forEach([&contextPool](uint64_t, NativeContext& context) {
+        contextPool.release(context.dwScope, context.hContext);
+    });
+    contexts.clear();
+}
 
-    for (const auto& [virtualContext, hContext] : mapContext) {
-        SCardReleaseContext(hContext);
+void Session::start() {
+    lastActivity = server.timerWheel.now();
+    watchSession();
+    if (!parent) {
+        if (server.mirror.isEnabled()) {
+            mirror = server.mirror.connect();
+        }
+        if (server.config.keepalive.interval) {
+            enableTcpKeepalive();
+        }
+        doRead();
     }
-    mapContext.clear();
+}
+
+void Session::clear() {
+    state.clear(server.contextPool);
 }
 
 void Session::doRead() {
+    if (shm) {
+        watchSocket();
+        return;
+    }
+    if (encoding == casproxy::Encoding::Compact) {
+        readCompactHeader();
+        return;
+    }
+
     auto self = shared_from_this();
     asio::async_read(socket, asio::buffer(&packetLength, 4),
         [this, self](std::error_code ec, std::size_t) {
             if (!ec) {
                 packetLength = casproxy::swapEndian32(packetLength);
                 readPacketData();
-                doRead();
             }
             else {
                 close();
@@ -36,18 +112,55 @@ void Session::doRead() {
     );
 }
 
-void Session::readPacketData() {
-    if (packetLength > 1024 * 100) {
+void Session::watchSocket() {
+    auto self = shared_from_this();
+    asio::async_read(socket, asio::buffer(compactHeader.data(), 1),
+        [this, self](std::error_code, std::size_t) {
+            close();
+        }
+    );
+}
+
+void Session::readCompactHeader() {
+    auto self = shared_from_this();
+    asio::async_read(socket, asio::buffer(compactHeader),
+        [this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                close();
+                return;
+            }
+
+            size_t prefixSize = casproxy::readCompactLength(compactHeader.data(), packetLength);
+            size_t headSize = compactHeader.size() - prefixSize;
+            if (prefixSize == 0 || packetLength < headSize) {
+                close();
+                return;
+            }
+            readPacketData(compactHeader.data() + prefixSize, headSize);
+        }
+    );
+}
+
+void Session::readPacketData(const uint8_t* head, size_t headSize) {
+    if (packetLength > maxPacketLength) {
+        close();
         return;
     }
 
-    packetData.resize(packetLength);
+    packetData = server.bufferPool.acquire(packetLength);
+    if (headSize > 0) {
+        memcpy(packetData.data(), head, headSize);
+    }
 
     auto self = shared_from_this();
-    asio::async_read(socket, asio::buffer(packetData.data(), packetLength),
+    asio::async_read(socket, asio::buffer(packetData.data() + headSize, packetLength - headSize),
         [this, self](std::error_code ec, std::size_t) {
             if (!ec) {
                 handlePacket();
+                server.bufferPool.release(std::move(packetData));
+                if (!closed) {
+                    doRead();
+                }
             }
             else {
                 close();
@@ -56,9 +169,71 @@ void Session::readPacketData() {
     );
 }
 
+void Session::handleFrames(std::vector<std::vector<uint8_t>>&& frames) {
+    for (auto& frame : frames) {
+        if (closed) {
+            return;
+        }
+        if (frame.size() > maxPacketLength) {
+            close();
+            return;
+        }
+        packetData = std::move(frame);
+        handlePacket();
+    }
+}
+
 void Session::handlePacket() {
-    casproxy::StreamReader reader(packetData);
+    server.capture.record(capture::Direction::Request, id, packetData.data(), packetData.size());
+    lastActivity = server.timerWheel.now();
+    ++frameCount;
+    if (mirror) {
+        mirror->request(packetData, capabilities);
+    }
+
+    casproxy::StreamReader reader(packetData, encoding);
+    uint32_t channel = 0;
+    if ((capabilities & casproxy::CapabilityChannels) && !reader.readBe(channel)) {
+        close();
+        return;
+    }
+    if (channel == 0) {
+        handleRequest(reader);
+        return;
+    }
+
+    // A malformed request closes its channel only; the frame boundaries of
+    // the connection are intact.
+    if (auto session = openChannel(channel)) {
+        session->lastActivity = lastActivity;
+        session->handleRequest(reader);
+    }
+    else {
+        close();
+    }
+}
+
+std::shared_ptr<Session> Session::openChannel(uint32_t channel) {
+    if (auto it = channels.find(channel); it != channels.end()) {
+        return it->second;
+    }
+    if (channels.size() >= maxChannels) {
+        return nullptr;
+    }
+
+    std::weak_ptr<Session> weak = shared_from_this();
+    auto session = std::make_shared<Session>(shared_from_this(), channel, [weak](std::shared_ptr<Session> s) {
+        if (auto self = weak.lock()) {
+            self->channels.erase(s->channel);
+        }
+    });
+    channels[channel] = session;
+    session->start();
+    return session;
+}
 
+void Session::handleRequest(casproxy::StreamReader& reader) {
+    receivedAt = std::chrono::steady_clock::now();
     uint32_t packetId, opcodeValue;
     if (!reader.readBe(packetId) || !reader.readBe(opcodeValue)) {
         close();
@@ -66,6 +241,13 @@ void Session::handlePacket() {
     }
     ;
     casproxy::Opcode opcode = static_cast<casproxy::Opcode>(opcodeValue);
+    if (server.logger.isEnabled(LogLevel::Debug)) {
+        server.logger.request(id, opcodeValue, packetId);
+    }
+
+    if (opcode == casproxy::Opcode::SCardTransmitReq && transmitInPlace(packetId, reader)) {
+        return;
+    }
 
     switch (opcode) {
     case casproxy::Opcode::SCardEstablishContextReq: {
@@ -158,6 +340,66 @@ void Session::handlePacket() {
         handleSCardGetAttrib(req);
         break;
     }
+    case casproxy::Opcode::SessionStartReq: {
+        casproxy::SessionStartRequest req;
+        if (!req.unpack(packetId, reader)) {
+            close();
+            return;
+        }
+
+        handleSessionStart(req);
+        break;
+    }
+    case casproxy::Opcode::SessionResumeReq: {
+        casproxy::SessionResumeRequest req;
+        if (!req.unpack(packetId, reader)) {
+            close();
+            return;
+        }
+
+        handleSessionResume(req);
+        break;
+    }
+    case casproxy::Opcode::SCardTransactionScriptReq: {
+        casproxy::SCardTransactionScriptRequest req;
+        if (!req.unpack(packetId, reader)) {
+            close();
+            return;
+        }
+
+        handleSCardTransactionScript(req);
+        break;
+    }
+    case casproxy::Opcode::HelloReq: {
+        casproxy::HelloRequest req;
+        if (!req.unpack(packetId, reader)) {
+            close();
+            return;
+        }
+
+        handleHello(req);
+        break;
+    }
+    case casproxy::Opcode::PingReq: {
+        casproxy::PingRequest req;
+        if (!req.unpack(packetId, reader)) {
+            close();
+            return;
+        }
+
+        handlePing(req);
+        break;
+    }
+    case casproxy::Opcode::ShmAttachReq: {
+        casproxy::ShmAttachRequest req;
+        if (!req.unpack(packetId, reader)) {
+            close();
+            return;
+        }
+
+        handleShmAttach(req);
+        break;
+    }
     default: {
         close();
     }
@@ -167,11 +409,22 @@ void Session::handlePacket() {
 
 void Session::handleSCardEstablishContext(const casproxy::SCardEstablishContextRequest& req) {
     SCARDCONTEXT hContext = 0;
-    LONG returnValue = SCardEstablishContext(req.dwScope, nullptr, nullptr, &hContext);
+    LONG returnValue = server.contextPool.lease(req.dwScope, hContext);
+
+    // Without a local PC/SC service the context can still reach upstream readers.
+    if (returnValue != SCARD_S_SUCCESS && !server.upstreams.empty()) {
+        hContext = 0;
+        returnValue = SCARD_S_SUCCESS;
+    }
+
+    if (returnValue == SCARD_S_SUCCESS && state.contexts.full()) {
+        server.contextPool.release(req.dwScope, hContext);
+        returnValue = SCARD_E_NO_MEMORY;
+    }
 
     uint64_t virtualContext = 0;
-    if (hContext != 0) {
-        virtualContext = addContext(hContext);
+    if (returnValue == SCARD_S_SUCCESS) {
+        virtualContext = addContext(hContext, req.dwScope);
     }
 
     casproxy::SCardEstablishContextResponse res;
@@ -191,14 +444,11 @@ void Session::handleSCardReleaseContext(const casproxy::SCardReleaseContextReque
         return;
     }
 
-    LONG returnValue = SCardReleaseContext(*hNativeContext);
-    if (returnValue == SCARD_S_SUCCESS) {
-        removeCardContext(req.hContext);
-    }
+    releaseContext(req.hContext);
 
     casproxy::SCardReleaseContextResponse res;
     res.packetId = req.packetId;
-    res.apiReturn = returnValue;
+    res.apiReturn = SCARD_S_SUCCESS;
     sendResponse(res);
 }
 
@@ -212,6 +462,14 @@ void Session::handleSCardListReaders(const casproxy::SCardListReadersRequest& re
         return;
     }
 
+    if (req.isGroupsNull) {
+        std::vector<uint8_t> readers;
+        if (collectReaders(*hNativeContext, readers)) {
+            sendReaderList(req, readers);
+            return;
+        }
+    }
+
     DWORD readersLength = req.readersLength;
     std::vector<uint8_t> readersBuffer(req.readersLength);
     LONG returnValue = SCardListReaders(*hNativeContext, req.isGroupsNull ? nullptr : (char*)req.groups.data(),
@@ -229,6 +487,59 @@ void Session::handleSCardListReaders(const casproxy::SCardListReadersRequest& re
     sendResponse(res);
 }
 
+bool Session::collectReaders(SCARDCONTEXT hContext, std::vector<uint8_t>& readers) {
+    if (const auto snapshot = server.readerMonitor.getSnapshot()) {
+        readers = snapshot->readers;
+    }
+    else if (server.upstreams.empty()) {
+        return false;
+    }
+    else if (hContext) {
+        DWORD readersLength = 0;
+        if (SCardListReaders(hContext, nullptr, nullptr, &readersLength) == SCARD_S_SUCCESS) {
+            readers.resize(readersLength);
+            if (SCardListReaders(hContext, nullptr, (char*)readers.data(), &readersLength) == SCARD_S_SUCCESS) {
+                readers.resize(readersLength);
+            }
+            else {
+                readers.clear();
+            }
+        }
+    }
+
+    if (!server.upstreams.empty()) {
+        server.upstreams.appendReaderNames(readers);
+    }
+    return true;
+}
+
+void Session::sendReaderList(const casproxy::SCardListReadersRequest& req, const std::vector<uint8_t>& readers) {
+    // Mirror SCardListReaders: a zero length is a size query, a short buffer
+    // reports the required length.
+    uint32_t readersLength = static_cast<uint32_t>(readers.size());
+    std::vector<uint8_t> readersBuffer(req.readersLength);
+    LONG returnValue = SCARD_S_SUCCESS;
+    if (readers.empty()) {
+        returnValue = SCARD_E_NO_READERS_AVAILABLE;
+    }
+    else if (req.readersLength != 0) {
+        if (req.readersLength < readersLength) {
+            returnValue = SCARD_E_INSUFFICIENT_BUFFER;
+        }
+        else {
+            std::copy(readers.begin(), readers.end(), readersBuffer.begin());
+            readersBuffer.resize(readersLength);
+        }
+    }
+
+    casproxy::SCardListReadersResponse res;
+    res.packetId = req.packetId;
+    res.apiReturn = returnValue;
+    res.readers = readersBuffer;
+    res.readersLength = readersLength;
+    sendResponse(res);
+}
+
 void Session::handleSCardConnect(const casproxy::SCardConnectRequest& req) {
     const auto hNativeContext = findContext(req.hContext);
     if (!hNativeContext) {
@@ -238,16 +549,152 @@ void Session::handleSCardConnect(const casproxy::SCardConnectRequest& req) {
         sendResponse(res);
         return;
     }
+    if (state.cardHandles.full()) {
+        casproxy::SCardConnectResponse res;
+        res.packetId = req.packetId;
+        res.apiReturn = SCARD_E_NO_MEMORY;
+        sendResponse(res);
+        return;
+    }
+
+    if (server.upstreams.isUpstreamReader(req.szReader)) {
+        connectUpstream(req);
+        return;
+    }
+
+    // A quarantined reader is swapped for a healthy one of its group.
+    auto connectReq = std::make_shared<casproxy::SCardConnectRequest>(req);
+    connectReq->szReader = server.readerHealth.selectReader(req.szReader);
 
     auto cardContext = addCardContext();
-    cardContext->addTask(std::make_shared<casproxy::SCardConnectRequest>(req));
+    cardContext->virtualContext = req.hContext;
+    cardContext->hContext = *hNativeContext;
+    cardContext->readerName = connectReq->szReader;
+    if (const auto cardGeneration = server.readerMonitor.findCardGeneration(connectReq->szReader)) {
+        cardContext->cardGeneration = *cardGeneration;
+    }
+    cardContext->addTask(connectReq, receivedAt);
     cardContext->workerThread = std::thread([cardContext]() {
         cardContext->run();
         });
     cardContext->workerThread.detach();
 }
 
+void Session::connectUpstream(const casproxy::SCardConnectRequest& req) {
+    auto connection = server.upstreams.pickConnection(req.szReader);
+    if (!connection) {
+        casproxy::SCardConnectResponse res;
+        res.packetId = req.packetId;
+        res.apiReturn = SCARD_E_READER_UNAVAILABLE;
+        sendResponse(res);
+        return;
+    }
+
+    casproxy::SCardConnectRequest upstreamReq = req;
+    upstreamReq.hContext = connection->getRemoteContext();
+    uint64_t epoch = connection->getEpoch();
+
+    auto self = shared_from_this();
+    ++pendingForwards;
+    connection->send(upstreamReq, [this, self, req, connection, epoch](std::shared_ptr<casproxy::ResponseBase> upstreamRes) {
+        --pendingForwards;
+        casproxy::SCardConnectResponse res;
+        if (auto connectRes = std::dynamic_pointer_cast<casproxy::SCardConnectResponse>(upstreamRes)) {
+            res = *connectRes;
+        }
+        else {
+            res.apiReturn = SCARD_E_READER_UNAVAILABLE;
+        }
+        res.packetId = req.packetId;
+
+        if (res.apiReturn == SCARD_S_SUCCESS) {
+            // The session or the context may have gone away, or the handles
+            // run out, while the remote connect was in flight.
+            bool full = state.cardHandles.full();
+            if (closed || !findContext(req.hContext) || full) {
+                casproxy::SCardDisconnectRequest disconnectReq;
+                disconnectReq.hCard = res.hCard;
+                disconnectReq.dwDisposition = SCARD_LEAVE_CARD;
+                connection->send(disconnectReq, [](std::shared_ptr<casproxy::ResponseBase>) {});
+                res.apiReturn = full && !closed ? SCARD_E_NO_MEMORY : SCARD_E_INVALID_HANDLE;
+                res.hCard = 0;
+            }
+            else {
+                uint64_t virtualCardHandle = state.cardHandles.insert({ nullptr,
+                    SessionState::UpstreamCard{ connection, epoch, res.hCard, req.hContext, server.timerWheel.now() } });
+                watchCardHandle(virtualCardHandle);
+                res.hCard = virtualCardHandle;
+            }
+        }
+        sendResponse(res);
+    });
+}
+
+template<typename Response, typename Request>
+bool Session::forwardUpstream(const Request& req, std::function<void(const Response&)> onResponse) {
+    auto cardHandle = state.cardHandles.find(req.hCard);
+    if (!cardHandle || !cardHandle->upstream) {
+        return false;
+    }
+
+    const auto card = *cardHandle->upstream;
+    if (!card.connection->isReady() || card.connection->getEpoch() != card.epoch) {
+        // The remote session that owned the handle is gone for good.
+        state.cardHandles.erase(req.hCard);
+        Response res;
+        res.packetId = req.packetId;
+        res.apiReturn = SCARD_E_READER_UNAVAILABLE;
+        sendResponse(res);
+        return true;
+    }
+
+    cardHandle->upstream->lastUsed = server.timerWheel.now();
+    touchContext(card.virtualContext);
+
+    Request upstreamReq = req;
+    upstreamReq.hCard = card.hCard;
+
+    auto self = shared_from_this();
+    ++pendingForwards;
+    card.connection->send(upstreamReq, [this, self, packetId = req.packetId, onResponse](std::shared_ptr<casproxy::ResponseBase> upstreamRes) {
+        --pendingForwards;
+        Response res;
+        if (auto typedRes = std::dynamic_pointer_cast<Response>(upstreamRes)) {
+            res = *typedRes;
+        }
+        else {
+            res.apiReturn = SCARD_E_READER_UNAVAILABLE;
+        }
+        res.packetId = packetId;
+
+        if (onResponse) {
+            onResponse(res);
+        }
+        sendResponse(res);
+    });
+    return true;
+}
+
+template<typename Response, typename Request>
+void Session::queueCardTask(CardContext& cardContext, const Request& req, std::chrono::steady_clock::time_point receivedAt) {
+    if (!cardContext.addTask(std::make_shared<Request>(req), receivedAt)) {
+        Response res;
+        res.packetId = req.packetId;
+        res.apiReturn = SCARD_E_SERVER_TOO_BUSY;
+        sendResponse(res);
+    }
+}
+
 void Session::handleSCardDisconnect(const casproxy::SCardDisconnectRequest& req) {
+    const bool isUpstream = forwardUpstream<casproxy::SCardDisconnectResponse>(req, [this, hCard = req.hCard](const casproxy::SCardDisconnectResponse& res) {
+        if (res.apiReturn == SCARD_S_SUCCESS) {
+            state.cardHandles.erase(hCard);
+        }
+    });
+    if (isUpstream) {
+        return;
+    }
+
     const auto cardContext = findCardContext(req.hCard);
     if (!cardContext || !cardContext->isRunning()) {
         casproxy::SCardDisconnectResponse res;
@@ -257,10 +704,14 @@ void Session::handleSCardDisconnect(const casproxy::SCardDisconnectRequest& req)
         return;
     }
 
-    cardContext->addTask(std::make_shared<casproxy::SCardDisconnectRequest>(req));
+    queueCardTask<casproxy::SCardDisconnectResponse>(*cardContext, req, receivedAt);
 }
 
 void Session::handleSCardBeginTransaction(const casproxy::SCardBeginTransactionRequest& req) {
+    if (forwardUpstream<casproxy::SCardBeginTransactionResponse>(req)) {
+        return;
+    }
+
     const auto cardContext = findCardContext(req.hCard);
     if (!cardContext || !cardContext->isRunning()) {
         casproxy::SCardBeginTransactionResponse res;
@@ -270,10 +721,14 @@ void Session::handleSCardBeginTransaction(const casproxy::SCardBeginTransactionR
         return;
     }
 
-    cardContext->addTask(std::make_shared<casproxy::SCardBeginTransactionRequest>(req));
+    queueCardTask<casproxy::SCardBeginTransactionResponse>(*cardContext, req, receivedAt);
 }
 
 void Session::handleSCardEndTransaction(const casproxy::SCardEndTransactionRequest& req) {
+    if (forwardUpstream<casproxy::SCardEndTransactionResponse>(req)) {
+        return;
+    }
+
     const auto cardContext = findCardContext(req.hCard);
     if (!cardContext || !cardContext->isRunning()) {
         casproxy::SCardEndTransactionResponse res;
@@ -283,10 +738,14 @@ void Session::handleSCardEndTransaction(const casproxy::SCardEndTransactionReque
         return;
     }
 
-    cardContext->addTask(std::make_shared<casproxy::SCardEndTransactionRequest>(req));
+    queueCardTask<casproxy::SCardEndTransactionResponse>(*cardContext, req, receivedAt);
 }
 
 void Session::handleSCardTransmit(const casproxy::SCardTransmitRequest& req) {
+    if (forwardUpstream<casproxy::SCardTransmitResponse>(req)) {
+        return;
+    }
+
     const auto cardContext = findCardContext(req.hCard);
     if (!cardContext || !cardContext->isRunning()) {
         casproxy::SCardTransmitResponse res;
@@ -296,115 +755,705 @@ void Session::handleSCardTransmit(const casproxy::SCardTransmitRequest& req) {
         return;
     }
 
-    cardContext->addTask(std::make_shared<casproxy::SCardTransmitRequest>(req));
+    if (routeTransmit(req, cardContext)) {
+        return;
+    }
+
+    queueCardTask<casproxy::SCardTransmitResponse>(*cardContext, req, receivedAt);
 }
 
-void Session::handleSCardGetAttrib(const casproxy::SCardGetAttribRequest& req) {
+// Most frames are transmits on a local card. Those skip the request object:
+// the worker gets a view of the fields and the receive buffer they point
+// into. Everything else, including malformed frames, takes the full path.
+bool Session::transmitInPlace(uint32_t packetId, const casproxy::StreamReader& reader) {
+    // The cluster may send the APDU to another node.
+    if (server.cluster.isEnabled()) {
+        return false;
+    }
+
+    casproxy::StreamReader peek = reader;
+    casproxy::SCardTransmitView req;
+    if (!req.unpack(packetId, peek)) {
+        return false;
+    }
     const auto cardContext = findCardContext(req.hCard);
     if (!cardContext || !cardContext->isRunning()) {
+        return false;
+    }
+
+    // Moving the buffer leaves the bytes the view points to in place.
+    auto& connection = parent ? *parent : *this;
+    if (!cardContext->addTransmit(req, connection.packetData, receivedAt)) {
         casproxy::SCardTransmitResponse res;
         res.packetId = req.packetId;
+        res.apiReturn = SCARD_E_SERVER_TOO_BUSY;
+        sendResponse(res);
+    }
+    return true;
+}
+
+bool Session::routeTransmit(const casproxy::SCardTransmitRequest& req, std::shared_ptr<CardContext> cardContext) {
+    // Routing again could disagree with the peer about the owner, whose
+    // loads differ from ours, and send the APDU on another hop.
+    if (!server.cluster.isEnabled() || (capabilities & casproxy::CapabilityClusterPeer)) {
+        return false;
+    }
+    // Everything inside a transaction has to reach the card that holds it.
+    if (cardContext->isTransacted()) {
+        return false;
+    }
+
+    auto node = server.cluster.route(req.sendBuffer, server.readerHealth.isAvailable(cardContext->readerName));
+    if (!node) {
+        return false;
+    }
+
+    // If the owner cannot take the APDU it runs on the client's own card.
+    auto self = shared_from_this();
+    ++pendingForwards;
+    node->transmit(req, [this, self, req, cardContext, receivedAt = receivedAt](std::shared_ptr<casproxy::ResponseBase> res) {
+        --pendingForwards;
+        if (!res) {
+            if (cardContext->isRunning()) {
+                queueCardTask<casproxy::SCardTransmitResponse>(*cardContext, req, receivedAt);
+            }
+            else {
+                casproxy::SCardTransmitResponse transmitRes;
+                transmitRes.packetId = req.packetId;
+                transmitRes.apiReturn = SCARD_E_INVALID_HANDLE;
+                sendResponse(transmitRes);
+            }
+            return;
+        }
+
+        res->packetId = req.packetId;
+        sendResponse(*res);
+    });
+    return true;
+}
+
+void Session::handleSCardGetAttrib(const casproxy::SCardGetAttribRequest& req) {
+    if (forwardUpstream<casproxy::SCardGetAttribResponse>(req)) {
+        return;
+    }
+
+    const auto cardContext = findCardContext(req.hCard);
+    if (!cardContext || !cardContext->isRunning()) {
+        casproxy::SCardGetAttribResponse res;
+        res.packetId = req.packetId;
         res.apiReturn = SCARD_E_INVALID_HANDLE;
         sendResponse(res);
         return;
     }
 
-    cardContext->addTask(std::make_shared<casproxy::SCardGetAttribRequest>(req));
+    if (cardContext->cardReplaced.exchange(false)) {
+        cardContext->cardGeneration = server.readerMonitor.findCardGeneration(cardContext->readerName).value_or(0);
+    }
+    if (getCachedAttrib(req, *cardContext)) {
+        return;
+    }
+
+    queueCardTask<casproxy::SCardGetAttribResponse>(*cardContext, req, receivedAt);
 }
 
-uint64_t Session::addContext(SCARDCONTEXT hContext) {
-    uint64_t virtualContext = nextContext;
-    mapContext[virtualContext] = hContext;
-    ++nextContext;
+void Session::handleSCardTransactionScript(const casproxy::SCardTransactionScriptRequest& req) {
+    if (forwardUpstream<casproxy::SCardTransactionScriptResponse>(req)) {
+        return;
+    }
 
-    if (nextContext == 0xFFFFFFFFFFFFFFFF) {
-        ++nextContext;
+    const auto cardContext = findCardContext(req.hCard);
+    if (!cardContext || !cardContext->isRunning()) {
+        casproxy::SCardTransactionScriptResponse res;
+        res.packetId = req.packetId;
+        res.apiReturn = SCARD_E_INVALID_HANDLE;
+        sendResponse(res);
+        return;
     }
 
-    if (nextContext == 0) {
-        ++nextContext;
+    queueCardTask<casproxy::SCardTransactionScriptResponse>(*cardContext, req, receivedAt);
+}
+
+bool Session::getCachedAttrib(const casproxy::SCardGetAttribRequest& req, const CardContext& cardContext) {
+    if (!cardContext.isConnected() || !cardContext.cardGeneration || !AttribCache::isCacheable(req.dwAttrId)) {
+        return false;
     }
 
-    return virtualContext;
+    const auto attrib = server.attribCache.find(cardContext.readerName, cardContext.cardGeneration, req.dwAttrId);
+    if (!attrib) {
+        return false;
+    }
+
+    // Short buffers are left to the card worker so that the native error
+    // behavior is preserved; a zero length is a size query.
+    uint32_t attrLength = static_cast<uint32_t>(attrib->size());
+    if (req.attrLength != 0 && req.attrLength < attrLength) {
+        return false;
+    }
+
+    casproxy::SCardGetAttribResponse res;
+    res.packetId = req.packetId;
+    res.apiReturn = SCARD_S_SUCCESS;
+    if (req.attrLength != 0) {
+        res.attrBuffer = *attrib;
+    }
+    res.attrLength = attrLength;
+    sendResponse(res);
+    return true;
 }
 
-std::shared_ptr<CardContext> Session::addCardContext() {
-    uint64_t virtualCardHandle = nextCardHandle;
-    mapCardContext[virtualCardHandle] = std::make_shared<CardContext>(shared_from_this(), virtualCardHandle);
-    ++nextCardHandle;
+void Session::handleHello(const casproxy::HelloRequest& req) {
+    casproxy::HelloResponse res;
+    res.packetId = req.packetId;
+    res.version = casproxy::protocolVersion;
+
+    // Frames already in flight could not be told apart by encoding.
+    if (parent || frameCount != 1) {
+        res.apiReturn = SCARD_E_INVALID_PARAMETER;
+        sendResponse(res);
+        return;
+    }
+
+    res.apiReturn = SCARD_S_SUCCESS;
+    res.capabilities = req.capabilities & supportedCapabilities;
+    sendResponse(res);
+
+    // The response itself still goes out in the old encoding.
+    capabilities = res.capabilities;
+    if (capabilities & casproxy::CapabilityCompactEncoding) {
+        encoding = casproxy::Encoding::Compact;
+    }
+    if ((capabilities & casproxy::CapabilityKeepalive) && server.config.keepalive.interval) {
+        watchPeer(std::chrono::seconds(server.config.keepalive.interval));
+    }
+}
+
+void Session::handlePing(const casproxy::PingRequest& req) {
+    if (req.packetId != 0) {
+        casproxy::PingResponse res;
+        res.packetId = req.packetId;
+        res.apiReturn = SCARD_S_SUCCESS;
+        res.nonce = req.nonce;
+        sendResponse(res);
+        return;
+    }
 
-    if (nextCardHandle == 0xFFFFFFFFFFFFFFFF) {
-        ++nextCardHandle;
+    // An answer to a keepalive; a late one or one on another channel only
+    // counts as activity.
+    if (parent || !pingSentAt || req.nonce != pingNonce) {
+        return;
     }
+    auto rtt = receivedAt - *pingSentAt;
+    server.metrics.sessionRtt.record(rtt);
+    smoothedRtt = smoothedRtt.count() ? smoothedRtt + (rtt - smoothedRtt) / 8 : rtt;
+    pingSentAt.reset();
+}
 
-    if (nextCardHandle == 0) {
-        ++nextCardHandle;
+void Session::handleShmAttach(const casproxy::ShmAttachRequest& req) {
+    casproxy::ShmAttachResponse res;
+    res.packetId = req.packetId;
+
+    std::error_code ec;
+    auto remote = socket.remote_endpoint(ec);
+    if (!server.config.sharedMemory || ec || !remote.address().is_loopback()) {
+        res.apiReturn = SCARD_E_UNSUPPORTED_FEATURE;
+        sendResponse(res);
+        return;
+    }
+    // Every response still to come, and every frame not yet written, has to
+    // go out on the socket before the ShmAttach response does.
+    if (shm || !channels.empty() || !state.cardHandles.empty() || pendingForwards
+        || !sendQueue.empty() || !writeBatch.empty()) {
+        res.apiReturn = SCARD_E_INVALID_PARAMETER;
+        sendResponse(res);
+        return;
     }
 
-    return mapCardContext[virtualCardHandle];
+    auto transport = ShmTransport::create(id);
+    if (!transport) {
+        res.apiReturn = SCARD_E_NO_MEMORY;
+        sendResponse(res);
+        return;
+    }
+
+    // The response is the last frame on the socket.
+    res.apiReturn = SCARD_S_SUCCESS;
+    res.name = transport->getName();
+    sendResponse(res);
+
+    std::weak_ptr<Session> weak = shared_from_this();
+    auto executor = socket.get_executor();
+    transport->start(
+        [weak, executor](std::vector<std::vector<uint8_t>>&& frames) {
+            asio::post(executor, [weak, frames = std::move(frames)]() mutable {
+                if (auto self = weak.lock()) {
+                    self->handleFrames(std::move(frames));
+                }
+            });
+        },
+        [weak, executor] {
+            asio::post(executor, [weak] {
+                if (auto self = weak.lock(); self && !self->closed) {
+                    self->writeShm();
+                }
+            });
+        },
+        [weak, executor] {
+            asio::post(executor, [weak] {
+                if (auto self = weak.lock(); self && !self->closed) {
+                    self->close();
+                }
+            });
+        }
+    );
+    shm = std::move(transport);
+}
+
+void Session::handleSessionStart(const casproxy::SessionStartRequest& req) {
+    casproxy::SessionStartResponse res;
+    res.packetId = req.packetId;
+    if (server.config.sessionResumeTimeout == 0) {
+        res.apiReturn = SCARD_E_UNSUPPORTED_FEATURE;
+        sendResponse(res);
+        return;
+    }
+
+    resumeToken = server.sessionStore.createToken();
+    res.apiReturn = SCARD_S_SUCCESS;
+    res.token = resumeToken;
+    res.gracePeriod = server.config.sessionResumeTimeout;
+    sendResponse(res);
+}
+
+void Session::handleSessionResume(const casproxy::SessionResumeRequest& req) {
+    casproxy::SessionResumeResponse res;
+    res.packetId = req.packetId;
+
+    // Only a fresh connection can take over a parked session.
+    if (!state.contexts.empty() || !state.cardHandles.empty()) {
+        res.apiReturn = SCARD_E_INVALID_PARAMETER;
+        sendResponse(res);
+        return;
+    }
+
+    auto parked = server.sessionStore.resume(req.token);
+    if (!parked) {
+        res.apiReturn = SCARD_E_INVALID_HANDLE;
+        sendResponse(res);
+        return;
+    }
+
+    state = std::move(*parked);
+
+    // Leases start over; the time spent parked does not count as idle.
+    auto now = server.timerWheel.now();
+    state.contexts.forEach([this, now](uint64_t virtualContext, SessionState::NativeContext& context) {
+        context.lastUsed = now;
+        watchContext(virtualContext);
+    });
+    state.cardHandles.forEach([this, now](uint64_t virtualHandle, SessionState::CardHandle& cardHandle) {
+        watchCardHandle(virtualHandle);
+        if (cardHandle.upstream) {
+            cardHandle.upstream->lastUsed = now;
+            return;
+        }
+        cardHandle.local->setSession(shared_from_this());
+        cardHandle.local->lastUsed = now;
+        if (cardHandle.local->isTransacted()) {
+            watchTransaction(virtualHandle);
+        }
+    });
+
+    // Tokens are single use; hand out the next one with the resumed state.
+    resumeToken = server.sessionStore.createToken();
+    res.apiReturn = SCARD_S_SUCCESS;
+    res.token = resumeToken;
+    res.gracePeriod = server.config.sessionResumeTimeout;
+    sendResponse(res);
+}
+
+uint64_t Session::addContext(SCARDCONTEXT hContext, DWORD dwScope) {
+    uint64_t virtualContext = state.contexts.insert({ hContext, dwScope, server.timerWheel.now() });
+    watchContext(virtualContext);
+    return virtualContext;
+}
+
+std::shared_ptr<CardContext> Session::addCardContext() {
+    // The worker needs its handle, so the slot is taken first.
+    uint64_t virtualCardHandle = state.cardHandles.insert({});
+    auto cardContext = std::make_shared<CardContext>(shared_from_this(), server, virtualCardHandle);
+    cardContext->lastUsed = server.timerWheel.now();
+    state.cardHandles.find(virtualCardHandle)->local = cardContext;
+    watchCardHandle(virtualCardHandle);
+    return cardContext;
 }
 
 std::optional<SCARDCONTEXT> Session::findContext(uint64_t virtualContext) {
-    if (auto it = mapContext.find(virtualContext); it != mapContext.end()) {
-        return it->second;
+    if (auto context = state.contexts.find(virtualContext)) {
+        context->lastUsed = server.timerWheel.now();
+        return context->hContext;
     }
     return std::nullopt;
 }
 
 std::shared_ptr<CardContext> Session::findCardContext(uint64_t virtualCardHandle) {
-    if (auto it = mapCardContext.find(virtualCardHandle); it != mapCardContext.end()) {
-        return it->second;
+    auto cardHandle = state.cardHandles.find(virtualCardHandle);
+    if (!cardHandle || !cardHandle->local) {
+        return nullptr;
     }
-    return nullptr;
+    cardHandle->local->lastUsed = server.timerWheel.now();
+    touchContext(cardHandle->local->virtualContext);
+    return cardHandle->local;
 }
 
 void Session::removeCardContext(uint64_t virtualContext) {
-    mapContext.erase(virtualContext);
+    state.contexts.erase(virtualContext);
 }
 
-void Session::sendResponse(const casproxy::ResponseBase& res) {
-    casproxy::StreamWriter writer;
-    res.pack(writer);
+void Session::releaseCardContexts(uint64_t virtualContext) {
+    state.cardHandles.eraseIf([virtualContext](uint64_t, SessionState::CardHandle& cardHandle) {
+        if (cardHandle.local) {
+            if (cardHandle.local->virtualContext != virtualContext) {
+                return false;
+            }
+            cardHandle.local->stop();
+            return true;
+        }
+
+        const auto& card = *cardHandle.upstream;
+        if (card.virtualContext != virtualContext) {
+            return false;
+        }
+        if (card.connection->isReady() && card.connection->getEpoch() == card.epoch) {
+            casproxy::SCardDisconnectRequest req;
+            req.hCard = card.hCard;
+            req.dwDisposition = SCARD_LEAVE_CARD;
+            card.connection->send(req, [](std::shared_ptr<casproxy::ResponseBase>) {});
+        }
+        return true;
+    });
+}
+
+void Session::releaseContext(uint64_t virtualContext) {
+    auto context = state.contexts.find(virtualContext);
+    if (!context) {
+        return;
+    }
+
+    // Releasing a native context invalidates its card handles, so do the same
+    // before the context goes back to the pool.
+    releaseCardContexts(virtualContext);
+    server.contextPool.release(context->dwScope, context->hContext);
+    removeCardContext(virtualContext);
+}
+
+void Session::touchContext(uint64_t virtualContext) {
+    if (auto context = state.contexts.find(virtualContext)) {
+        context->lastUsed = server.timerWheel.now();
+    }
+}
+
+void Session::watchSession() {
+    if (!server.config.leases.session) {
+        return;
+    }
+
+    armLease(std::make_shared<Lease>(Lease{
+        std::chrono::seconds(server.config.leases.session),
+        [this]() -> std::optional<std::chrono::steady_clock::time_point> { return lastActivity; },
+        [this] { close(); }
+    }), std::chrono::seconds(server.config.leases.session));
+}
+
+void Session::enableTcpKeepalive() {
+    std::error_code ec;
+    socket.set_option(asio::socket_base::keep_alive(true), ec);
+#ifdef __linux__
+    // Three probes spread over the timeout after the interval, and the
+    // same timeout for data the peer does not acknowledge.
+    const auto& keepalive = server.config.keepalive;
+    int fd = socket.native_handle();
+    int idle = static_cast<int>(keepalive.interval);
+    int probeInterval = static_cast<int>(std::max<uint32_t>(keepalive.timeout / 3, 1));
+    int probes = 3;
+    unsigned int userTimeout = keepalive.timeout * 1000;
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &probeInterval, sizeof(probeInterval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
+#endif
+}
+
+void Session::watchPeer(std::chrono::steady_clock::duration delay) {
+    std::weak_ptr<Session> weak = shared_from_this();
+    server.timerWheel.schedule(delay, [this, weak] {
+        auto self = weak.lock();
+        if (!self || closed) {
+            return;
+        }
+
+        auto now = server.timerWheel.now();
+        auto interval = std::chrono::seconds(server.config.keepalive.interval);
+        auto timeout = std::chrono::seconds(server.config.keepalive.timeout);
+        // Any frame after the ping shows the peer is there.
+        if (pingSentAt && lastActivity > *pingSentAt) {
+            pingSentAt.reset();
+        }
+        if (pingSentAt) {
+            if (now - *pingSentAt >= timeout) {
+                ++server.metrics.reapedSessions;
+                server.logger.log(LogLevel::Warning, "Closing connection from " + ip + ", keepalive unanswered for "
+                    + std::to_string(server.config.keepalive.timeout) + "s (smoothed rtt "
+                    + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(smoothedRtt).count()) + " ms)");
+                close();
+                return;
+            }
+            watchPeer(timeout - (now - *pingSentAt));
+            return;
+        }
+
+        auto idle = now - lastActivity;
+        if (idle < interval) {
+            watchPeer(interval - idle);
+            return;
+        }
+
+        casproxy::PingResponse ping;
+        ping.packetId = 0;
+        ping.apiReturn = SCARD_S_SUCCESS;
+        ping.nonce = ++pingNonce;
+        pingSentAt = std::chrono::steady_clock::now();
+        sendResponse(ping);
+        watchPeer(timeout);
+    });
+}
+
+void Session::watchContext(uint64_t virtualContext) {
+    if (!server.config.leases.context) {
+        return;
+    }
+
+    armLease(std::make_shared<Lease>(Lease{
+        std::chrono::seconds(server.config.leases.context),
+        [this, virtualContext]() -> std::optional<std::chrono::steady_clock::time_point> {
+            if (auto context = state.contexts.find(virtualContext)) {
+                return context->lastUsed;
+            }
+            return std::nullopt;
+        },
+        [this, virtualContext] { releaseContext(virtualContext); }
+    }), std::chrono::seconds(server.config.leases.context));
+}
 
-    uint32_t packetLength = static_cast<uint32_t>(writer.buffer.size());
-    std::vector<uint8_t> packet(packetLength + 4);
-    packetLength = casproxy::swapEndian32(packetLength);
-    memcpy(packet.data(), &packetLength, 4);
-    memcpy(packet.data() + 4, writer.buffer.data(), writer.buffer.size());
+void Session::watchCardHandle(uint64_t virtualCardHandle) {
+    if (!server.config.leases.cardHandle) {
+        return;
+    }
+
+    armLease(std::make_shared<Lease>(Lease{
+        std::chrono::seconds(server.config.leases.cardHandle),
+        [this, virtualCardHandle]() -> std::optional<std::chrono::steady_clock::time_point> {
+            auto cardHandle = state.cardHandles.find(virtualCardHandle);
+            if (!cardHandle) {
+                return std::nullopt;
+            }
+            return cardHandle->local ? cardHandle->local->lastUsed : cardHandle->upstream->lastUsed;
+        },
+        [this, virtualCardHandle] { expireCardHandle(virtualCardHandle); }
+    }), std::chrono::seconds(server.config.leases.cardHandle));
+}
+
+void Session::watchTransaction(uint64_t virtualCardHandle) {
+    if (!server.config.leases.transaction) {
+        return;
+    }
+
+    auto self = shared_from_this();
+    asio::post(socket.get_executor(), [this, self, virtualCardHandle] {
+        armLease(std::make_shared<Lease>(Lease{
+            std::chrono::seconds(server.config.leases.transaction),
+            [this, virtualCardHandle]() -> std::optional<std::chrono::steady_clock::time_point> {
+                auto cardHandle = state.cardHandles.find(virtualCardHandle);
+                if (!cardHandle || !cardHandle->local || !cardHandle->local->isTransacted()) {
+                    return std::nullopt;
+                }
+                return cardHandle->local->lastUsed;
+            },
+            [this, virtualCardHandle] {
+                if (auto cardHandle = state.cardHandles.find(virtualCardHandle); cardHandle && cardHandle->local) {
+                    cardHandle->local->expireTransaction();
+                }
+            }
+        }), std::chrono::seconds(server.config.leases.transaction));
+    });
+}
+
+void Session::releaseCardHandle(uint64_t virtualCardHandle) {
+    auto self = shared_from_this();
+    asio::post(socket.get_executor(), [this, self, virtualCardHandle] {
+        auto cardHandle = state.cardHandles.find(virtualCardHandle);
+        if (cardHandle && cardHandle->local && !cardHandle->local->isRunning()) {
+            state.cardHandles.erase(virtualCardHandle);
+        }
+    });
+}
 
-    sendQueue.push_back(packet);
-    if (sendQueue.size() < 2) {
-        doWrite();
+void Session::expireCardHandle(uint64_t virtualCardHandle) {
+    auto cardHandle = state.cardHandles.find(virtualCardHandle);
+    if (!cardHandle) {
+        return;
+    }
+
+    // The worker disconnects the card when it stops.
+    if (cardHandle->local) {
+        cardHandle->local->stop();
+    }
+    else {
+        const auto& card = *cardHandle->upstream;
+        if (card.connection->isReady() && card.connection->getEpoch() == card.epoch) {
+            casproxy::SCardDisconnectRequest req;
+            req.hCard = card.hCard;
+            req.dwDisposition = SCARD_LEAVE_CARD;
+            card.connection->send(req, [](std::shared_ptr<casproxy::ResponseBase>) {});
+        }
     }
+    state.cardHandles.erase(virtualCardHandle);
+}
+
+// Checks the lease when it could first have run out and again for the
+// remainder if the object was used since, so a request only stamps a time.
+void Session::armLease(std::shared_ptr<Lease> lease, std::chrono::steady_clock::duration delay) {
+    std::weak_ptr<Session> weak = shared_from_this();
+    server.timerWheel.schedule(delay, [this, weak, lease] {
+        auto self = weak.lock();
+        if (!self || closed) {
+            return;
+        }
+
+        auto lastUsed = lease->lastUsed();
+        if (!lastUsed) {
+            return;
+        }
+
+        auto idle = server.timerWheel.now() - *lastUsed;
+        if (idle >= lease->duration) {
+            lease->onExpired();
+        }
+        else {
+            armLease(lease, lease->duration - idle);
+        }
+    });
+}
+
+void Session::sendResponse(const casproxy::ResponseBase& res, std::vector<uint8_t>&& frame) {
+    auto connection = parent ? parent : shared_from_this();
+    casproxy::StreamWriter writer(encoding);
+    if (capabilities & casproxy::CapabilityChannels) {
+        writer.writeBe(channel);
+    }
+    res.pack(writer);
+    if (capabilities & casproxy::CapabilityServerTiming) {
+        res.timing.pack(writer);
+    }
+    server.capture.record(capture::Direction::Response, connection->id, writer.buffer.data(), writer.buffer.size());
+
+    // Card workers respond from their own threads; the send queue and the
+    // shared memory transport are only touched on the I/O thread.
+    auto handedOverAt = std::chrono::steady_clock::now();
+    auto caller = std::this_thread::get_id();
+    uint32_t channel = this->channel, packetId = res.packetId;
+    auto encoding = this->encoding;
+    asio::dispatch(socket.get_executor(), [connection, packet = std::move(writer.buffer), frame = std::move(frame), encoding, handedOverAt, caller, channel, packetId]() mutable {
+        if (std::this_thread::get_id() != caller) {
+            connection->server.metrics.ioWakeup.record(std::chrono::steady_clock::now() - handedOverAt);
+        }
+        if (!frame.empty()) {
+            connection->server.bufferPool.release(std::move(frame));
+        }
+        if (connection->closed) {
+            return;
+        }
+        if (connection->mirror) {
+            connection->mirror->response(channel, packetId, packet);
+        }
+        // Frames in shared memory need no length prefix.
+        if (connection->shm) {
+            connection->sendQueue.push_back(std::move(packet));
+            connection->writeShm();
+        }
+        else {
+            connection->sendQueue.push_back(casproxy::makeFrame(packet, encoding));
+            connection->doWrite();
+        }
+    });
 }
 
 void Session::doWrite() {
     auto self = shared_from_this();
 
-    if (sendQueue.empty()) {
+    if (sendQueue.empty() || !writeBatch.empty()) {
+        return;
+    }
+    // Once the ShmAttach response is written, the rest goes to the ring.
+    if (shm) {
+        writeShm();
         return;
     }
 
-    asio::async_write(socket, asio::buffer(sendQueue.front()),
+    // Whatever queued up meanwhile goes out in one write; with channels,
+    // that batches the responses of many sessions.
+    writeBatch.swap(sendQueue);
+    std::vector<asio::const_buffer> buffers;
+    buffers.reserve(writeBatch.size());
+    for (const auto& packet : writeBatch) {
+        buffers.push_back(asio::buffer(packet));
+    }
+
+    asio::async_write(socket, buffers,
         [this, self](std::error_code ec, std::size_t) {
             if (ec) {
                 close();
             }
             else {
-                sendQueue.pop_front();
+                writeBatch.clear();
                 doWrite();
             }
         }
     );
 }
 
+void Session::writeShm() {
+    // What does not fit waits for the client to make room.
+    size_t written = 0;
+    while (written < sendQueue.size() && shm->write(sendQueue[written].data(), sendQueue[written].size())) {
+        ++written;
+    }
+    sendQueue.erase(sendQueue.begin(), sendQueue.begin() + written);
+}
+
 void Session::close() {
+    closed = true;
     std::error_code ignored;
     socket.close(ignored);
+    shm.reset();
+    if (mirror) {
+        mirror->close();
+        mirror.reset();
+    }
 
-    std::deque<std::vector<uint8_t>> empty;
-    sendQueue.swap(empty);
+    std::vector<std::vector<uint8_t>>().swap(sendQueue);
+    std::vector<std::vector<uint8_t>>().swap(writeBatch);
 
+    auto channelSessions = std::move(channels);
+    channels.clear();
+    for (const auto& [channel, session] : channelSessions) {
+        session->close();
+    }
+
+    if (!resumeToken.empty()) {
+        server.sessionStore.park(resumeToken, std::move(state), std::chrono::seconds(server.config.sessionResumeTimeout));
+        resumeToken.clear();
+        state = SessionState();
+    }
     clear();
 
     if (onClose) {
@@ -3,50 +3,175 @@
 #include <memory>
 #include <map>
 #include <vector>
+#include <array>
 #include <optional>
 #include <functional>
+#include <chrono>
 #include <asio.hpp>
 #include <winscard.h>
 #include "cardContext.h"
+#include "serverContext.h"
+#include "shmTransport.h"
+#include "slotMap.h"
+
+class ContextPool;
+class UpstreamConnection;
+class MirrorConnection;
+
+// Virtual contexts and card handles owned by a client. Kept apart from the
+// connection so that it can outlive a dropped connection and be resumed.
+struct SessionState {
+    struct NativeContext {
+        SCARDCONTEXT hContext;
+        DWORD dwScope;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    // A card handle opened on a remote casproxyserver.
+    struct UpstreamCard {
+        std::shared_ptr<UpstreamConnection> connection;
+        uint64_t epoch;
+        uint64_t hCard;
+        uint64_t virtualContext;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    // Served by a local card worker or by a remote casproxyserver; one of
+    // the two is set.
+    struct CardHandle {
+        std::shared_ptr<CardContext> local;
+        std::optional<UpstreamCard> upstream;
+    };
+
+    void clear(ContextPool& contextPool);
+
+    // Keyed by virtual handle, which is what clients see.
+    SlotMap<NativeContext> contexts;
+    SlotMap<CardHandle> cardHandles;
+};
 
 class Session : public std::enable_shared_from_this<Session> {
 public:
     using CloseHandler = std::function<void(std::shared_ptr<Session>)>;
-    Session(asio::ip::tcp::socket socket, CloseHandler onClose);
+    Session(asio::ip::tcp::socket socket, ServerContext& server, CloseHandler onClose);
+    // A channel of the connection of parent.
+    Session(std::shared_ptr<Session> parent, uint32_t channel, CloseHandler onClose);
+    void start();
     void clear();
     void doRead();
-    void readPacketData();
+    void readCompactHeader();
+    // head holds the start of the frame if it was read with the length.
+    void readPacketData(const uint8_t* head = nullptr, size_t headSize = 0);
     void handlePacket();
+    void handleRequest(casproxy::StreamReader& reader);
+    bool transmitInPlace(uint32_t packetId, const casproxy::StreamReader& reader);
+    void handleFrames(std::vector<std::vector<uint8_t>>&& frames);
+    void handleHello(const casproxy::HelloRequest& req);
+    void handlePing(const casproxy::PingRequest& req);
+    void handleShmAttach(const casproxy::ShmAttachRequest& req);
     void handleSCardEstablishContext(const casproxy::SCardEstablishContextRequest& req);
     void handleSCardReleaseContext(const casproxy::SCardReleaseContextRequest& req);
     void handleSCardListReaders(const casproxy::SCardListReadersRequest& req);
+    bool collectReaders(SCARDCONTEXT hContext, std::vector<uint8_t>& readers);
+    void sendReaderList(const casproxy::SCardListReadersRequest& req, const std::vector<uint8_t>& readers);
     void handleSCardConnect(const casproxy::SCardConnectRequest& req);
+    void connectUpstream(const casproxy::SCardConnectRequest& req);
     void handleSCardDisconnect(const casproxy::SCardDisconnectRequest& req);
     void handleSCardBeginTransaction(const casproxy::SCardBeginTransactionRequest& req);
     void handleSCardEndTransaction(const casproxy::SCardEndTransactionRequest& req);
     void handleSCardTransmit(const casproxy::SCardTransmitRequest& req);
+    bool routeTransmit(const casproxy::SCardTransmitRequest& req, std::shared_ptr<CardContext> cardContext);
     void handleSCardGetAttrib(const casproxy::SCardGetAttribRequest& req);
-    uint64_t addContext(SCARDCONTEXT hContext);
+    void handleSCardTransactionScript(const casproxy::SCardTransactionScriptRequest& req);
+    void handleSessionStart(const casproxy::SessionStartRequest& req);
+    void handleSessionResume(const casproxy::SessionResumeRequest& req);
+    bool getCachedAttrib(const casproxy::SCardGetAttribRequest& req, const CardContext& cardContext);
+    uint64_t addContext(SCARDCONTEXT hContext, DWORD dwScope);
     std::shared_ptr<CardContext> addCardContext();
     std::optional<SCARDCONTEXT> findContext(uint64_t virtualContext);
     std::shared_ptr<CardContext> findCardContext(uint64_t virtualCardHandle);
     void removeCardContext(uint64_t virtualContext);
-    void sendResponse(const casproxy::ResponseBase& res);
+    void releaseCardContexts(uint64_t virtualContext);
+    void releaseContext(uint64_t virtualContext);
+    void touchContext(uint64_t virtualContext);
+    // Arms the transaction lease of a card handle; called by its worker.
+    void watchTransaction(uint64_t virtualCardHandle);
+    // Frees the slot of a card handle whose connect failed; called by its
+    // worker.
+    void releaseCardHandle(uint64_t virtualCardHandle);
+    // frame is a receive buffer the request was read in place from; it goes
+    // back to the buffer pool on the I/O thread.
+    void sendResponse(const casproxy::ResponseBase& res, std::vector<uint8_t>&& frame = {});
     void doWrite();
+    void writeShm();
     void close();
+    uint64_t getId() const { return id; }
 
     std::string ip;
     asio::ip::tcp::socket socket;
 
 private:
+    struct Lease;
+
+    std::shared_ptr<Session> openChannel(uint32_t channel);
+    // Waits for the client to close a socket that has moved to shared memory.
+    void watchSocket();
+    void watchSession();
+    // Lets the kernel probe a connection that has gone quiet.
+    void enableTcpKeepalive();
+    // Pings a client that granted keepalives whenever the connection has been
+    // quiet for the interval, and closes it if the ping goes unanswered.
+    void watchPeer(std::chrono::steady_clock::duration delay);
+    void watchContext(uint64_t virtualContext);
+    void watchCardHandle(uint64_t virtualCardHandle);
+    void expireCardHandle(uint64_t virtualCardHandle);
+    void armLease(std::shared_ptr<Lease> lease, std::chrono::steady_clock::duration delay);
+
+    template<typename Response, typename Request>
+    bool forwardUpstream(const Request& req, std::function<void(const Response&)> onResponse = nullptr);
+    // Answers req with SCARD_E_SERVER_TOO_BUSY if the worker has fallen too
+    // far behind to take it.
+    template<typename Response, typename Request>
+    void queueCardTask(CardContext& cardContext, const Request& req, std::chrono::steady_clock::time_point receivedAt);
+
+    ServerContext& server;
+    // Switched by the Hello on the first frame, before any card worker can
+    // respond, so workers read it without synchronization.
+    casproxy::Encoding encoding{ casproxy::Encoding::V1 };
+    uint32_t capabilities{ 0 };
+    // Set once frames go through shared memory and reset on close; only
+    // touched on the I/O thread.
+    std::unique_ptr<ShmTransport> shm;
+    // Set on the session of a channel other than 0; the socket and the send
+    // queue are the parent's.
+    std::shared_ptr<Session> parent;
+    uint32_t channel{ 0 };
+    std::map<uint32_t, std::shared_ptr<Session>> channels;
+    std::shared_ptr<MirrorConnection> mirror;
+    uint64_t frameCount{ 0 };
+    // Requests sent on to an upstream or cluster node and not yet answered.
+    uint32_t pendingForwards{ 0 };
+    // When the request being handled was read; card workers are told.
+    std::chrono::steady_clock::time_point receivedAt;
     uint32_t packetLength;
+    std::array<uint8_t, casproxy::compactHeaderSize> compactHeader;
     std::vector<uint8_t> packetData;
-    std::map<uint64_t, SCARDCONTEXT> mapContext;
-    std::map<uint64_t, std::shared_ptr<CardContext>> mapCardContext;
-    uint64_t nextContext{ 1 };
-    uint64_t nextCardHandle{ 1 };
+    SessionState state;
+    // Identifies the connection in traffic captures.
+    uint64_t id;
+    std::chrono::steady_clock::time_point lastActivity;
+    // Of the last keepalive ping; the time is only set while it is unanswered.
+    uint64_t pingNonce{ 0 };
+    std::optional<std::chrono::steady_clock::time_point> pingSentAt;
+    // Moves an eighth of the way to each new sample, like TCP's.
+    std::chrono::steady_clock::duration smoothedRtt{ 0 };
+    std::vector<uint8_t> resumeToken;
+    bool closed{ false };
     CloseHandler onClose;
-    std::deque<std::vector<uint8_t>> sendQueue;
-    std::mutex sendMutex;
+    // Rarely holds more than one frame; unlike a deque, an empty vector
+    // allocates nothing.
+    std::vector<std::vector<uint8_t>> sendQueue;
+    // Frames being written, all in one write.
+    std::vector<std::vector<uint8_t>> writeBatch;
 
 };
\ No newline at end of file
@@ -0,0 +1,56 @@
+#include "sessionStore.h"
+#include "contextPool.h"
+#include <random>
+
+namespace {
+
+constexpr size_t tokenSize = 16;
+
+}
+
+SessionStore::SessionStore(asio::io_context& io_context, ContextPool& contextPool)
+    : io_context(io_context), contextPool(contextPool) {
+}
+
+std::vector<uint8_t> SessionStore::createToken() {
+    std::random_device random;
+    std::vector<uint8_t> token(tokenSize);
+    for (size_t i = 0; i < tokenSize; i += 4) {
+        uint32_t value = random();
+        memcpy(token.data() + i, &value, 4);
+    }
+    return token;
+}
+
+void SessionStore::park(const std::vector<uint8_t>& token, SessionState state, std::chrono::seconds gracePeriod) {
+    if (state.contexts.empty() && state.cardHandles.empty()) {
+        return;
+    }
+
+    auto timer = std::make_unique<asio::steady_timer>(io_context, gracePeriod);
+    timer->async_wait([this, token](std::error_code ec) {
+        if (ec) {
+            return;
+        }
+
+        auto it = parkedSessions.find(token);
+        if (it != parkedSessions.end()) {
+            it->second.state.clear(contextPool);
+            parkedSessions.erase(it);
+        }
+    });
+
+    parkedSessions[token] = { std::move(state), std::move(timer) };
+}
+
+std::optional<SessionState> SessionStore::resume(const std::vector<uint8_t>& token) {
+    auto it = parkedSessions.find(token);
+    if (it == parkedSessions.end()) {
+        return std::nullopt;
+    }
+
+    // Erasing destroys the timer, which cancels the pending expiry.
+    SessionState state = std::move(it->second.state);
+    parkedSessions.erase(it);
+    return state;
+}
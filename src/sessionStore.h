@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <optional>
+#include <asio.hpp>
+#include "session.h"
+
+class ContextPool;
+
+// Holds the state of sessions whose connection dropped for a grace period so
+// that a reconnecting client presenting the session's token gets it back.
+// Only used from the I/O thread.
+class SessionStore {
+public:
+    SessionStore(asio::io_context& io_context, ContextPool& contextPool);
+    std::vector<uint8_t> createToken();
+    void park(const std::vector<uint8_t>& token, SessionState state, std::chrono::seconds gracePeriod);
+    std::optional<SessionState> resume(const std::vector<uint8_t>& token);
+
+private:
+    struct ParkedSession {
+        SessionState state;
+        std::unique_ptr<asio::steady_timer> timer;
+    };
+
+    asio::io_context& io_context;
+    ContextPool& contextPool;
+    std::map<std::vector<uint8_t>, ParkedSession> parkedSessions;
+
+};
@@ -0,0 +1,280 @@
+#include "shmTransport.h"
+#include "threadScheduling.h"
+#ifdef __linux__
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#ifdef __linux__
+
+namespace {
+
+constexpr uint32_t regionMagic = 0x43505352;
+// Room for the largest frame either side accepts.
+constexpr size_t ringSize = 256 * 1024;
+// How long a receive thread spins before it sleeps. On a single CPU the
+// spinning would only hold off the thread it waits for.
+constexpr auto spinTime = std::chrono::microseconds(50);
+// Sleepers check for shutdown at least this often.
+constexpr time_t sleepSeconds = 1;
+
+void futexWait(std::atomic<uint32_t>& word, uint32_t expected) {
+    timespec timeout{ sleepSeconds, 0 };
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+void futexWake(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+void wake(std::atomic<uint32_t>& sequence) {
+    sequence.fetch_add(1);
+    futexWake(sequence);
+}
+
+void copyIn(uint8_t* ring, uint64_t position, const void* data, size_t size) {
+    size_t offset = position % ringSize;
+    size_t first = std::min(size, ringSize - offset);
+    memcpy(ring + offset, data, first);
+    memcpy(ring, static_cast<const uint8_t*>(data) + first, size - first);
+}
+
+void copyOut(const uint8_t* ring, uint64_t position, void* data, size_t size) {
+    size_t offset = position % ringSize;
+    size_t first = std::min(size, ringSize - offset);
+    memcpy(data, ring + offset, first);
+    memcpy(static_cast<uint8_t*>(data) + first, ring, size - first);
+}
+
+}
+
+// Shared by both processes. The memory of a new file is zero, which is the
+// initial state of every field but the magic.
+struct ShmTransport::Region {
+    // One per side; the side sleeps on its own and rings the other's.
+    struct alignas(64) Doorbell {
+        std::atomic<uint32_t> sequence;
+        std::atomic<uint32_t> sleeping;
+        // Set by the side when its last write did not fit.
+        std::atomic<uint32_t> writerBlocked;
+    };
+
+    struct Ring {
+        // Byte positions; only ever grow.
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) uint8_t data[ringSize];
+    };
+
+    uint32_t magic;
+    Doorbell doorbells[2];
+    // Requests from the client, then responses from the server.
+    Ring rings[2];
+};
+
+std::unique_ptr<ShmTransport> ShmTransport::create(uint64_t sessionId) {
+    std::random_device random;
+    std::string name = "/casproxy-" + std::to_string(getpid()) + "-" + std::to_string(sessionId)
+        + "-" + std::to_string(random());
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return nullptr;
+    }
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, sizeof(Region)) == 0) {
+        memory = mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    auto region = static_cast<Region*>(memory);
+    region->magic = regionMagic;
+    return std::unique_ptr<ShmTransport>(new ShmTransport(std::move(name), region, true));
+}
+
+std::unique_ptr<ShmTransport> ShmTransport::open(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) == sizeof(Region)) {
+        memory = mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    shm_unlink(name.c_str());
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    auto region = static_cast<Region*>(memory);
+    if (region->magic != regionMagic) {
+        munmap(memory, sizeof(Region));
+        return nullptr;
+    }
+    return std::unique_ptr<ShmTransport>(new ShmTransport(name, region, false));
+}
+
+ShmTransport::ShmTransport(std::string name, Region* region, bool server)
+    : name(std::move(name)), region(region), server(server) {
+}
+
+ShmTransport::~ShmTransport() {
+    if (thread.joinable()) {
+        stopping = true;
+        wake(region->doorbells[server ? 0 : 1].sequence);
+        thread.join();
+    }
+    munmap(region, sizeof(Region));
+    // Only still there if the client never opened it.
+    if (server) {
+        shm_unlink(name.c_str());
+    }
+}
+
+void ShmTransport::start(FramesHandler onFrames, Handler onWritable, Handler onError) {
+    this->onFrames = std::move(onFrames);
+    this->onWritable = std::move(onWritable);
+    this->onError = std::move(onError);
+    thread = std::thread([this] { run(); });
+}
+
+bool ShmTransport::write(const uint8_t* data, size_t size) {
+    auto& doorbell = region->doorbells[server ? 0 : 1];
+    auto& peer = region->doorbells[server ? 1 : 0];
+    auto& ring = region->rings[server ? 1 : 0];
+    uint32_t length = static_cast<uint32_t>(size);
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+
+    // The reader checks writerBlocked after freeing room, so one of the two
+    // sees the other.
+    while (ringSize - (tail - ring.head.load()) < sizeof(length) + size) {
+        if (doorbell.writerBlocked.load()) {
+            return false;
+        }
+        doorbell.writerBlocked.store(1);
+    }
+    doorbell.writerBlocked.store(0, std::memory_order_relaxed);
+
+    copyIn(ring.data, tail, &length, sizeof(length));
+    copyIn(ring.data, tail + sizeof(length), data, size);
+    ring.tail.store(tail + sizeof(length) + size);
+    if (peer.sleeping.load()) {
+        wake(peer.sequence);
+    }
+    return true;
+}
+
+void ShmTransport::run() {
+    auto& doorbell = region->doorbells[server ? 0 : 1];
+    auto& peer = region->doorbells[server ? 1 : 0];
+    auto& inbound = region->rings[server ? 0 : 1];
+    auto& outbound = region->rings[server ? 1 : 0];
+    uint64_t outboundHead = outbound.head.load();
+    auto idleSince = std::chrono::steady_clock::now();
+    bool spin = std::thread::hardware_concurrency() > 1;
+
+    while (!stopping) {
+        std::vector<std::vector<uint8_t>> frames;
+        uint64_t head = inbound.head.load(std::memory_order_relaxed);
+        uint64_t tail = inbound.tail.load();
+        // The peer is another process; nothing it wrote is trusted.
+        bool corrupt = tail - head > ringSize;
+        while (!corrupt && tail - head >= sizeof(uint32_t)) {
+            uint32_t length;
+            copyOut(inbound.data, head, &length, sizeof(length));
+            if (length > tail - head - sizeof(length)) {
+                corrupt = true;
+                break;
+            }
+            std::vector<uint8_t> frame(length);
+            copyOut(inbound.data, head + sizeof(length), frame.data(), length);
+            head += sizeof(length) + length;
+            frames.push_back(std::move(frame));
+        }
+
+        bool received = !frames.empty();
+        if (received) {
+            inbound.head.store(head);
+            if (peer.writerBlocked.load()) {
+                wake(peer.sequence);
+            }
+            onFrames(std::move(frames));
+            idleSince = std::chrono::steady_clock::now();
+        }
+        if (corrupt) {
+            onError();
+            return;
+        }
+        if (received) {
+            continue;
+        }
+
+        if (doorbell.writerBlocked.load() && outbound.head.load() != outboundHead) {
+            outboundHead = outbound.head.load();
+            onWritable();
+            continue;
+        }
+
+        if (spin && std::chrono::steady_clock::now() - idleSince < spinTime) {
+            cpuRelax();
+            continue;
+        }
+
+        uint32_t sequence = doorbell.sequence.load();
+        doorbell.sleeping.store(1);
+        bool idle = inbound.tail.load() == head
+            && !(doorbell.writerBlocked.load() && outbound.head.load() != outboundHead);
+        if (idle && !stopping) {
+            futexWait(doorbell.sequence, sequence);
+        }
+        doorbell.sleeping.store(0);
+        idleSince = std::chrono::steady_clock::now();
+    }
+}
+
+#else
+
+struct ShmTransport::Region {
+};
+
+std::unique_ptr<ShmTransport> ShmTransport::create(uint64_t) {
+    return nullptr;
+}
+
+std::unique_ptr<ShmTransport> ShmTransport::open(const std::string&) {
+    return nullptr;
+}
+
+ShmTransport::ShmTransport(std::string name, Region* region, bool server)
+    : name(std::move(name)), region(region), server(server) {
+}
+
+ShmTransport::~ShmTransport() {
+}
+
+void ShmTransport::start(FramesHandler, Handler, Handler) {
+}
+
+bool ShmTransport::write(const uint8_t*, size_t) {
+    return false;
+}
+
+void ShmTransport::run() {
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <functional>
+
+// Carries frames between a client and the server on the same host through a
+// pair of single-producer single-consumer rings in a shared memory file,
+// without a system call per frame. Each side drains its ring on a receive
+// thread, which spins for a moment when the ring runs dry and then sleeps on
+// a futex; a writer only wakes the other side if it is asleep.
+//
+// Linux only. Elsewhere create and open return nullptr.
+class ShmTransport {
+public:
+    using FramesHandler = std::function<void(std::vector<std::vector<uint8_t>>&& frames)>;
+    using Handler = std::function<void()>;
+
+    // The server side. The file is readable by the server's user only.
+    static std::unique_ptr<ShmTransport> create(uint64_t sessionId);
+    // The client side. Unlinks the file once it is mapped.
+    static std::unique_ptr<ShmTransport> open(const std::string& name);
+    ~ShmTransport();
+
+    // Starts the receive thread; the handlers are called on it. onError
+    // means the peer wrote something that is not a frame, and ends receiving.
+    void start(FramesHandler onFrames, Handler onWritable, Handler onError);
+    // Must always be called from the same thread. Returns false if the ring
+    // has no room for the frame; onWritable follows once the peer made some.
+    bool write(const uint8_t* data, size_t size);
+    const std::string& getName() const { return name; }
+
+private:
+    struct Region;
+
+    ShmTransport(std::string name, Region* region, bool server);
+    void run();
+
+    std::string name;
+    Region* region;
+    bool server;
+    std::atomic<bool> stopping{ false };
+    FramesHandler onFrames;
+    Handler onWritable;
+    Handler onError;
+    std::thread thread;
+
+};
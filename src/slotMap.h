@@ -0,0 +1,125 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <optional>
+#include <utility>
+
+// Values stored under handles that resolve with one index into a contiguous
+// array. A handle fits in 32 bits, so that clients which keep only those
+// still have all of it: the slot index plus one in its low 20 bits and the
+// generation of the slot, modulo 4096, in the 12 above. Freeing a slot bumps
+// its generation, so a handle that outlived its value finds nothing until
+// the slot has been reused 4096 times. Until a slot is reused, handles come
+// out as 1, 2, 3 and so on, and even reused ones stay short in the compact
+// encoding.
+template<typename T>
+class SlotMap {
+public:
+    static constexpr uint32_t maxSize = (1u << 20) - 1;
+
+    // Must not be called when full.
+    uint64_t insert(T value) {
+        uint32_t index;
+        if (!freeSlots.empty()) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else {
+            index = static_cast<uint32_t>(slots.size());
+            slots.emplace_back();
+        }
+        slots[index].value = std::move(value);
+        ++count;
+        return makeHandle(index, slots[index].generation);
+    }
+
+    // Invalidated by insert.
+    T* find(uint64_t handle) {
+        Slot* slot = findSlot(handle);
+        return slot ? &*slot->value : nullptr;
+    }
+
+    const T* find(uint64_t handle) const {
+        return const_cast<SlotMap*>(this)->find(handle);
+    }
+
+    bool erase(uint64_t handle) {
+        Slot* slot = findSlot(handle);
+        if (!slot) {
+            return false;
+        }
+        release(static_cast<uint32_t>(slot - slots.data()));
+        return true;
+    }
+
+    // Calls predicate(handle, value) for every value and erases those it
+    // returns true for.
+    template<typename Predicate>
+    void eraseIf(Predicate predicate) {
+        for (uint32_t index = 0; index < slots.size(); ++index) {
+            auto& slot = slots[index];
+            if (slot.value && predicate(makeHandle(index, slot.generation), *slot.value)) {
+                release(index);
+            }
+        }
+    }
+
+    // Calls function(handle, value) for every value, in slot order. The
+    // function must not insert or erase.
+    template<typename Function>
+    void forEach(Function function) {
+        for (uint32_t index = 0; index < slots.size(); ++index) {
+            auto& slot = slots[index];
+            if (slot.value) {
+                function(makeHandle(index, slot.generation), *slot.value);
+            }
+        }
+    }
+
+    // Handles from before stay invalid.
+    void clear() {
+        eraseIf([](uint64_t, const T&) { return true; });
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool full() const { return count == maxSize; }
+
+private:
+    struct Slot {
+        uint32_t generation{ 0 };
+        std::optional<T> value;
+    };
+
+    static constexpr uint32_t generationMask = 0xFFF;
+
+    static uint64_t makeHandle(uint32_t index, uint32_t generation) {
+        return (uint64_t{ generation & generationMask } << 20) | (uint64_t{ index } + 1);
+    }
+
+    Slot* findSlot(uint64_t handle) {
+        uint64_t index = (handle & maxSize) - 1;
+        if (handle >> 32 || index >= slots.size()) {
+            return nullptr;
+        }
+        Slot& slot = slots[index];
+        if (!slot.value || (slot.generation & generationMask) != ((handle >> 20) & generationMask)) {
+            return nullptr;
+        }
+        return &slot;
+    }
+
+    void release(uint32_t index) {
+        slots[index].value.reset();
+        ++slots[index].generation;
+        freeSlots.push_back(index);
+        --count;
+    }
+
+    std::vector<Slot> slots;
+    // Reused last in, first out, so the slots in use stay packed.
+    std::vector<uint32_t> freeSlots;
+    size_t count{ 0 };
+
+};
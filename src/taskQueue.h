@@ -0,0 +1,140 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include "threadScheduling.h"
+
+// A bounded queue that any thread may push to and one consumer thread drains.
+// Pushing takes no lock: each slot carries a sequence number that says whose
+// turn it is, so producers only race for the tail index. The consumer spins
+// for a while when the queue runs dry and then parks on a condition
+// variable; producers only take the lock to wake it when it is parked. How
+// long it spins adapts to whether spinning has lately caught new values.
+template<typename T>
+class TaskQueue {
+public:
+    // Rounded up to a power of two.
+    explicit TaskQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask = size - 1;
+        cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false if the queue is full, leaving value as it was.
+    bool push(T&& value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (difference < 0) {
+                return false;
+            }
+            else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = std::move(value);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        // Pairs with the fence in wait: either the consumer sees the value
+        // before it parks or this sees it parked.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed)) {
+            wake();
+        }
+        return true;
+    }
+
+    // Consumer only. Moves everything queued, in order, to the end of out.
+    void popAll(std::vector<T>& out) {
+        for (;;) {
+            Cell& cell = cells[head & mask];
+            if (cell.sequence.load(std::memory_order_acquire) != head + 1) {
+                return;
+            }
+            out.push_back(std::move(cell.value));
+            cell.value = T();
+            cell.sequence.store(head + mask + 1, std::memory_order_release);
+            ++head;
+        }
+    }
+
+    // Consumer only.
+    bool empty() const {
+        return cells[head & mask].sequence.load(std::memory_order_acquire) != head + 1;
+    }
+
+    // Consumer only. Returns once a value is queued or ready() is true.
+    // Whatever makes ready() true has to call wake() afterwards.
+    template<typename Ready>
+    void wait(Ready ready) {
+        if (!empty() || ready()) {
+            return;
+        }
+
+        auto spinUntil = std::chrono::steady_clock::now() + spinTime;
+        while (canSpin && std::chrono::steady_clock::now() < spinUntil) {
+            if (!empty() || ready()) {
+                spinTime = std::min(spinTime * 2 + minSpinTime, maxSpinTime);
+                return;
+            }
+            cpuRelax();
+        }
+
+        spinTime /= 2;
+        std::unique_lock<std::mutex> lock(mutex);
+        parked.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait(lock, [this, &ready] { return !empty() || ready(); });
+        parked.store(false, std::memory_order_relaxed);
+    }
+
+    void wake() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        cv.notify_one();
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static constexpr std::chrono::nanoseconds minSpinTime{ 500 };
+    static constexpr std::chrono::nanoseconds maxSpinTime{ 50000 };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail{ 0 };
+    // Only touched by the consumer.
+    alignas(64) size_t head{ 0 };
+    // On a single CPU the spinning would only hold off the producer.
+    bool canSpin{ std::thread::hardware_concurrency() > 1 };
+    std::chrono::nanoseconds spinTime{ maxSpinTime };
+    alignas(64) std::atomic<bool> parked{ false };
+    std::mutex mutex;
+    std::condition_variable cv;
+
+};
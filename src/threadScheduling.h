@@ -0,0 +1,29 @@
+#pragma once
+#include <vector>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+// Pins the calling thread to the given CPUs. Returns false if the platform
+// does not support it or refuses.
+bool pinCurrentThread(const std::vector<int>& cpus);
+
+// The CPUs the calling thread may run on. Empty where threads do not inherit
+// the affinity of the thread that creates them.
+std::vector<int> currentThreadCpus();
+
+// Runs the calling thread with real-time priority: SCHED_FIFO at the given
+// priority on Linux, time-critical priority on Windows. Usually needs
+// CAP_SYS_NICE or root.
+bool setRealtimePriority(int priority);
+
+// Tells the CPU that the calling thread is busy waiting.
+inline void cpuRelax() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
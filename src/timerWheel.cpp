@@ -0,0 +1,91 @@
+#include "timerWheel.h"
+#include <algorithm>
+
+namespace {
+
+constexpr uint64_t rootMask = (uint64_t{ 1 } << 8) - 1;
+constexpr uint64_t levelMask = (uint64_t{ 1 } << 6) - 1;
+constexpr uint64_t maxTicks = (uint64_t{ 1 } << (8 + 6 * 3)) - 1;
+
+}
+
+TimerWheel::TimerWheel(asio::io_context& io_context, Clock::duration tick)
+    : timer(io_context), tick(tick), startTime(Clock::now()), currentTime(startTime) {
+}
+
+void TimerWheel::start() {
+    startTime = Clock::now();
+    currentTime = startTime;
+    currentTick = 0;
+    wait();
+}
+
+void TimerWheel::schedule(Clock::duration delay, Callback callback) {
+    uint64_t ticks = delay > Clock::duration::zero() ? static_cast<uint64_t>((delay + tick - Clock::duration(1)) / tick) : 1;
+    ticks = std::min(ticks, maxTicks);
+    add({ currentTick + ticks, std::move(callback) });
+    ++count;
+}
+
+void TimerWheel::add(Entry entry) {
+    uint64_t expiry = std::max(entry.expiry, currentTick);
+    uint64_t delta = expiry - currentTick;
+
+    if (delta <= rootMask) {
+        root[expiry & rootMask].push_back(std::move(entry));
+        return;
+    }
+    for (size_t level = 0; level < upperLevels; ++level) {
+        size_t shift = rootBits + levelBits * level;
+        if (delta < (uint64_t{ 1 } << (shift + levelBits)) || level == upperLevels - 1) {
+            levels[level][(expiry >> shift) & levelMask].push_back(std::move(entry));
+            return;
+        }
+    }
+}
+
+void TimerWheel::cascade(size_t level, size_t slot) {
+    auto entries = std::move(levels[level][slot]);
+    levels[level][slot].clear();
+    for (auto& entry : entries) {
+        add(std::move(entry));
+    }
+}
+
+void TimerWheel::advance() {
+    ++currentTick;
+    currentTime = startTime + tick * currentTick;
+
+    // Each time a level wraps, the next slot of the level above is spread
+    // over the levels below.
+    for (size_t level = 0; level < upperLevels; ++level) {
+        size_t shift = rootBits + levelBits * level;
+        if ((currentTick & ((uint64_t{ 1 } << shift) - 1)) != 0) {
+            break;
+        }
+        cascade(level, (currentTick >> shift) & levelMask);
+    }
+
+    auto due = std::move(root[currentTick & rootMask]);
+    root[currentTick & rootMask].clear();
+    count -= due.size();
+    for (auto& entry : due) {
+        entry.callback();
+    }
+}
+
+void TimerWheel::wait() {
+    timer.expires_at(startTime + tick * (currentTick + 1));
+    timer.async_wait([this](std::error_code ec) {
+        if (ec) {
+            return;
+        }
+
+        // Catch up on ticks missed while the thread was busy.
+        uint64_t targetTick = static_cast<uint64_t>((Clock::now() - startTime) / tick);
+        while (currentTick < targetTick) {
+            advance();
+        }
+        wait();
+    });
+}
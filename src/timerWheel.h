@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <asio.hpp>
+
+// Hierarchical timer wheel for the many long, mostly idle timers of leases.
+// Scheduling and expiry are O(1); a timer is never cancelled, its callback
+// checks whether it still applies. Timers are placed in a level of 256 slots
+// of one tick each and three levels of 64 coarser slots that are cascaded
+// down as time advances, covering about 77 days at the default tick. Only
+// used from the I/O thread that drives it.
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    explicit TimerWheel(asio::io_context& io_context, Clock::duration tick = std::chrono::milliseconds(100));
+    void start();
+    void schedule(Clock::duration delay, Callback callback);
+    // Time of the last tick, cheap enough to stamp every request with.
+    Clock::time_point now() const { return currentTime; }
+    size_t size() const { return count; }
+
+private:
+    struct Entry {
+        uint64_t expiry;
+        Callback callback;
+    };
+
+    static constexpr size_t rootBits = 8;
+    static constexpr size_t levelBits = 6;
+    static constexpr size_t upperLevels = 3;
+
+    void add(Entry entry);
+    void cascade(size_t level, size_t slot);
+    void advance();
+    void wait();
+
+    asio::steady_timer timer;
+    Clock::duration tick;
+    Clock::time_point startTime;
+    Clock::time_point currentTime;
+    uint64_t currentTick{ 0 };
+    size_t count{ 0 };
+    std::array<std::vector<Entry>, size_t{ 1 } << rootBits> root;
+    std::array<std::array<std::vector<Entry>, size_t{ 1 } << levelBits>, upperLevels> levels;
+
+};
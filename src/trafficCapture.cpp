@@ -0,0 +1,196 @@
+#include "trafficCapture.h"
+#include <cstring>
+#include <stdexcept>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// A file of fixed size mapped into memory for writing.
+class MappedFile {
+public:
+    MappedFile(const std::string& path, uint64_t size) : size(size) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("cannot create " + path);
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+        if (!mapping) {
+            CloseHandle(file);
+            throw std::runtime_error("cannot map " + path);
+        }
+        data = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size));
+        if (!data) {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            throw std::runtime_error("cannot map " + path);
+        }
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("cannot create " + path);
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot resize " + path);
+        }
+        void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("cannot map " + path);
+        }
+        data = static_cast<uint8_t*>(address);
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        FlushViewOfFile(data, 0);
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        msync(data, size, MS_ASYNC);
+        munmap(data, size);
+        ::close(fd);
+#endif
+    }
+
+    // Cuts the file down to the bytes actually written. Only valid after
+    // the mapping is gone, so it is done by the owner on close.
+    static void truncate(const std::string& path, uint64_t size) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER position;
+        position.QuadPart = static_cast<LONGLONG>(size);
+        SetFilePointerEx(file, position, nullptr, FILE_BEGIN);
+        SetEndOfFile(file);
+        CloseHandle(file);
+#else
+        if (::truncate(path.c_str(), static_cast<off_t>(size)) != 0) {
+            return;
+        }
+#endif
+    }
+
+    uint8_t* data{ nullptr };
+    uint64_t size;
+    std::string path;
+
+private:
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+
+};
+
+TrafficCapture::TrafficCapture() = default;
+
+TrafficCapture::~TrafficCapture() {
+    close();
+}
+
+void TrafficCapture::open(const std::string& path, uint64_t maxSize) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    dataFile = std::make_unique<MappedFile>(path, sizeof(capture::FileHeader) + maxSize);
+    dataFile->path = path;
+    uint64_t maxIndexEntries = maxSize / (capture::indexInterval * sizeof(capture::RecordHeader)) + 1;
+    indexFile = std::make_unique<MappedFile>(path + ".idx",
+        sizeof(capture::IndexHeader) + maxIndexEntries * sizeof(capture::IndexEntry));
+    indexFile->path = path + ".idx";
+
+    startTime = std::chrono::steady_clock::now();
+    auto systemTime = std::chrono::system_clock::now().time_since_epoch();
+
+    capture::FileHeader header{};
+    memcpy(header.magic, capture::fileMagic, sizeof(header.magic));
+    header.version = capture::version;
+    header.headerSize = sizeof(capture::FileHeader);
+    header.startTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(systemTime).count());
+    memcpy(dataFile->data, &header, sizeof(header));
+
+    capture::IndexHeader indexHeader{};
+    memcpy(indexHeader.magic, capture::indexMagic, sizeof(indexHeader.magic));
+    memcpy(indexFile->data, &indexHeader, sizeof(indexHeader));
+
+    droppedRecords = 0;
+    enabled = true;
+}
+
+void TrafficCapture::close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!enabled) {
+        return;
+    }
+    enabled = false;
+
+    capture::FileHeader header;
+    memcpy(&header, dataFile->data, sizeof(header));
+    capture::IndexHeader indexHeader;
+    memcpy(&indexHeader, indexFile->data, sizeof(indexHeader));
+
+    std::string dataPath = dataFile->path;
+    std::string indexPath = indexFile->path;
+    dataFile.reset();
+    indexFile.reset();
+    MappedFile::truncate(dataPath, header.headerSize + header.dataSize);
+    MappedFile::truncate(indexPath, sizeof(indexHeader) + indexHeader.entryCount * sizeof(capture::IndexEntry));
+}
+
+void TrafficCapture::record(capture::Direction direction, uint64_t sessionId, const uint8_t* data, size_t size) {
+    if (!enabled) {
+        return;
+    }
+
+    uint64_t recordSize = (sizeof(capture::RecordHeader) + size + 7) & ~uint64_t{ 7 };
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!enabled) {
+        return;
+    }
+
+    auto timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime);
+
+    auto* header = reinterpret_cast<capture::FileHeader*>(dataFile->data);
+    uint64_t offset = header->headerSize + header->dataSize;
+    if (offset + recordSize > dataFile->size) {
+        ++droppedRecords;
+        return;
+    }
+
+    capture::RecordHeader recordHeader{};
+    recordHeader.length = static_cast<uint32_t>(size);
+    recordHeader.direction = static_cast<uint8_t>(direction);
+    recordHeader.sessionId = sessionId;
+    recordHeader.timestamp = static_cast<uint64_t>(timestamp.count());
+    memcpy(dataFile->data + offset, &recordHeader, sizeof(recordHeader));
+    memcpy(dataFile->data + offset + sizeof(recordHeader), data, size);
+
+    if (header->recordCount % capture::indexInterval == 0) {
+        auto* indexHeader = reinterpret_cast<capture::IndexHeader*>(indexFile->data);
+        uint64_t indexOffset = sizeof(capture::IndexHeader) + indexHeader->entryCount * sizeof(capture::IndexEntry);
+        if (indexOffset + sizeof(capture::IndexEntry) <= indexFile->size) {
+            capture::IndexEntry entry{ recordHeader.timestamp, offset };
+            memcpy(indexFile->data + indexOffset, &entry, sizeof(entry));
+            ++indexHeader->entryCount;
+        }
+    }
+
+    // Publish the record only once it is complete, so that a capture cut
+    // short by a crash still parses up to the last full record.
+    header->dataSize += recordSize;
+    ++header->recordCount;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <atomic>
+
+// Capture file layout, shared with the replay tool. All integers are in host
+// byte order; frames are stored as received or sent, without the 4-byte
+// length prefix.
+//
+//   <path>      FileHeader, then records: RecordHeader + frame, padded to 8 bytes
+//   <path>.idx  IndexHeader, then an IndexEntry every indexInterval records
+namespace capture {
+
+constexpr char fileMagic[8] = { 'C', 'P', 'X', 'C', 'A', 'P', '0', '1' };
+constexpr char indexMagic[8] = { 'C', 'P', 'X', 'I', 'D', 'X', '0', '1' };
+constexpr uint32_t version = 1;
+constexpr uint64_t indexInterval = 256;
+
+enum class Direction : uint8_t {
+    Request = 0,
+    Response = 1,
+};
+
+#pragma pack(push, 1)
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    // Bytes of records after the header; updated after every record.
+    uint64_t dataSize;
+    uint64_t recordCount;
+    // System clock at the start of the capture, nanoseconds since the epoch.
+    uint64_t startTime;
+};
+
+struct RecordHeader {
+    uint32_t length;
+    uint8_t direction;
+    uint8_t reserved[3];
+    uint64_t sessionId;
+    // Nanoseconds since the start of the capture.
+    uint64_t timestamp;
+};
+
+struct IndexHeader {
+    char magic[8];
+    uint64_t entryCount;
+};
+
+struct IndexEntry {
+    uint64_t timestamp;
+    // Offset of the record from the start of the capture file.
+    uint64_t offset;
+};
+#pragma pack(pop)
+
+}
+
+class MappedFile;
+
+// Records request and response frames into an append-only, memory-mapped
+// capture file of fixed maximum size. Frames that do not fit are dropped.
+class TrafficCapture {
+public:
+    TrafficCapture();
+    ~TrafficCapture();
+    void open(const std::string& path, uint64_t maxSize);
+    void close();
+    bool isEnabled() const { return enabled; }
+    void record(capture::Direction direction, uint64_t sessionId, const uint8_t* data, size_t size);
+    uint64_t getDroppedRecords() const { return droppedRecords; }
+
+private:
+    std::atomic<bool> enabled{ false };
+    std::mutex mutex;
+    std::unique_ptr<MappedFile> dataFile;
+    std::unique_ptr<MappedFile> indexFile;
+    std::chrono::steady_clock::time_point startTime;
+    std::atomic<uint64_t> droppedRecords{ 0 };
+
+};
@@ -0,0 +1,340 @@
+#include "trafficMirror.h"
+#include <cstring>
+#include "casProxy.h"
+
+namespace {
+
+constexpr uint32_t maxPacketLength = 1024 * 100;
+
+casproxy::Encoding encodingOf(uint32_t capabilities) {
+    return (capabilities & casproxy::CapabilityCompactEncoding) ? casproxy::Encoding::Compact : casproxy::Encoding::V1;
+}
+
+uint64_t makeKey(uint32_t channel, uint32_t packetId) {
+    return (uint64_t{ channel } << 32) | packetId;
+}
+
+// The capabilities granted by a Hello response, which is always in version 1.
+uint32_t readGrantedCapabilities(const std::vector<uint8_t>& frame) {
+    casproxy::StreamReader reader(frame);
+    uint32_t packetId, resultCode, opcode;
+    if (!reader.readBe(packetId) || !reader.readBe(resultCode) || !reader.readBe(opcode)
+        || opcode != static_cast<uint32_t>(casproxy::Opcode::HelloRes)) {
+        return 0;
+    }
+    casproxy::HelloResponse res;
+    if (!res.unpack(packetId, resultCode, reader) || res.apiReturn != SCARD_S_SUCCESS) {
+        return 0;
+    }
+    return res.capabilities;
+}
+
+// The response without its ServerTiming trailer, which never matches.
+std::vector<uint8_t> withoutTiming(const std::vector<uint8_t>& frame, uint32_t capabilities) {
+    if (!(capabilities & casproxy::CapabilityServerTiming)) {
+        return frame;
+    }
+    return std::vector<uint8_t>(frame.begin(), frame.end() - casproxy::timingTrailerSize(frame, encodingOf(capabilities)));
+}
+
+}
+
+MirrorConnection::MirrorConnection(asio::io_context& io_context, TrafficMirror& mirror)
+    : socket(io_context), resolver(io_context), mirror(mirror), readBuffer(maxPacketLength + 4) {
+}
+
+void MirrorConnection::start() {
+    auto self = shared_from_this();
+    resolver.async_resolve(mirror.config.host, std::to_string(mirror.config.port),
+        [this, self](std::error_code ec, asio::ip::tcp::resolver::results_type results) {
+            if (stopped) {
+                return;
+            }
+            if (ec) {
+                stop(StopReason::Error);
+                return;
+            }
+
+            asio::async_connect(socket, results,
+                [this, self](std::error_code ec, const asio::ip::tcp::endpoint&) {
+                    if (stopped) {
+                        return;
+                    }
+                    if (ec) {
+                        stop(StopReason::Error);
+                        return;
+                    }
+
+                    socket.set_option(asio::ip::tcp::no_delay(true));
+                    connected = true;
+                    doRead();
+                    doWrite();
+                }
+            );
+        }
+    );
+}
+
+void MirrorConnection::request(const std::vector<uint8_t>& frame, uint32_t capabilities) {
+    if (stopped) {
+        ++mirror.droppedFrames;
+        return;
+    }
+    if (unanswered >= mirror.config.queueSize) {
+        ++mirror.droppedFrames;
+        stop(StopReason::Overflow);
+        return;
+    }
+
+    // A request that does not parse gets no response from either server.
+    casproxy::StreamReader reader(frame, encodingOf(capabilities));
+    uint32_t channel = 0, packetId, opcode;
+    if ((!(capabilities & casproxy::CapabilityChannels) || reader.readBe(channel))
+        && reader.readBe(packetId) && reader.readBe(opcode)
+        // Nor does the answer to a keepalive.
+        && !(packetId == 0 && opcode == static_cast<uint32_t>(casproxy::Opcode::PingReq))) {
+        uint64_t key = makeKey(channel, packetId);
+        if (framesSent == 0 && opcode == static_cast<uint32_t>(casproxy::Opcode::HelloReq)) {
+            helloKey = key;
+        }
+        auto [it, inserted] = exchanges.try_emplace(key);
+        it->second = Exchange{ std::chrono::steady_clock::now() };
+        it->second.capabilities = capabilities;
+        if (inserted) {
+            ++unanswered;
+        }
+    }
+
+    ++framesSent;
+    ++mirror.mirroredFrames;
+    sendQueue.push_back(casproxy::makeFrame(frame, encodingOf(capabilities)));
+    doWrite();
+}
+
+void MirrorConnection::response(uint32_t channel, uint32_t packetId, std::vector<uint8_t> frame) {
+    if (stopped) {
+        return;
+    }
+
+    uint64_t key = makeKey(channel, packetId);
+    if (helloKey == key && !primaryCapabilities) {
+        primaryCapabilities = readGrantedCapabilities(frame);
+        checkCapabilities();
+        if (stopped) {
+            return;
+        }
+    }
+
+    auto it = exchanges.find(key);
+    if (it == exchanges.end() || it->second.primaryAt) {
+        return;
+    }
+    it->second.primaryAt = std::chrono::steady_clock::now();
+    it->second.primaryFrame = std::move(frame);
+    if (it->second.shadowAt) {
+        complete(key, it->second);
+    }
+}
+
+void MirrorConnection::close() {
+    stopped = true;
+    std::error_code ignored;
+    resolver.cancel();
+    socket.close(ignored);
+    exchanges.clear();
+    sendQueue.clear();
+}
+
+void MirrorConnection::doRead() {
+    auto self = shared_from_this();
+    socket.async_read_some(asio::buffer(readBuffer.data() + readSize, readBuffer.size() - readSize),
+        [this, self](std::error_code ec, std::size_t length) {
+            if (stopped) {
+                return;
+            }
+            if (ec) {
+                stop(StopReason::Error);
+                return;
+            }
+
+            readSize += length;
+            size_t offset = 0;
+            while (!stopped) {
+                const uint8_t* bytes = readBuffer.data() + offset;
+                size_t available = readSize - offset;
+                // Frames after the response to a Hello use what the shadow granted.
+                auto encoding = encodingOf(shadowCapabilities.value_or(0));
+
+                uint32_t packetLength = 0;
+                size_t prefixSize;
+                if (encoding == casproxy::Encoding::V1) {
+                    if (available < 4) {
+                        break;
+                    }
+                    memcpy(&packetLength, bytes, 4);
+                    packetLength = casproxy::swapEndian32(packetLength);
+                    prefixSize = 4;
+                }
+                else {
+                    size_t end = 0;
+                    while (end < available && end < casproxy::compactHeaderSize && (bytes[end] & 0x80)) {
+                        ++end;
+                    }
+                    if (end == available) {
+                        break;
+                    }
+                    prefixSize = casproxy::readCompactLength(bytes, packetLength);
+                }
+                if (prefixSize == 0 || packetLength > maxPacketLength) {
+                    stop(StopReason::Error);
+                    return;
+                }
+                if (available - prefixSize < packetLength) {
+                    break;
+                }
+
+                handleShadowFrame(std::vector<uint8_t>(bytes + prefixSize, bytes + prefixSize + packetLength));
+                offset += prefixSize + packetLength;
+            }
+            if (stopped) {
+                return;
+            }
+
+            memmove(readBuffer.data(), readBuffer.data() + offset, readSize - offset);
+            readSize -= offset;
+            doRead();
+        }
+    );
+}
+
+void MirrorConnection::handleShadowFrame(std::vector<uint8_t> frame) {
+    uint32_t capabilities = shadowCapabilities.value_or(0);
+    casproxy::StreamReader reader(frame, encodingOf(capabilities));
+    uint32_t channel = 0, packetId;
+    if (((capabilities & casproxy::CapabilityChannels) && !reader.readBe(channel)) || !reader.readBe(packetId)) {
+        stop(StopReason::Error);
+        return;
+    }
+
+    uint64_t key = makeKey(channel, packetId);
+    if (helloKey == key && !shadowCapabilities) {
+        shadowCapabilities = readGrantedCapabilities(frame);
+        checkCapabilities();
+        if (stopped) {
+            return;
+        }
+    }
+
+    auto it = exchanges.find(key);
+    if (it == exchanges.end() || it->second.shadowAt) {
+        return;
+    }
+    --unanswered;
+    it->second.shadowAt = std::chrono::steady_clock::now();
+    it->second.shadowFrame = std::move(frame);
+    if (it->second.primaryAt) {
+        complete(key, it->second);
+    }
+}
+
+void MirrorConnection::checkCapabilities() {
+    // The shadow would read every later frame differently.
+    if (primaryCapabilities && shadowCapabilities && *primaryCapabilities != *shadowCapabilities) {
+        stop(StopReason::Capabilities);
+    }
+}
+
+void MirrorConnection::complete(uint64_t key, Exchange& exchange) {
+    mirror.primaryLatency.record(*exchange.primaryAt - exchange.receivedAt);
+    mirror.shadowLatency.record(*exchange.shadowAt - exchange.receivedAt);
+    if (withoutTiming(exchange.primaryFrame, exchange.capabilities) != withoutTiming(exchange.shadowFrame, exchange.capabilities)) {
+        ++mirror.mismatchedResponses;
+    }
+    exchanges.erase(key);
+}
+
+void MirrorConnection::doWrite() {
+    if (!connected || stopped || sendQueue.empty() || !writeBatch.empty()) {
+        return;
+    }
+
+    writeBatch.swap(sendQueue);
+    std::vector<asio::const_buffer> buffers;
+    buffers.reserve(writeBatch.size());
+    for (const auto& packet : writeBatch) {
+        buffers.push_back(asio::buffer(packet));
+    }
+
+    auto self = shared_from_this();
+    asio::async_write(socket, buffers,
+        [this, self](std::error_code ec, std::size_t) {
+            if (stopped) {
+                return;
+            }
+            if (ec) {
+                stop(StopReason::Error);
+                return;
+            }
+
+            writeBatch.clear();
+            doWrite();
+        }
+    );
+}
+
+void MirrorConnection::stop(StopReason reason) {
+    switch (reason) {
+    case StopReason::Overflow:
+        ++mirror.stoppedOverflow;
+        break;
+    case StopReason::Error:
+        ++mirror.stoppedError;
+        break;
+    case StopReason::Capabilities:
+        ++mirror.stoppedCapabilities;
+        break;
+    }
+    close();
+}
+
+TrafficMirror::TrafficMirror(asio::io_context& io_context) : io_context(io_context) {
+}
+
+void TrafficMirror::configure(const Config::Mirror& config) {
+    this->config = config;
+}
+
+std::shared_ptr<MirrorConnection> TrafficMirror::connect() {
+    auto connection = std::make_shared<MirrorConnection>(io_context, *this);
+    connection->start();
+    return connection;
+}
+
+void TrafficMirror::write(std::ostream& os) const {
+    if (!isEnabled()) {
+        return;
+    }
+
+    primaryLatency.write(os, "casproxy_mirror_primary_latency_seconds",
+        "Time from a mirrored request arriving to this server sending its response.");
+    shadowLatency.write(os, "casproxy_mirror_shadow_latency_seconds",
+        "Time from a mirrored request arriving to the shadow server's response arriving.");
+
+    os << "# HELP casproxy_mirror_frames_total Request frames copied to the shadow server.\n";
+    os << "# TYPE casproxy_mirror_frames_total counter\n";
+    os << "casproxy_mirror_frames_total " << mirroredFrames << "\n";
+
+    os << "# HELP casproxy_mirror_dropped_frames_total Request frames not copied to the shadow server.\n";
+    os << "# TYPE casproxy_mirror_dropped_frames_total counter\n";
+    os << "casproxy_mirror_dropped_frames_total " << droppedFrames << "\n";
+
+    os << "# HELP casproxy_mirror_mismatched_responses_total Shadow responses that differ from this server's.\n";
+    os << "# TYPE casproxy_mirror_mismatched_responses_total counter\n";
+    os << "casproxy_mirror_mismatched_responses_total " << mismatchedResponses << "\n";
+
+    os << "# HELP casproxy_mirror_stopped_total Connections no longer mirrored, by reason.\n";
+    os << "# TYPE casproxy_mirror_stopped_total counter\n";
+    os << "casproxy_mirror_stopped_total{reason=\"overflow\"} " << stoppedOverflow << "\n";
+    os << "casproxy_mirror_stopped_total{reason=\"error\"} " << stoppedError << "\n";
+    os << "casproxy_mirror_stopped_total{reason=\"capabilities\"} " << stoppedCapabilities << "\n";
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <ostream>
+#include <optional>
+#include <asio.hpp>
+#include "config.h"
+#include "metrics.h"
+
+class TrafficMirror;
+
+// The shadow connection of one client connection. Request frames are copied
+// to it as they arrive and its responses are matched by channel and packet
+// id against the ones this server sent. The first frame the shadow could not
+// take in time is dropped along with everything after it: later requests
+// would refer to handles the shadow never created. Only used from the I/O
+// thread.
+class MirrorConnection : public std::enable_shared_from_this<MirrorConnection> {
+public:
+    MirrorConnection(asio::io_context& io_context, TrafficMirror& mirror);
+    void start();
+    // A request frame without its length prefix, with the capabilities the
+    // client session had when it arrived.
+    void request(const std::vector<uint8_t>& frame, uint32_t capabilities);
+    // A response of this server, without its length prefix.
+    void response(uint32_t channel, uint32_t packetId, std::vector<uint8_t> frame);
+    void close();
+
+private:
+    struct Exchange {
+        std::chrono::steady_clock::time_point receivedAt;
+        std::optional<std::chrono::steady_clock::time_point> primaryAt;
+        std::optional<std::chrono::steady_clock::time_point> shadowAt;
+        std::vector<uint8_t> primaryFrame;
+        std::vector<uint8_t> shadowFrame;
+        uint32_t capabilities;
+    };
+
+    enum class StopReason {
+        Overflow,
+        Error,
+        Capabilities,
+    };
+
+    void doRead();
+    void handleShadowFrame(std::vector<uint8_t> frame);
+    void checkCapabilities();
+    void complete(uint64_t key, Exchange& exchange);
+    void doWrite();
+    void stop(StopReason reason);
+
+    asio::ip::tcp::socket socket;
+    asio::ip::tcp::resolver resolver;
+    TrafficMirror& mirror;
+    bool stopped{ false };
+    bool connected{ false };
+    uint64_t framesSent{ 0 };
+    // Capabilities the two servers granted in answer to a Hello.
+    std::optional<uint64_t> helloKey;
+    std::optional<uint32_t> primaryCapabilities;
+    std::optional<uint32_t> shadowCapabilities;
+    std::map<uint64_t, Exchange> exchanges;
+    // Requests the shadow has not answered yet.
+    size_t unanswered{ 0 };
+    std::vector<std::vector<uint8_t>> sendQueue;
+    std::vector<std::vector<uint8_t>> writeBatch;
+    std::vector<uint8_t> readBuffer;
+    size_t readSize{ 0 };
+
+};
+
+// Duplicates the requests of every client connection to a shadow
+// casproxyserver, so that a new build can be tried on real traffic. Shadow
+// responses are discarded once their latency is recorded next to that of
+// this server and their bytes are compared. Only used from the I/O thread.
+class TrafficMirror {
+public:
+    explicit TrafficMirror(asio::io_context& io_context);
+    void configure(const Config::Mirror& config);
+    bool isEnabled() const { return !config.host.empty(); }
+    std::shared_ptr<MirrorConnection> connect();
+    void write(std::ostream& os) const;
+
+private:
+    friend class MirrorConnection;
+
+    asio::io_context& io_context;
+    Config::Mirror config;
+    // Both from the request arriving here.
+    LatencyHistogram primaryLatency;
+    LatencyHistogram shadowLatency;
+    uint64_t mirroredFrames{ 0 };
+    uint64_t droppedFrames{ 0 };
+    uint64_t mismatchedResponses{ 0 };
+    uint64_t stoppedOverflow{ 0 };
+    uint64_t stoppedError{ 0 };
+    uint64_t stoppedCapabilities{ 0 };
+
+};
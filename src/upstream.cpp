@@ -0,0 +1,350 @@
+#include "upstream.h"
+
+namespace {
+
+constexpr auto minReconnectDelay = std::chrono::seconds(1);
+constexpr auto maxReconnectDelay = std::chrono::seconds(30);
+constexpr auto healthCheckInterval = std::chrono::seconds(5);
+constexpr auto requestTimeout = std::chrono::seconds(10);
+constexpr uint32_t maxPacketLength = 1024 * 100;
+
+}
+
+UpstreamConnection::UpstreamConnection(asio::io_context& io_context, const Config::Upstream& upstream, uint32_t capabilities)
+    : io_context(io_context), upstream(upstream), capabilities(capabilities), socket(io_context), resolver(io_context),
+    reconnectTimer(io_context), healthTimer(io_context), reconnectDelay(minReconnectDelay) {
+}
+
+void UpstreamConnection::start() {
+    connect();
+    startHealthCheck();
+}
+
+void UpstreamConnection::send(casproxy::RequestBase& req, ResponseHandler onResponse) {
+    if (!ready) {
+        onResponse(nullptr);
+        return;
+    }
+
+    write(req, std::move(onResponse));
+}
+
+void UpstreamConnection::connect() {
+    connecting = true;
+    auto self = shared_from_this();
+    resolver.async_resolve(upstream.host, std::to_string(upstream.port),
+        [this, self](std::error_code ec, asio::ip::tcp::resolver::results_type results) {
+            if (ec) {
+                scheduleReconnect();
+                return;
+            }
+
+            asio::async_connect(socket, results,
+                [this, self](std::error_code ec, const asio::ip::tcp::endpoint&) {
+                    if (ec) {
+                        scheduleReconnect();
+                        return;
+                    }
+
+                    socket.set_option(asio::ip::tcp::no_delay(true));
+                    lastActivity = std::chrono::steady_clock::now();
+                    doRead();
+                    if (capabilities) {
+                        sayHello();
+                    }
+                    else {
+                        establishContext();
+                    }
+                }
+            );
+        }
+    );
+}
+
+void UpstreamConnection::sayHello() {
+    casproxy::HelloRequest req;
+    req.capabilities = capabilities;
+
+    auto self = shared_from_this();
+    write(req, [this, self](std::shared_ptr<casproxy::ResponseBase> res) {
+        if (!res) {
+            return;
+        }
+
+        // None of the capabilities asked for here changes the encoding.
+        auto helloRes = std::dynamic_pointer_cast<casproxy::HelloResponse>(res);
+        if (!helloRes || helloRes->apiReturn != SCARD_S_SUCCESS) {
+            reset();
+            return;
+        }
+        establishContext();
+    });
+}
+
+void UpstreamConnection::establishContext() {
+    casproxy::SCardEstablishContextRequest req;
+    req.dwScope = SCARD_SCOPE_SYSTEM;
+
+    auto self = shared_from_this();
+    write(req, [this, self](std::shared_ptr<casproxy::ResponseBase> res) {
+        if (!res) {
+            return;
+        }
+
+        auto establishRes = std::dynamic_pointer_cast<casproxy::SCardEstablishContextResponse>(res);
+        if (!establishRes || establishRes->apiReturn != SCARD_S_SUCCESS) {
+            reset();
+            return;
+        }
+
+        remoteContext = establishRes->hContext;
+        ++epoch;
+        ready = true;
+        connecting = false;
+        reconnectDelay = minReconnectDelay;
+    });
+}
+
+void UpstreamConnection::doRead() {
+    auto self = shared_from_this();
+    asio::async_read(socket, asio::buffer(&packetLength, 4),
+        [this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                reset();
+                return;
+            }
+
+            packetLength = casproxy::swapEndian32(packetLength);
+            if (packetLength > maxPacketLength) {
+                reset();
+                return;
+            }
+            readPacketData();
+        }
+    );
+}
+
+void UpstreamConnection::readPacketData() {
+    packetData.resize(packetLength);
+
+    auto self = shared_from_this();
+    asio::async_read(socket, asio::buffer(packetData.data(), packetLength),
+        [this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                reset();
+                return;
+            }
+
+            lastActivity = std::chrono::steady_clock::now();
+            handlePacket();
+            if (socket.is_open()) {
+                doRead();
+            }
+        }
+    );
+}
+
+void UpstreamConnection::handlePacket() {
+    casproxy::StreamReader reader(packetData);
+
+    uint32_t packetId, resultCode, opcodeValue;
+    if (!reader.readBe(packetId) || !reader.readBe(resultCode) || !reader.readBe(opcodeValue)) {
+        reset();
+        return;
+    }
+
+    auto res = casproxy::ResponseFactory::create(static_cast<casproxy::Opcode>(opcodeValue));
+    if (!res || !res->unpack(packetId, resultCode, reader)) {
+        reset();
+        return;
+    }
+
+    auto it = pendingRequests.find(packetId);
+    if (it == pendingRequests.end()) {
+        return;
+    }
+
+    auto onResponse = std::move(it->second.onResponse);
+    pendingRequests.erase(it);
+    onResponse(res);
+}
+
+void UpstreamConnection::write(casproxy::RequestBase& req, ResponseHandler onResponse) {
+    uint32_t packetId = nextPacketId++;
+    if (nextPacketId == 0) {
+        nextPacketId = 1;
+    }
+
+    req.packetId = packetId;
+    casproxy::StreamWriter writer;
+    req.pack(writer);
+
+    uint32_t packetLength = static_cast<uint32_t>(writer.buffer.size());
+    std::vector<uint8_t> packet(packetLength + 4);
+    packetLength = casproxy::swapEndian32(packetLength);
+    memcpy(packet.data(), &packetLength, 4);
+    memcpy(packet.data() + 4, writer.buffer.data(), writer.buffer.size());
+
+    pendingRequests[packetId] = { std::move(onResponse), std::chrono::steady_clock::now() };
+    sendQueue.push_back(std::move(packet));
+    if (sendQueue.size() < 2) {
+        doWrite();
+    }
+}
+
+void UpstreamConnection::doWrite() {
+    if (sendQueue.empty()) {
+        return;
+    }
+
+    auto self = shared_from_this();
+    asio::async_write(socket, asio::buffer(sendQueue.front()),
+        [this, self](std::error_code ec, std::size_t) {
+            if (ec) {
+                reset();
+                return;
+            }
+
+            sendQueue.pop_front();
+            doWrite();
+        }
+    );
+}
+
+void UpstreamConnection::reset() {
+    if (!socket.is_open() && !ready && !connecting) {
+        return;
+    }
+
+    std::error_code ignored;
+    socket.close(ignored);
+    ready = false;
+    remoteContext = 0;
+    sendQueue.clear();
+
+    // Fail everything in flight; handlers may send new requests, which are
+    // refused while not ready.
+    auto pending = std::move(pendingRequests);
+    pendingRequests.clear();
+    for (auto& [packetId, request] : pending) {
+        request.onResponse(nullptr);
+    }
+
+    scheduleReconnect();
+}
+
+void UpstreamConnection::scheduleReconnect() {
+    connecting = false;
+    if (socket.is_open()) {
+        std::error_code ignored;
+        socket.close(ignored);
+    }
+
+    auto self = shared_from_this();
+    reconnectTimer.expires_after(reconnectDelay);
+    reconnectTimer.async_wait([this, self](std::error_code ec) {
+        if (!ec) {
+            connect();
+        }
+    });
+    reconnectDelay = std::min<std::chrono::seconds>(reconnectDelay * 2, maxReconnectDelay);
+}
+
+void UpstreamConnection::startHealthCheck() {
+    auto self = shared_from_this();
+    healthTimer.expires_after(healthCheckInterval);
+    healthTimer.async_wait([this, self](std::error_code ec) {
+        if (ec) {
+            return;
+        }
+
+        checkHealth();
+        startHealthCheck();
+    });
+}
+
+void UpstreamConnection::checkHealth() {
+    if (!ready) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& [packetId, request] : pendingRequests) {
+        if (now - request.sentAt > requestTimeout) {
+            reset();
+            return;
+        }
+    }
+
+    // Probe an idle connection so that a dead peer is noticed before a
+    // client request is sent to it.
+    if (pendingRequests.empty() && now - lastActivity >= healthCheckInterval) {
+        casproxy::SCardListReadersRequest req;
+        req.hContext = remoteContext;
+        req.readersLength = 0;
+        write(req, [](std::shared_ptr<casproxy::ResponseBase>) {});
+    }
+}
+
+Upstreams::Upstreams(asio::io_context& io_context) : io_context(io_context) {
+}
+
+void Upstreams::start(const std::vector<Config::Upstream>& upstreams) {
+    for (const auto& upstream : upstreams) {
+        Pool pool;
+        pool.upstream = &upstream;
+        for (size_t i = 0; i < upstream.connections; ++i) {
+            auto connection = std::make_shared<UpstreamConnection>(io_context, upstream);
+            connection->start();
+            pool.connections.push_back(connection);
+        }
+        pools.push_back(std::move(pool));
+    }
+}
+
+bool Upstreams::isUpstreamReader(const std::string& reader) const {
+    return findPool(reader) != nullptr;
+}
+
+std::shared_ptr<UpstreamConnection> Upstreams::pickConnection(const std::string& reader) const {
+    const Pool* pool = findPool(reader);
+    if (!pool) {
+        return nullptr;
+    }
+
+    std::shared_ptr<UpstreamConnection> best;
+    for (const auto& connection : pool->connections) {
+        if (connection->isReady() && (!best || connection->pendingCount() < best->pendingCount())) {
+            best = connection;
+        }
+    }
+    return best;
+}
+
+void Upstreams::appendReaderNames(std::vector<uint8_t>& readers) const {
+    if (!readers.empty() && readers.back() == '\0') {
+        readers.pop_back();
+    }
+
+    for (const auto& pool : pools) {
+        for (const auto& reader : pool.upstream->readers) {
+            readers.insert(readers.end(), reader.begin(), reader.end());
+            readers.push_back('\0');
+        }
+    }
+
+    if (!readers.empty()) {
+        readers.push_back('\0');
+    }
+}
+
+const Upstreams::Pool* Upstreams::findPool(const std::string& reader) const {
+    for (const auto& pool : pools) {
+        for (const auto& name : pool.upstream->readers) {
+            if (name == reader) {
+                return &pool;
+            }
+        }
+    }
+    return nullptr;
+}
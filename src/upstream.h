@@ -0,0 +1,97 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <asio.hpp>
+#include "casProxy.h"
+#include "config.h"
+
+// One pipelined connection to a remote casproxyserver. Requests from any
+// number of local sessions share it; their packet ids are remapped to ids
+// unique on this connection and responses are matched back by id. A remote
+// context is established once per connection and used for every forwarded
+// SCardConnect. Only used from the I/O thread.
+class UpstreamConnection : public std::enable_shared_from_this<UpstreamConnection> {
+public:
+    using ResponseHandler = std::function<void(std::shared_ptr<casproxy::ResponseBase>)>;
+
+    // A connection with capabilities starts with a Hello asking for them.
+    UpstreamConnection(asio::io_context& io_context, const Config::Upstream& upstream, uint32_t capabilities = 0);
+    void start();
+    // The handler is called with nullptr if the connection fails first.
+    void send(casproxy::RequestBase& req, ResponseHandler onResponse);
+    bool isReady() const { return ready; }
+    size_t pendingCount() const { return pendingRequests.size(); }
+    uint64_t getRemoteContext() const { return remoteContext; }
+    // Changes on every reconnect; remote card handles from an older epoch
+    // are no longer valid.
+    uint64_t getEpoch() const { return epoch; }
+
+private:
+    struct PendingRequest {
+        ResponseHandler onResponse;
+        std::chrono::steady_clock::time_point sentAt;
+    };
+
+    void connect();
+    void sayHello();
+    void establishContext();
+    void doRead();
+    void readPacketData();
+    void handlePacket();
+    void write(casproxy::RequestBase& req, ResponseHandler onResponse);
+    void doWrite();
+    void reset();
+    void scheduleReconnect();
+    void startHealthCheck();
+    void checkHealth();
+
+    asio::io_context& io_context;
+    const Config::Upstream& upstream;
+    uint32_t capabilities;
+    asio::ip::tcp::socket socket;
+    asio::ip::tcp::resolver resolver;
+    asio::steady_timer reconnectTimer;
+    asio::steady_timer healthTimer;
+    std::chrono::seconds reconnectDelay;
+    bool ready{ false };
+    bool connecting{ false };
+    uint64_t epoch{ 0 };
+    uint64_t remoteContext{ 0 };
+    uint32_t nextPacketId{ 1 };
+    uint32_t packetLength{ 0 };
+    std::vector<uint8_t> packetData;
+    std::map<uint32_t, PendingRequest> pendingRequests;
+    std::deque<std::vector<uint8_t>> sendQueue;
+    std::chrono::steady_clock::time_point lastActivity;
+
+};
+
+// The configured remote servers and the readers they serve.
+class Upstreams {
+public:
+    explicit Upstreams(asio::io_context& io_context);
+    void start(const std::vector<Config::Upstream>& upstreams);
+    bool empty() const { return pools.empty(); }
+    bool isUpstreamReader(const std::string& reader) const;
+    // Picks the ready connection with the fewest requests in flight.
+    std::shared_ptr<UpstreamConnection> pickConnection(const std::string& reader) const;
+    void appendReaderNames(std::vector<uint8_t>& readers) const;
+
+private:
+    struct Pool {
+        const Config::Upstream* upstream;
+        std::vector<std::shared_ptr<UpstreamConnection>> connections;
+    };
+
+    const Pool* findPool(const std::string& reader) const;
+
+    asio::io_context& io_context;
+    std::vector<Pool> pools;
+
+};
@@ -0,0 +1,145 @@
+// Compares looking up virtual handles in a std::map, as sessions used to,
+// with the SlotMap they use now, for a growing number of live handles. Each
+// round looks up handles in random order, the way requests of many tuners
+// interleave, and a share of the lookups use handles that were released.
+//
+//   casproxyhandlebench [--lookups <n>] [--max-handles <n>] [--stale <percent>]
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include "slotMap.h"
+
+namespace {
+
+struct Options {
+    size_t lookups{ 10000000 };
+    size_t maxHandles{ 65536 };
+    size_t stalePercent{ 1 };
+};
+
+// About the size of a card handle entry in a session.
+struct Value {
+    std::shared_ptr<int> context;
+    uint64_t virtualContext;
+    std::chrono::steady_clock::time_point lastUsed;
+};
+
+// Keeps the lookup loops from being optimized away.
+volatile uint64_t sink;
+
+template<typename Find>
+double measure(const std::vector<uint64_t>& handles, size_t lookups, Find find) {
+    uint64_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        found += find(handles[i % handles.size()]);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    sink = found;
+    return elapsed.count() / lookups;
+}
+
+void runRound(size_t handleCount, const Options& options, std::mt19937_64& random) {
+    std::map<uint64_t, Value> map;
+    SlotMap<Value> slots;
+    std::vector<uint64_t> mapLive, slotLive, mapStale, slotStale;
+    uint64_t nextHandle = 1;
+    auto add = [&] {
+        uint64_t mapHandle = nextHandle++;
+        map[mapHandle] = { std::make_shared<int>(0), 1, {} };
+        mapLive.push_back(mapHandle);
+        slotLive.push_back(slots.insert({ std::make_shared<int>(0), 1, {} }));
+    };
+
+    // Release a share and allocate as many again, so that the slot map has
+    // reused slots and both hold stale handles to look up.
+    size_t staleCount = handleCount * options.stalePercent / 100;
+    for (size_t i = 0; i < handleCount; ++i) {
+        add();
+    }
+    for (size_t i = 0; i < staleCount; ++i) {
+        size_t index = random() % mapLive.size();
+        map.erase(mapLive[index]);
+        slots.erase(slotLive[index]);
+        mapStale.push_back(mapLive[index]);
+        slotStale.push_back(slotLive[index]);
+        mapLive.erase(mapLive.begin() + index);
+        slotLive.erase(slotLive.begin() + index);
+    }
+    for (size_t i = 0; i < staleCount; ++i) {
+        add();
+    }
+
+    std::vector<uint64_t> mapHandles, slotHandles;
+    size_t workloadSize = std::max<size_t>(handleCount * 4, 4096);
+    for (size_t i = 0; i < workloadSize; ++i) {
+        bool stale = !mapStale.empty() && random() % 100 < options.stalePercent;
+        size_t index = random() % (stale ? mapStale.size() : mapLive.size());
+        mapHandles.push_back(stale ? mapStale[index] : mapLive[index]);
+        slotHandles.push_back(stale ? slotStale[index] : slotLive[index]);
+    }
+
+    double mapTime = measure(mapHandles, options.lookups, [&map](uint64_t handle) -> uint64_t {
+        auto it = map.find(handle);
+        return it != map.end() ? it->second.virtualContext : 0;
+    });
+    double slotTime = measure(slotHandles, options.lookups, [&slots](uint64_t handle) -> uint64_t {
+        auto value = slots.find(handle);
+        return value ? value->virtualContext : 0;
+    });
+
+    std::cout << std::setw(10) << handleCount << std::fixed << std::setprecision(1)
+        << std::setw(14) << mapTime << std::setw(14) << slotTime
+        << std::setw(10) << std::setprecision(2) << mapTime / slotTime << "x" << std::endl;
+}
+
+Options parseOptions(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        size_t value = std::stoull(argv[i + 1]);
+        if (name == "--lookups") {
+            options.lookups = value;
+        }
+        else if (name == "--max-handles") {
+            options.maxHandles = value;
+        }
+        else if (name == "--stale") {
+            options.stalePercent = std::min<size_t>(value, 100);
+        }
+        else {
+            throw std::runtime_error("Unknown option '" + name + "'");
+        }
+    }
+    if (options.lookups == 0 || options.maxHandles == 0) {
+        throw std::runtime_error("--lookups and --max-handles must be at least 1");
+    }
+    return options;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options = parseOptions(argc, argv);
+        std::mt19937_64 random(42);
+
+        std::cout << "   handles    map ns/op    slot ns/op   speedup" << std::endl;
+        for (size_t handleCount = 1; handleCount <= options.maxHandles; handleCount *= 8) {
+            runRound(handleCount, options, random);
+        }
+        return 0;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,166 @@
+// Opens many sessions against a running casproxyserver, lets each exchange
+// one frame and then go idle, and reports how much the server's resident
+// memory grew per session. Linux only: the server's RSS is read from /proc.
+//
+//   casproxyidlebench <host:port> <server pid> [--sessions <n>] [--frame-size <bytes>] [--budget <bytes>]
+//
+// Exits with status 2 when the growth per session exceeds the budget. The
+// server needs a file descriptor limit above the session count.
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+#include <sys/resource.h>
+#include <asio.hpp>
+#include "casProxy.h"
+
+namespace {
+
+struct Options {
+    std::string host;
+    std::string port;
+    std::string pid;
+    size_t sessions{ 10000 };
+    size_t frameSize{ 4096 };
+    size_t budget{ 2048 };
+};
+
+size_t readResidentBytes(const std::string& pid) {
+    std::ifstream fs("/proc/" + pid + "/status");
+    if (!fs.good()) {
+        throw std::runtime_error("Cannot read /proc/" + pid + "/status");
+    }
+
+    std::string line;
+    while (std::getline(fs, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            return std::stoull(line.substr(6)) * 1024;
+        }
+    }
+    throw std::runtime_error("No VmRSS in /proc/" + pid + "/status");
+}
+
+void raiseFileLimit(size_t sessions) {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return;
+    }
+    rlim_t wanted = static_cast<rlim_t>(sessions + 64);
+    if (limit.rlim_cur < wanted) {
+        limit.rlim_cur = std::min(wanted, limit.rlim_max);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// A transmit on a handle that does not exist: the server reads the whole
+// frame and answers it without touching a reader.
+std::vector<uint8_t> buildFrame(size_t frameSize) {
+    casproxy::SCardTransmitRequest req;
+    req.packetId = 1;
+    req.hCard = UINT64_MAX;
+    req.sendBuffer.resize(frameSize);
+    req.recvLength = 258;
+
+    casproxy::StreamWriter writer;
+    req.pack(writer);
+
+    uint32_t packetLength = casproxy::swapEndian32(static_cast<uint32_t>(writer.buffer.size()));
+    std::vector<uint8_t> packet(writer.buffer.size() + 4);
+    memcpy(packet.data(), &packetLength, 4);
+    memcpy(packet.data() + 4, writer.buffer.data(), writer.buffer.size());
+    return packet;
+}
+
+Options parseOptions(int argc, char* argv[]) {
+    if (argc < 3) {
+        throw std::runtime_error("usage: casproxyidlebench <host:port> <server pid> [--sessions <n>] [--frame-size <bytes>] [--budget <bytes>]");
+    }
+
+    Options options;
+    std::string address = argv[1];
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        throw std::runtime_error("Invalid address '" + address + "'");
+    }
+    options.host = address.substr(0, colon);
+    options.port = address.substr(colon + 1);
+    options.pid = argv[2];
+
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        size_t value = std::stoull(argv[i + 1]);
+        if (name == "--sessions") {
+            options.sessions = value;
+        }
+        else if (name == "--frame-size") {
+            options.frameSize = value;
+        }
+        else if (name == "--budget") {
+            options.budget = value;
+        }
+        else {
+            throw std::runtime_error("Unknown option '" + name + "'");
+        }
+    }
+    return options;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options = parseOptions(argc, argv);
+        raiseFileLimit(options.sessions);
+
+        asio::io_context io_context;
+        asio::ip::tcp::resolver resolver(io_context);
+        auto endpoints = resolver.resolve(options.host, options.port);
+        auto frame = buildFrame(options.frameSize);
+
+        size_t residentBefore = readResidentBytes(options.pid);
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<asio::ip::tcp::socket> sockets;
+        sockets.reserve(options.sessions);
+        std::vector<uint8_t> response;
+        for (size_t i = 0; i < options.sessions; ++i) {
+            asio::ip::tcp::socket socket(io_context);
+            asio::connect(socket, endpoints);
+            asio::write(socket, asio::buffer(frame));
+
+            uint32_t length;
+            asio::read(socket, asio::buffer(&length, 4));
+            response.resize(casproxy::swapEndian32(length));
+            asio::read(socket, asio::buffer(response));
+            sockets.push_back(std::move(socket));
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        // Let the server finish tearing down per-frame state.
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        size_t residentAfter = readResidentBytes(options.pid);
+
+        double perSession = residentAfter > residentBefore
+            ? static_cast<double>(residentAfter - residentBefore) / options.sessions : 0.0;
+        bool withinBudget = perSession <= options.budget;
+
+        std::cout << "Opened " << options.sessions << " sessions in " << std::fixed << std::setprecision(2)
+            << elapsed.count() << " s, one " << frame.size() << " byte frame each" << "\n";
+        std::cout << "Server RSS " << residentBefore / 1024 << " KiB -> " << residentAfter / 1024 << " KiB" << "\n";
+        std::cout << "Per session " << std::setprecision(0) << perSession << " bytes, budget " << options.budget
+            << " bytes: " << (withinBudget ? "PASS" : "FAIL") << std::endl;
+
+        return withinBudget ? 0 : 2;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
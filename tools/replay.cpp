@@ -0,0 +1,477 @@
+// Plays a traffic capture against a casproxyserver and compares the latency
+// distribution with the one recorded in the capture.
+//
+//   casproxyreplay <capture> <host:port> [--speed original|max|<factor>] [--from <s>] [--to <s>]
+//
+// Each captured session is replayed on its own connection. A request is sent
+// once its scaled capture time is reached and every response that preceded it
+// in the capture has arrived, so handles returned by the server line up with
+// the ones in the recorded requests. At max speed only the second condition
+// applies. Sessions that negotiated the compact encoding or channels are
+// replayed with them.
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <asio.hpp>
+#include "trafficCapture.h"
+#include "casProxy.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Request {
+    uint64_t timestamp;
+    std::vector<uint8_t> frame;
+    // Responses of the session captured before this request was.
+    size_t precedingResponses;
+    // Capabilities in effect when the request was sent.
+    uint32_t capabilities;
+};
+
+struct CapturedSession {
+    std::vector<Request> requests;
+    std::vector<std::vector<uint8_t>> responses;
+    std::vector<double> originalLatencies;
+    // Index of the first response after a Hello that granted capabilities;
+    // every frame from there on uses them.
+    size_t negotiatedFrom{ SIZE_MAX };
+    uint32_t capabilities{ 0 };
+
+    uint32_t capabilitiesAt(size_t responses) const {
+        return responses >= negotiatedFrom ? capabilities : 0;
+    }
+};
+
+struct Options {
+    std::string capturePath;
+    std::string host;
+    std::string port;
+    // 0 replays at maximum speed.
+    double speed{ 1.0 };
+    uint64_t from{ 0 };
+    uint64_t to{ UINT64_MAX };
+};
+
+struct Result {
+    std::vector<double> latencies;
+    size_t sent{ 0 };
+    size_t received{ 0 };
+    size_t mismatched{ 0 };
+    std::string error;
+};
+
+casproxy::Encoding encodingOf(uint32_t capabilities) {
+    return (capabilities & casproxy::CapabilityCompactEncoding) ? casproxy::Encoding::Compact : casproxy::Encoding::V1;
+}
+
+// Packet ids are only unique within a channel, so the channel is part of the key.
+uint64_t readPacketKey(const std::vector<uint8_t>& frame, uint32_t capabilities) {
+    casproxy::StreamReader reader(frame, encodingOf(capabilities));
+    uint32_t channel = 0, packetId;
+    if (((capabilities & casproxy::CapabilityChannels) && !reader.readBe(channel)) || !reader.readBe(packetId)) {
+        return 0;
+    }
+    return (uint64_t{ channel } << 32) | packetId;
+}
+
+// Server timing trailers differ from run to run and are left out.
+bool sameResponse(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b, uint32_t capabilities) {
+    if (!(capabilities & casproxy::CapabilityServerTiming)) {
+        return a == b;
+    }
+    auto encoding = encodingOf(capabilities);
+    size_t aSize = a.size() - casproxy::timingTrailerSize(a, encoding);
+    size_t bSize = b.size() - casproxy::timingTrailerSize(b, encoding);
+    return aSize == bSize && std::equal(a.begin(), a.begin() + aSize, b.begin());
+}
+
+// Keepalive pings of the server and their answers come at times of their
+// own, so they are neither replayed nor waited for.
+bool isKeepalive(const std::vector<uint8_t>& frame, uint32_t capabilities, bool response) {
+    if (!(capabilities & casproxy::CapabilityKeepalive)) {
+        return false;
+    }
+    casproxy::StreamReader reader(frame, encodingOf(capabilities));
+    uint32_t channel = 0, packetId, resultCode, opcode;
+    if (((capabilities & casproxy::CapabilityChannels) && !reader.readBe(channel)) || !reader.readBe(packetId)
+        || (response && !reader.readBe(resultCode)) || !reader.readBe(opcode)) {
+        return false;
+    }
+    auto ping = response ? casproxy::Opcode::PingRes : casproxy::Opcode::PingReq;
+    return packetId == 0 && opcode == static_cast<uint32_t>(ping);
+}
+
+uint32_t readRequestOpcode(const std::vector<uint8_t>& frame) {
+    casproxy::StreamReader reader(frame);
+    uint32_t packetId, opcode;
+    if (!reader.readBe(packetId) || !reader.readBe(opcode)) {
+        return 0;
+    }
+    return opcode;
+}
+
+uint32_t readGrantedCapabilities(const std::vector<uint8_t>& frame) {
+    casproxy::StreamReader reader(frame);
+    uint32_t packetId, resultCode, opcode;
+    if (!reader.readBe(packetId) || !reader.readBe(resultCode) || !reader.readBe(opcode)
+        || opcode != static_cast<uint32_t>(casproxy::Opcode::HelloRes)) {
+        return 0;
+    }
+    casproxy::HelloResponse res;
+    if (!res.unpack(packetId, resultCode, reader) || res.apiReturn != SCARD_S_SUCCESS) {
+        return 0;
+    }
+    return res.capabilities;
+}
+
+std::vector<uint8_t> readFile(const std::string& path) {
+    std::ifstream fs(path, std::ios::binary);
+    if (!fs.good()) {
+        throw std::runtime_error("Cannot open '" + path + "'");
+    }
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(fs), std::istreambuf_iterator<char>());
+}
+
+// Finds where to start reading for the given capture time using the sparse
+// index, falling back to the first record without one.
+uint64_t findStartOffset(const std::string& path, uint64_t timestamp, uint64_t firstOffset) {
+    std::ifstream fs(path + ".idx", std::ios::binary);
+    capture::IndexHeader header;
+    if (!fs.read(reinterpret_cast<char*>(&header), sizeof(header))
+        || memcmp(header.magic, capture::indexMagic, sizeof(header.magic)) != 0) {
+        return firstOffset;
+    }
+
+    uint64_t offset = firstOffset;
+    capture::IndexEntry entry;
+    for (uint64_t i = 0; i < header.entryCount && fs.read(reinterpret_cast<char*>(&entry), sizeof(entry)); ++i) {
+        if (entry.timestamp > timestamp) {
+            break;
+        }
+        offset = entry.offset;
+    }
+    return offset;
+}
+
+std::map<uint64_t, CapturedSession> loadCapture(const Options& options) {
+    auto data = readFile(options.capturePath);
+    capture::FileHeader header;
+    if (data.size() < sizeof(header)) {
+        throw std::runtime_error("Capture file is truncated");
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, capture::fileMagic, sizeof(header.magic)) != 0 || header.version != capture::version) {
+        throw std::runtime_error("Not a capture file or unsupported version");
+    }
+
+    uint64_t end = std::min<uint64_t>(header.headerSize + header.dataSize, data.size());
+    uint64_t offset = findStartOffset(options.capturePath, options.from, header.headerSize);
+
+    // Sessions already open before the window are skipped: their requests
+    // refer to handles the replay would never have created.
+    std::map<uint64_t, CapturedSession> sessions;
+    std::map<uint64_t, bool> skippedSessions;
+    std::map<uint64_t, std::map<uint64_t, std::deque<uint64_t>>> pendingTimestamps;
+    std::map<uint64_t, uint64_t> pendingHellos;
+    while (offset + sizeof(capture::RecordHeader) <= end) {
+        capture::RecordHeader record;
+        memcpy(&record, data.data() + offset, sizeof(record));
+        uint64_t recordSize = (sizeof(record) + record.length + 7) & ~uint64_t{ 7 };
+        if (offset + sizeof(record) + record.length > end) {
+            break;
+        }
+        const uint8_t* frame = data.data() + offset + sizeof(record);
+        offset += recordSize;
+
+        if (record.timestamp > options.to) {
+            break;
+        }
+        if (record.timestamp < options.from) {
+            skippedSessions[record.sessionId] = true;
+            continue;
+        }
+        if (skippedSessions.count(record.sessionId)) {
+            continue;
+        }
+
+        auto& session = sessions[record.sessionId];
+        std::vector<uint8_t> bytes(frame, frame + record.length);
+        uint32_t capabilities = session.capabilitiesAt(session.responses.size());
+        bool isRequest = record.direction == static_cast<uint8_t>(capture::Direction::Request);
+        if (isKeepalive(bytes, capabilities, !isRequest)) {
+            continue;
+        }
+        uint64_t packetKey = readPacketKey(bytes, capabilities);
+        if (isRequest) {
+            if (capabilities == 0 && readRequestOpcode(bytes) == static_cast<uint32_t>(casproxy::Opcode::HelloReq)) {
+                pendingHellos[record.sessionId] = packetKey;
+            }
+            session.requests.push_back({ record.timestamp, std::move(bytes), session.responses.size(), capabilities });
+            pendingTimestamps[record.sessionId][packetKey].push_back(record.timestamp);
+        }
+        else {
+            auto hello = pendingHellos.find(record.sessionId);
+            if (hello != pendingHellos.end() && hello->second == packetKey) {
+                session.capabilities = readGrantedCapabilities(bytes);
+                if (session.capabilities != 0) {
+                    session.negotiatedFrom = session.responses.size() + 1;
+                }
+                pendingHellos.erase(hello);
+            }
+            auto& pending = pendingTimestamps[record.sessionId][packetKey];
+            if (!pending.empty()) {
+                session.originalLatencies.push_back((record.timestamp - pending.front()) / 1000.0);
+                pending.pop_front();
+            }
+            session.responses.push_back(std::move(bytes));
+        }
+    }
+    return sessions;
+}
+
+bool readFrame(asio::ip::tcp::socket& socket, std::vector<uint8_t>& frame, casproxy::Encoding encoding) {
+    std::error_code ec;
+    if (encoding == casproxy::Encoding::Compact) {
+        uint8_t header[casproxy::compactHeaderSize];
+        asio::read(socket, asio::buffer(header), ec);
+        uint32_t length;
+        size_t prefixSize = ec ? 0 : casproxy::readCompactLength(header, length);
+        if (prefixSize == 0 || length < sizeof(header) - prefixSize) {
+            return false;
+        }
+        frame.assign(header + prefixSize, header + sizeof(header));
+        frame.resize(length);
+        asio::read(socket, asio::buffer(frame.data() + sizeof(header) - prefixSize, length - (sizeof(header) - prefixSize)), ec);
+        return !ec;
+    }
+
+    uint8_t lengthBytes[4];
+    asio::read(socket, asio::buffer(lengthBytes), ec);
+    if (ec) {
+        return false;
+    }
+    uint32_t length = (uint32_t(lengthBytes[0]) << 24) | (uint32_t(lengthBytes[1]) << 16)
+        | (uint32_t(lengthBytes[2]) << 8) | lengthBytes[3];
+    frame.resize(length);
+    asio::read(socket, asio::buffer(frame), ec);
+    return !ec;
+}
+
+void replaySession(const Options& options, const CapturedSession& session, uint64_t captureStart,
+    Clock::time_point replayStart, Result& result) {
+    asio::io_context io_context;
+    asio::ip::tcp::socket socket(io_context);
+    try {
+        asio::ip::tcp::resolver resolver(io_context);
+        asio::connect(socket, resolver.resolve(options.host, options.port));
+        socket.set_option(asio::ip::tcp::no_delay(true));
+    }
+    catch (const std::exception& e) {
+        result.error = e.what();
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<uint64_t, std::deque<Clock::time_point>> sentAt;
+    size_t received = 0;
+    bool failed = false;
+
+    std::thread reader([&] {
+        std::vector<uint8_t> frame;
+        while (true) {
+            uint32_t capabilities = session.capabilitiesAt(received);
+            bool ok = readFrame(socket, frame, encodingOf(capabilities));
+            auto now = Clock::now();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok) {
+                failed = true;
+                cv.notify_all();
+                return;
+            }
+            if (isKeepalive(frame, capabilities, true)) {
+                continue;
+            }
+
+            auto& pending = sentAt[readPacketKey(frame, capabilities)];
+            if (!pending.empty()) {
+                result.latencies.push_back(std::chrono::duration<double, std::micro>(now - pending.front()).count());
+                pending.pop_front();
+            }
+            if (received < session.responses.size() && !sameResponse(frame, session.responses[received], capabilities)) {
+                ++result.mismatched;
+            }
+            ++received;
+            cv.notify_all();
+            if (received == session.responses.size()) {
+                return;
+            }
+        }
+    });
+
+    for (const auto& request : session.requests) {
+        if (options.speed > 0) {
+            auto offset = std::chrono::nanoseconds(static_cast<int64_t>((request.timestamp - captureStart) / options.speed));
+            std::this_thread::sleep_until(replayStart + offset);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return failed || received >= request.precedingResponses; });
+        if (failed) {
+            break;
+        }
+
+        auto packet = casproxy::makeFrame(request.frame, encodingOf(request.capabilities));
+        sentAt[readPacketKey(request.frame, request.capabilities)].push_back(Clock::now());
+        lock.unlock();
+
+        std::error_code ec;
+        asio::write(socket, asio::buffer(packet), ec);
+        if (ec) {
+            break;
+        }
+        ++result.sent;
+    }
+
+    // Give the server a moment to answer what is still in flight.
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_for(lock, std::chrono::seconds(10), [&] { return failed || received >= session.responses.size(); });
+    }
+    std::error_code ignored;
+    socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+    socket.close(ignored);
+    reader.join();
+    result.received = received;
+}
+
+void printDistribution(const std::string& name, std::vector<double> values) {
+    std::cout << std::left << std::setw(10) << name << std::right;
+    if (values.empty()) {
+        std::cout << "  no samples" << "\n";
+        return;
+    }
+
+    std::sort(values.begin(), values.end());
+    auto percentile = [&](double p) {
+        size_t index = static_cast<size_t>(p * (values.size() - 1));
+        return values[index];
+    };
+    std::cout << std::fixed << std::setprecision(1)
+        << std::setw(10) << values.size()
+        << std::setw(12) << percentile(0.50)
+        << std::setw(12) << percentile(0.90)
+        << std::setw(12) << percentile(0.99)
+        << std::setw(12) << percentile(0.999)
+        << std::setw(12) << values.back() << "\n";
+}
+
+Options parseOptions(int argc, char* argv[]) {
+    if (argc < 3) {
+        throw std::runtime_error("usage: casproxyreplay <capture> <host:port> [--speed original|max|<factor>] [--from <s>] [--to <s>]");
+    }
+
+    Options options;
+    options.capturePath = argv[1];
+    std::string address = argv[2];
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        throw std::runtime_error("Invalid address '" + address + "'");
+    }
+    options.host = address.substr(0, colon);
+    options.port = address.substr(colon + 1);
+
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        std::string value = argv[i + 1];
+        if (name == "--speed") {
+            options.speed = value == "original" ? 1.0 : value == "max" ? 0.0 : std::stod(value);
+        }
+        else if (name == "--from") {
+            options.from = static_cast<uint64_t>(std::stod(value) * 1e9);
+        }
+        else if (name == "--to") {
+            options.to = static_cast<uint64_t>(std::stod(value) * 1e9);
+        }
+        else {
+            throw std::runtime_error("Unknown option '" + name + "'");
+        }
+    }
+    return options;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options = parseOptions(argc, argv);
+        auto sessions = loadCapture(options);
+
+        uint64_t captureStart = UINT64_MAX;
+        size_t requestCount = 0;
+        for (const auto& [id, session] : sessions) {
+            if (!session.requests.empty()) {
+                captureStart = std::min(captureStart, session.requests.front().timestamp);
+            }
+            requestCount += session.requests.size();
+        }
+        std::cout << "Replaying " << requestCount << " requests from " << sessions.size() << " sessions" << std::endl;
+
+        std::vector<Result> results(sessions.size());
+        std::vector<std::thread> threads;
+        auto replayStart = Clock::now();
+        size_t index = 0;
+        for (const auto& [id, session] : sessions) {
+            threads.emplace_back(replaySession, std::cref(options), std::cref(session), captureStart,
+                replayStart, std::ref(results[index++]));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        std::chrono::duration<double> elapsed = Clock::now() - replayStart;
+
+        std::vector<double> original, replayed;
+        size_t sent = 0, received = 0, mismatched = 0, failedSessions = 0;
+        for (const auto& [id, session] : sessions) {
+            original.insert(original.end(), session.originalLatencies.begin(), session.originalLatencies.end());
+        }
+        for (const auto& result : results) {
+            replayed.insert(replayed.end(), result.latencies.begin(), result.latencies.end());
+            sent += result.sent;
+            received += result.received;
+            mismatched += result.mismatched;
+            if (!result.error.empty()) {
+                ++failedSessions;
+                std::cerr << "Session failed: " << result.error << "\n";
+            }
+        }
+
+        std::cout << "Sent " << sent << ", received " << received << ", differing from capture " << mismatched
+            << ", failed sessions " << failedSessions << ", " << std::fixed << std::setprecision(2)
+            << elapsed.count() << " s" << "\n\n";
+        std::cout << std::left << std::setw(10) << "latency" << std::right
+            << std::setw(10) << "count" << std::setw(12) << "p50 us" << std::setw(12) << "p90 us"
+            << std::setw(12) << "p99 us" << std::setw(12) << "p99.9 us" << std::setw(12) << "max us" << "\n";
+        printDistribution("original", original);
+        printDistribution("replay", replayed);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Measures how long a task waits between being queued for a card worker and
+// the worker starting on it, with the mutex and condition variable queue card
+// workers used before and with the TaskQueue they use now. A producer queues
+// tasks at a fixed interval, as the I/O thread does at a steady ECM rate, and
+// the worker busy-waits for a while on each, as if talking to the card.
+//
+//   casproxytaskqueuebench [--tasks <n>] [--interval <us>] [--work <us>]
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include "taskQueue.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    size_t tasks{ 20000 };
+    std::chrono::microseconds interval{ 100 };
+    std::chrono::microseconds work{ 10 };
+};
+
+struct Task {
+    Clock::time_point queuedAt;
+    bool last{ false };
+};
+
+// What CardContext did before: a vector under a mutex, swapped out whole by
+// the worker, which sleeps on a condition variable whenever it is empty.
+class MutexQueue {
+public:
+    void push(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(task);
+        }
+        cv.notify_one();
+    }
+
+    void popAll(std::vector<Task>& batch) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !tasks.empty(); });
+        batch.swap(tasks);
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Task> tasks;
+};
+
+class LockFreeQueue {
+public:
+    void push(Task task) {
+        while (!tasks.push(std::move(task))) {
+            std::this_thread::yield();
+        }
+    }
+
+    void popAll(std::vector<Task>& batch) {
+        tasks.wait([] { return false; });
+        tasks.popAll(batch);
+    }
+
+private:
+    TaskQueue<Task> tasks{ 256 };
+};
+
+void busyWait(std::chrono::microseconds duration) {
+    auto until = Clock::now() + duration;
+    while (Clock::now() < until) {
+    }
+}
+
+template<typename Queue>
+void runRound(const char* name, const Options& options) {
+    Queue queue;
+    std::vector<double> latencies;
+    latencies.reserve(options.tasks);
+
+    std::clock_t cpuStart = std::clock();
+    std::thread worker([&] {
+        std::vector<Task> batch;
+        for (;;) {
+            queue.popAll(batch);
+            for (const auto& task : batch) {
+                std::chrono::duration<double, std::micro> latency = Clock::now() - task.queuedAt;
+                latencies.push_back(latency.count());
+                if (task.last) {
+                    return;
+                }
+                busyWait(options.work);
+            }
+            batch.clear();
+        }
+    });
+
+    auto next = Clock::now();
+    for (size_t i = 0; i < options.tasks; ++i) {
+        next += options.interval;
+        while (Clock::now() < next) {
+            std::this_thread::sleep_until(next);
+        }
+        queue.push({ Clock::now(), i + 1 == options.tasks });
+    }
+    worker.join();
+    double cpuMilliseconds = 1000.0 * (std::clock() - cpuStart) / CLOCKS_PER_SEC;
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(1)
+        << std::setw(10) << percentile(0.5) << std::setw(10) << percentile(0.99)
+        << std::setw(10) << percentile(0.999) << std::setw(10) << latencies.back()
+        << std::setw(12) << std::setprecision(0) << cpuMilliseconds << std::endl;
+}
+
+Options parseOptions(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        size_t value = std::stoull(argv[i + 1]);
+        if (name == "--tasks") {
+            options.tasks = value;
+        }
+        else if (name == "--interval") {
+            options.interval = std::chrono::microseconds(value);
+        }
+        else if (name == "--work") {
+            options.work = std::chrono::microseconds(value);
+        }
+        else {
+            throw std::runtime_error("Unknown option '" + name + "'");
+        }
+    }
+    if (options.tasks == 0) {
+        throw std::runtime_error("--tasks must be at least 1");
+    }
+    return options;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        Options options = parseOptions(argc, argv);
+
+        std::cout << "queue        p50 us    p99 us  p99.9 us    max us      cpu ms" << std::endl;
+        runRound<MutexQueue>("mutex", options);
+        runRound<LockFreeQueue>("lock-free", options);
+        return 0;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}